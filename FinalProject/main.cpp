@@ -4,10 +4,25 @@
  */
 
 #include <iostream> // cout, cerr
+#include <cassert> // assert
 #include <cstdlib> // EXIT_FAILURE
+#include <cstring> // strcmp
+#include <filesystem> // create_directories
+#include <fstream> // ifstream, ofstream
+#include <chrono> // steady_clock
+#include <array> // array
+#include <atomic> // atomic
+#include <mutex> // mutex, lock_guard
+#include <thread> // thread
 #include <GL/glew.h> // GLEW library
 #include <GLFW/glfw3.h> // GLFW library
 #include <numbers> // pi
+#include <random> // mt19937
+#include <sstream> // istringstream
+#include <memory> // shared_ptr, weak_ptr
+#include <string> // string, to_string
+#include <unordered_map> // unordered_map
+#include <vector> // vector
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h> // Image loading Utility functions
 
@@ -16,15 +31,28 @@
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include "bvh.h" // Ray and frustum queries
 #include "camera.h" // Camera class
+#include "image_compare.h" // Image differences
+#include "light_clusters.h" // Clustered light lists
+#include "lightmap.h" // Lightmap atlas layout and baking
+#include "mesh_generators.h" // Procedural mesh generators
+#include "mesh_simplifier.h" // Level of detail generation
+#include "mesh_tables.h" // Compile time mesh tables
+#include "mesh_validation.h" // Winding checks
+#include "meshlets.h" // Meshlet building and culling
+#include "sh_probes.h" // Spherical harmonic light probes
+#include "staging_arena.h" // Temporary mesh memory
+#include "thread_pool.h" // Worker threads
+
+#ifdef __linux__
+#include <poll.h> // poll
+#include <sys/inotify.h> // inotify_init1, inotify_add_watch
+#include <unistd.h> // read, close
+#endif
 
 using namespace std; // Standard namespace
 
-/* Shader program Macro */
-#ifndef GLSL
-#define GLSL(Version, Source) "#version " #Version " core \n" #Source
-#endif
-
 // Unnamed namespace
 namespace
 {
@@ -35,24 +63,280 @@ namespace
     const int WINDOW_WIDTH = 800;
     const int WINDOW_HEIGHT = 600;
 
+    // Meshes are drawn with 16 bit indices
+    const int MAX_MESH_VERTICES = 65536;
+
+    // Longest per object light list passed with a draw, the size of objectLights in the lighting shader source
+    const int MAX_OBJECT_LIGHTS = 16;
+
+    // Depth range of the projections
+    const float NEAR_PLANE = 0.1f;
+    const float FAR_PLANE = 100.0f;
+
+    // Lights that can cast shadows at once, and the size of each face of their cube shadow maps
+    const int MAX_SHADOW_LIGHTS = 4;
+    const int SHADOW_MAP_SIZE = 512;
+
+    // Fixed meshes of the scene, built by the compiler
+    constexpr auto CUBE_TABLE = UCubeTable();
+    constexpr auto WEDGE_TABLE = UCubeTable(0.4f, 1.0f);
+    constexpr auto PLANE_TABLE = UPlaneTable();
+    constexpr auto PLANE_ANGLED_TABLE = UPlaneTable(0.4f, 1.0f);
+    constexpr auto PYRAMID_TABLE = UPyramidTable();
+
+    // Every triangle of the fixed meshes must face outwards for back face culling
+    static_assert(UCheckWinding(CUBE_TABLE).flipped == 0, "Cube triangles must be counter clockwise");
+    static_assert(UCheckWinding(WEDGE_TABLE).flipped == 0, "Wedge triangles must be counter clockwise");
+    static_assert(UCheckWinding(PLANE_TABLE).flipped == 0, "Plane triangles must be counter clockwise");
+    static_assert(UCheckWinding(PLANE_ANGLED_TABLE).flipped == 0, "Angled plane triangles must be counter clockwise");
+    static_assert(UCheckWinding(PYRAMID_TABLE).flipped == 0, "Pyramid triangles must be counter clockwise");
+
     // Stores the GL data relative to a given mesh
     struct GLMesh
     {
         GLuint vao; // Handle for the vertex array object
         GLuint vbos[2]; // Handles for the vertex buffer objects
         GLuint nIndices; // Number of indices of the mesh
+        GLuint nVertices; // Number of unique vertices of the mesh
+        glm::vec3 boundsMin; // Corners of the mesh's bounding box
+        glm::vec3 boundsMax;
+        bool indexed; // Whether the mesh is drawn with its index buffer
+        bool twoSided; // Whether both sides can be seen, so the mesh is drawn without back face culling
+        GLsizeiptr nBytes; // GPU memory used by the mesh's buffers
+        std::vector<Meshlet> meshlets; // Clusters of the index buffer, culled before drawing when present
+        MeshBvh bvh; // The mesh's triangles, for ray queries
+    };
+
+    // Layout of a glMultiDrawElementsIndirect command
+    struct DrawElementsIndirectCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    // Stores the levels of detail of a mesh, finest first, with the accumulated quadric error of each
+    struct GLMeshLods
+    {
+        std::vector<GLMesh> levels;
+        std::vector<float> quadricErrors;
+    };
+
+    // Procedural generators of the shared meshes
+    enum MeshGenerator
+    {
+        MESH_CUBE, // front height, back height
+        MESH_PLANE, // front height, back height
+        MESH_PYRAMID,
+        MESH_CYLINDER, // slices
+        MESH_UV_SPHERE, // complexity
+        MESH_ICO_SPHERE, // subdivisions
+        MESH_CUBE_SPHERE // divisions
+    };
+
+    // Identifies a generated mesh by its generator and parameters
+    struct MeshKey
+    {
+        MeshGenerator generator;
+        float params[2];
+
+        bool operator==(const MeshKey& other) const
+        {
+            return generator == other.generator && params[0] == other.params[0] && params[1] == other.params[1];
+        }
+    };
+
+    struct MeshKeyHash
+    {
+        size_t operator()(const MeshKey& key) const
+        {
+            size_t seed = std::hash<int>()(key.generator);
+            for (float param : key.params)
+            {
+                seed ^= std::hash<float>()(param) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            }
+            return seed;
+        }
+    };
+
+    // Every generated mesh in use, so objects with the same shape share one GPU copy.
+    // A mesh is destroyed when the last object holding it lets go of it.
+    struct MeshRegistry
+    {
+        std::unordered_map<MeshKey, std::weak_ptr<GLMesh>, MeshKeyHash> meshes;
+        unsigned int requests = 0; // Meshes asked for
+        unsigned int uploads = 0; // Meshes actually generated and uploaded
+        GLsizeiptr bytesUploaded = 0;
+        GLsizeiptr bytesSaved = 0; // Memory the shared requests would have uploaded again
+    };
+
+    // Low order patches the tessellation shaders refine into a smooth shape
+    enum PatchShape
+    {
+        PATCH_NONE,
+        PATCH_SPHERE, // Octahedron of triangles pushed onto the unit sphere
+        PATCH_CYLINDER // Quads in angle, height and radius around the z axis
+    };
+
+    // Stores the GL data of a patch mesh
+    struct GLPatchMesh
+    {
+        GLuint vao;
+        GLuint vbo;
+        GLint verticesPerPatch;
+        GLsizei nVertices;
+    };
+
+    // Triangles and GPU time spent on the round objects. Queries are read a frame late so waiting on them doesn't stall.
+    struct RoundObjectStats
+    {
+        GLuint primitivesQueries[2];
+        GLuint timeQueries[2];
+        unsigned int frame = 0;
+        GLuint64 triangles = 0; // Totals since the last report
+        GLuint64 nanoseconds = 0;
+        GLuint64 meshletTriangles = 0; // Triangles of the meshlets drawn and of all meshlets considered
+        GLuint64 meshletTrianglesTotal = 0;
+        unsigned int frames = 0;
+        float lastReport = 0.0f;
+    };
+
+    // GPU time of the scene's shading, from the first draw to the last lit pixel, measured with timestamps so the
+    // round object queries can run inside it. Read a frame late like the round object stats.
+    struct ShadingStats
+    {
+        GLuint timestampQueries[2][2]; // Start and end of each of the last two frames
+        unsigned int frame = 0;
+        GLuint64 nanoseconds = 0; // Total since the last report
+        unsigned int frames = 0;
+        float lastReport = 0.0f;
+    };
+
+    // Render targets of the deferred path: surface color, normal and depth of the nearest surface at each pixel
+    struct GBuffer
+    {
+        GLuint fbo;
+        GLuint albedo; // RGBA8 texture color
+        GLuint normal; // RG16 octahedral normal
+        GLuint depth;
+        int width;
+        int height;
+    };
+
+    // A textured object of the scene
+    struct SceneObject
+    {
+        const char* name;
+        std::shared_ptr<GLMesh> mesh;
+        const GLMeshLods* lods; // Levels of detail drawn instead of the mesh, when set
+        GLuint textureId;
+        glm::vec2 uvScale;
+        glm::mat4 model;
+        glm::vec2 shapeHeights = glm::vec2(1.0f); // Front and back height applied to the mesh in the vertex shader
+        PatchShape patchShape = PATCH_NONE; // Shape drawn instead of the mesh when tessellating
+        bool dynamic = false; // Moves, so it is drawn on its own and casts its shadows into the per frame shadow maps
+        glm::vec4 lightmap = glm::vec4(0.0f); // Scale and offset of the object's part of the lightmap atlas, zero without one
+    };
+
+    // A point light of the scene, with the lamp marker drawn at it
+    struct SceneLight
+    {
+        glm::vec3 position;
+        glm::vec3 color;
+        float ambientStrength;
+        float specularIntensity = 0.1f;
+        float highlightSize = 16.0f;
+        float markerScale = 0.3f;
+        glm::vec3 orbitAxis = glm::vec3(0.0f); // Axis the light circles the origin around while lights orbit, none when zero
+        float range = 0.0f; // Distance the light reaches, 0 for everywhere
+        bool castsShadows = false;
+    };
+
+    // A light as the shaders read it from the light buffer (std430 layout)
+    struct GLLight
+    {
+        glm::vec4 positionScale; // Position, and the scale of the lamp marker
+        glm::vec4 colorAmbient; // Color, and the ambient strength
+        glm::vec4 specular; // Intensity, highlight size, range and shadow map (-1 for none)
+    };
+
+    // Cube shadow maps of the lights that cast shadows, one cube per light in a cube map array. Static casters are
+    // cached and only drawn again when their light moves; dynamic casters are drawn every frame into maps of their own.
+    struct ShadowMaps
+    {
+        GLuint fbo;
+        GLuint staticMaps;
+        GLuint dynamicMaps;
+        std::vector<int> lights; // Light of each cube
+        std::vector<glm::vec3> renderedPositions; // Where each cube's light was when its static casters were drawn
+        bool hasDynamicCasters = false;
+    };
+
+    // Per instance vertex attributes of an instanced draw
+    struct InstanceData
+    {
+        glm::mat4 model;
+        glm::vec2 shapeHeights;
+        glm::vec4 lightmap;
+    };
+
+    // Scene objects with the same mesh, texture and texture scale, drawn in one instanced call
+    struct GLInstanceBatch
+    {
+        GLuint vao; // Reads the shared mesh's buffers and the instance buffer
+        GLuint instanceVbo;
+        std::shared_ptr<GLMesh> mesh;
+        GLuint textureId;
+        glm::vec2 uvScale;
+        GLsizei nInstances;
+        std::vector<unsigned int> objects; // Scene objects drawn as the instances
     };
 
     // Main GLFW window
     GLFWwindow* gWindow = nullptr;
-    // Mesh data
-    GLMesh gCubeMesh;
-    GLMesh gCylinderMesh;
-    GLMesh gPlaneMesh;
-    GLMesh gPlaneAngledMesh;
-    GLMesh gPyramidMesh;
-    GLMesh gSphereMesh;
-    GLMesh gWedgeMesh;
+    // Size of the window's framebuffer in pixels, larger than the window on high DPI screens and updated on resize
+    int gFramebufferWidth = WINDOW_WIDTH;
+    int gFramebufferHeight = WINDOW_HEIGHT;
+    // Worker threads for procedural generation
+    ThreadPool gThreadPool;
+    // Reused memory that generated meshes are built in before upload
+    StagingArena gStagingArena;
+    MeshData gStagingMesh;
+    // Shared mesh data
+    MeshRegistry gMeshRegistry;
+    // Scene objects and the mesh of the lamps
+    std::vector<SceneObject> gSceneObjects;
+    std::vector<GLInstanceBatch> gInstanceBatches;
+    std::shared_ptr<GLMesh> gLampMesh;
+    // Sphere tessellation used by each round object
+    SphereType gHomePodSphereType = SPHERE_ICO;
+    SphereType gMouseSphereType = SPHERE_ICO;
+    SphereType gLampSphereType = SPHERE_ICO;
+    // Levels of detail for the round objects, chosen by their projected error on screen
+    GLMeshLods gSphereLods;
+    bool gUseMeshLods = true;
+    // Draw wedges and angled planes as the cube and plane with their heights changed in the vertex shader
+    bool gUseParametricShapes = true;
+    // Tessellate the round objects on the GPU from patches, falling back to the levels of detail when unsupported
+    GLPatchMesh gSpherePatches;
+    GLPatchMesh gCylinderPatches;
+    bool gTessellationAvailable = false;
+    bool gUseTessellation = false;
+    float gTessPixelsPerEdge = 8.0f; // Target length of a tessellated edge on screen
+    GLint gMaxTessLevel = 64;
+    RoundObjectStats gRoundObjectStats;
+    // Skip the meshlets of detailed meshes that face away from the camera or are out of view
+    bool gUseMeshletCulling = true;
+    GLuint gIndirectBuffer;
+    std::vector<DrawElementsIndirectCommand> gIndirectCommands;
+    // Skip the triangles facing away from the camera
+    bool gCullBackFaces = true;
+    // Tree over the world bounds of the scene objects followed by the lamps, for picking and view culling
+    Bvh gSceneBvh;
+    std::vector<Aabb> gSceneBounds;
+    std::vector<bool> gVisibleObjects; // Scene objects in the view this frame
     // Textures
     GLuint gDeskTextureId;
     GLuint gMeshFabricTextureId;
@@ -67,6 +351,193 @@ namespace
     // Shader programs
     GLuint gProgramId;
     GLuint gLampProgramId;
+    GLuint gSphereTessProgramId;
+    GLuint gCylinderTessProgramId;
+    GLuint gGBufferProgramId;
+    GLuint gSphereGBufferProgramId;
+    GLuint gCylinderGBufferProgramId;
+    GLuint gDeferredLightingProgramId;
+    GLuint gShadowProgramId;
+
+    // Shader sources, read from the files in SHADER_DIRECTORY at startup and again whenever one of them changes. The
+    // stages are also compiled to SPIR-V at build time by compile_spirv.bat (compile_spirv.sh with the Makefile), into
+    // SPIRV_DIRECTORY.
+    enum ShaderFile
+    {
+        SHADER_SCENE_VERT,
+        SHADER_SCENE_FRAG,
+        SHADER_LIGHTING,
+        SHADER_GBUFFER_FRAG,
+        SHADER_SHADOW_FRAG,
+        SHADER_FULLSCREEN_VERT,
+        SHADER_DEFERRED_LIGHTING_FRAG,
+        SHADER_PATCH_VERT,
+        SHADER_SPHERE_TESC,
+        SHADER_SPHERE_TESE,
+        SHADER_CYLINDER_TESC,
+        SHADER_CYLINDER_TESE,
+        SHADER_LAMP_VERT,
+        SHADER_LAMP_FRAG,
+        SHADER_FILE_COUNT,
+        SHADER_NONE = SHADER_FILE_COUNT // Stage a program doesn't have
+    };
+    const char* const SHADER_FILE_NAMES[SHADER_FILE_COUNT] = {
+        "scene.vert", "scene.frag", "lighting.glsl", "gbuffer.frag", "shadow.frag", "fullscreen.vert", "deferred_lighting.frag",
+        "patch.vert", "sphere.tesc", "sphere.tese", "cylinder.tesc", "cylinder.tese", "lamp.vert", "lamp.frag"
+    };
+    const char* const SHADER_DIRECTORY = "../shaders";
+    const char* const SPIRV_DIRECTORY = "../shaders/spirv";
+    struct ShaderSources
+    {
+        std::array<std::string, SHADER_FILE_COUNT> text;
+        std::array<std::vector<char>, SHADER_FILE_COUNT> spirv; // Each stage's SPIR-V module, empty when there is none to use
+    };
+    ShaderSources gShaderSources;
+    bool gSpirvAvailable = false; // The driver loads SPIR-V modules
+
+    // Locations of the uniforms, given in the shaders since programs loaded from SPIR-V can't be asked for them by name.
+    // A uniform shared by several shaders has the same location in each.
+    enum UniformLocation : GLint
+    {
+        UNIFORM_MODEL = 0, // mat4s and arrays are given room for one location per column or element
+        UNIFORM_VIEW = 4,
+        UNIFORM_PROJECTION = 8,
+        UNIFORM_SHAPE_HEIGHTS = 12,
+        UNIFORM_INSTANCED = 13,
+        UNIFORM_UV_SCALE = 14,
+        UNIFORM_TEXTURE = 15,
+        UNIFORM_LIGHTMAP = 16,
+        UNIFORM_LIGHT_COUNT = 17,
+        UNIFORM_VIEW_POSITION = 18,
+        UNIFORM_SHOW_CLUSTER_HEATMAP = 19,
+        UNIFORM_CLUSTER_COUNTS = 20,
+        UNIFORM_CLUSTER_TILE_SIZE = 21,
+        UNIFORM_CLUSTER_DEPTH_SCALE = 22,
+        UNIFORM_CLUSTER_DEPTH_BIAS = 23,
+        UNIFORM_SHADOW_MAPS = 24,
+        UNIFORM_DYNAMIC_SHADOW_MAPS = 25,
+        UNIFORM_DYNAMIC_SHADOWS = 26,
+        UNIFORM_SHADOW_FAR_PLANE = 27,
+        UNIFORM_PROBE_GRID_ORIGIN = 28,
+        UNIFORM_PROBE_GRID_SPACING = 29,
+        UNIFORM_PROBE_GRID_COUNTS = 30,
+        UNIFORM_OBJECT_LIGHT_COUNT = 31,
+        UNIFORM_OBJECT_LIGHTS = 32,
+        UNIFORM_G_ALBEDO = 48,
+        UNIFORM_G_NORMAL = 49,
+        UNIFORM_G_DEPTH = 50,
+        UNIFORM_INVERSE_VIEW_PROJECTION = 51,
+        UNIFORM_VIEWPORT_SIZE = 55,
+        UNIFORM_VIEWPORT_HEIGHT = 56,
+        UNIFORM_PIXELS_PER_EDGE = 57,
+        UNIFORM_MAX_TESS_LEVEL = 58,
+        UNIFORM_LIGHT_POSITION = 59
+    };
+
+    // Programs that include the lighting shader source, each compiled in variants
+    enum ShaderPipeline
+    {
+        PIPELINE_FORWARD, // Scene vertex shader and the lit fragment shader
+        PIPELINE_SPHERE_TESS, // Sphere patches and the lit fragment shader
+        PIPELINE_CYLINDER_TESS, // Cylinder patches and the lit fragment shader
+        PIPELINE_DEFERRED_LIGHTING // Fullscreen pass lighting the G-buffer
+    };
+    // Stage files of each pipeline: vertex, tessellation control, tessellation evaluation and fragment
+    const ShaderFile PIPELINE_STAGES[][4] = {
+        { SHADER_SCENE_VERT, SHADER_NONE, SHADER_NONE, SHADER_SCENE_FRAG },
+        { SHADER_PATCH_VERT, SHADER_SPHERE_TESC, SHADER_SPHERE_TESE, SHADER_SCENE_FRAG },
+        { SHADER_PATCH_VERT, SHADER_CYLINDER_TESC, SHADER_CYLINDER_TESE, SHADER_SCENE_FRAG },
+        { SHADER_FULLSCREEN_VERT, SHADER_NONE, SHADER_NONE, SHADER_DEFERRED_LIGHTING_FRAG }
+    };
+
+    // Lighting features of a variant. Each becomes a #define of true or false, and the code behind a false one is
+    // compiled out.
+    const unsigned int FEATURE_SPECULAR = 1 << 0;
+    const unsigned int FEATURE_SHADOWS = 1 << 1;
+    const unsigned int FEATURE_PROBES = 1 << 2;
+    const unsigned int FEATURE_CLUSTERS = 1 << 3;
+    const unsigned int FEATURE_OBJECT_LIGHTS = 1 << 4;
+    const unsigned int FEATURE_LIGHTMAP = 1 << 5;
+    const unsigned int FEATURE_BLINN_PHONG = 1 << 6;
+    const unsigned int FEATURE_FAST_SPECULAR = 1 << 7;
+    const struct { unsigned int feature; const char* name; } SHADER_FEATURES[] = {
+        { FEATURE_SPECULAR, "SPECULAR" },
+        { FEATURE_SHADOWS, "SHADOWS" },
+        { FEATURE_PROBES, "PROBES" },
+        { FEATURE_CLUSTERS, "CLUSTERS" },
+        { FEATURE_OBJECT_LIGHTS, "OBJECT_LIGHTS" },
+        { FEATURE_LIGHTMAP, "LIGHTMAP" },
+        { FEATURE_BLINN_PHONG, "BLINN_PHONG" },
+        { FEATURE_FAST_SPECULAR, "FAST_SPECULAR" }
+    };
+    // Variants compiled at startup, which the others fall back to when they fail to compile
+    const unsigned int DEFAULT_SHADER_FEATURES = FEATURE_SPECULAR | FEATURE_SHADOWS | FEATURE_PROBES | FEATURE_CLUSTERS | FEATURE_OBJECT_LIGHTS;
+    // Most lights a variant shades with a loop of fixed length
+    const unsigned int MAX_FIXED_LIGHT_COUNT = 8;
+
+    // Identifies a variant of a lit program
+    struct ShaderKey
+    {
+        ShaderPipeline pipeline;
+        unsigned int features;
+        unsigned int lightCount; // Lights shaded by a loop of fixed length, 0 when the count comes from the light buffer
+
+        bool operator==(const ShaderKey& other) const
+        {
+            return pipeline == other.pipeline && features == other.features && lightCount == other.lightCount;
+        }
+    };
+
+    struct ShaderKeyHash
+    {
+        size_t operator()(const ShaderKey& key) const
+        {
+            return std::hash<unsigned int>()((key.lightCount << 16) ^ (key.features << 4) ^ key.pipeline);
+        }
+    };
+
+    // Linked programs are saved to the cache directory and loaded from it on later runs, keyed by a hash of their sources
+    // and the driver's renderer and version strings
+    struct ProgramCacheStats
+    {
+        unsigned int loaded = 0; // Programs loaded from a saved binary
+        unsigned int compiled = 0; // Programs compiled from source or SPIR-V
+        unsigned int fromSpirv = 0; // Of the compiled programs, those loaded from SPIR-V modules
+        unsigned int rejected = 0; // Saved binaries the driver no longer accepts
+        double milliseconds = 0.0; // Time spent creating programs
+    };
+    const char* const PROGRAM_CACHE_DIRECTORY = "../shader_cache";
+    bool gProgramCacheAvailable = false; // The driver supports at least one program binary format
+    ProgramCacheStats gProgramCacheStats;
+
+    // A program handed to the driver to compile and link, checked once it is needed. With parallel shader compile the
+    // driver works on it in the background, and whether it is done can be asked without waiting.
+    struct PendingProgram
+    {
+        GLuint programId = 0;
+        std::vector<std::pair<GLuint, const char*>> shaders; // Each stage's shader and name, for error reports
+        std::string cachePath;
+        bool fromCache = false; // Loaded from the binary cache, already checked
+        bool fromSpirv = false; // Loaded from SPIR-V modules rather than compiled from GLSL
+        double milliseconds = 0.0; // Time spent submitting and checking, not the time the driver took in the background
+        ProgramCacheStats* stats = &gProgramCacheStats; // Where the program is counted; reloads keep their own
+    };
+    bool gParallelShaderCompile = false;
+
+    // A program's SPIR-V modules, null for the stages it doesn't have, and the specialization constants of its fragment stage
+    struct SpirvModules
+    {
+        const std::vector<char>* stages[4] = {};
+        std::vector<GLuint> constantIds;
+        std::vector<GLuint> constantValues;
+    };
+
+    // Every variant compiled so far, 0 for the ones that failed, and the variants still compiling
+    std::unordered_map<ShaderKey, GLuint, ShaderKeyHash> gShaderVariants;
+    std::unordered_map<ShaderKey, PendingProgram, ShaderKeyHash> gPendingVariants;
+    // Specular highlights from the half vector rather than the reflected light, and with an approximate power
+    bool gUseBlinnPhong = false;
+    bool gUseFastSpecular = false;
 
     // camera
     Camera gCamera(glm::vec3(0.0f, 3.0f, 18.0f));
@@ -79,21 +550,133 @@ namespace
     float gDeltaTime = 0.0f; // time between current frame and last frame
     float gLastFrame = 0.0f;
 
-    // Light color, position and scale
-    glm::vec3 gLightColor(0.639f, 0.592f, 0.512f); // Warm white
-    glm::vec3 gLightPosition(-10.0f, 5.0f, 5.0f);
-    glm::vec3 gLightScale(0.3f);
-
-    // Light 2 color, position and scale
-    glm::vec3 gLightColor2(0.25f, 0.0f, 0.6f); // Purple
-    glm::vec3 gLightPosition2(12.0f, 2.0f, 5.0f);
-    glm::vec3 gLightScale2(0.3f);
+    // Lights of the scene. Adding an entry is all a new light needs: the shaders loop over the list
+    // and a lamp marker is drawn for each one.
+    std::vector<SceneLight> gLights = {
+        { glm::vec3(-10.0f, 5.0f, 5.0f), glm::vec3(0.639f, 0.592f, 0.512f), 0.85f, 0.1f, 16.0f, 0.3f, glm::vec3(0.0f, -1.0f, 0.0f), 0.0f, true }, // Warm white
+        { glm::vec3(12.0f, 2.0f, 5.0f), glm::vec3(0.25f, 0.0f, 0.6f), 0.35f, 0.1f, 16.0f, 0.3f, glm::vec3(1.0f, 1.0f, 1.0f), 0.0f, true } // Purple
+    };
+    // Shader storage buffer holding the lights, bound at LIGHT_BUFFER_BINDING
+    const GLuint LIGHT_BUFFER_BINDING = 0;
+    GLuint gLightBuffer;
+    // Lights binned into clusters of the view, so each fragment only shades the lights that reach it
+    bool gUseLightClusters = true;
+    bool gShowClusterHeatmap = false; // Color the scene by the number of lights per cluster
+    LightClusters gLightClusters;
+    const GLuint CLUSTER_BUFFER_BINDING = 1;
+    const GLuint LIGHT_INDEX_BUFFER_BINDING = 2;
+    GLuint gClusterBuffers[2]; // Cluster ranges and light indices
+    // Shadows of the lights that cast them, bound at SHADOW_MAP_UNIT and DYNAMIC_SHADOW_MAP_UNIT
+    bool gUseShadows = true;
+    ShadowMaps gShadowMaps;
+    const GLint SHADOW_MAP_UNIT = 3;
+    const GLint DYNAMIC_SHADOW_MAP_UNIT = 4;
+    // Ambient and diffuse light of the static objects, baked into a lightmap atlas and used while the lights stand still
+    bool gUseLightmaps = true;
+    GLuint gLightmapTextureId = 0;
+    std::vector<glm::vec3> gBakedLightPositions; // Where the lights were for the last bake
+    const GLint LIGHTMAP_UNIT = 5;
+    const float LIGHTMAP_TEXELS_PER_UNIT = 16.0f;
+    // Bakes after the lights stop somewhere new run on a thread of their own, from copies of the lights and the scene tree,
+    // and the finished atlas is uploaded between frames. Their worker threads are apart from gThreadPool so the frame's
+    // own parallel work never waits behind a bake.
+    struct LightmapBake
+    {
+        std::thread thread;
+        std::atomic<bool> done = false;
+        std::vector<SceneLight> lights; // The lights as they were when the bake started
+        Bvh sceneBvh;
+        std::vector<glm::vec4> texels; // The finished atlas
+        size_t bakedTexels = 0;
+        double milliseconds = 0.0;
+    };
+    LightmapBake gLightmapBake;
+    ThreadPool gBakeThreadPool(std::max(1u, std::thread::hardware_concurrency() / 2));
+    // Ambient light from a grid of spherical harmonic probes baked from the scene, bound at PROBE_BUFFER_BINDING.
+    // Probes a moving light reaches are queued and baked again a few per frame.
+    struct GLProbe
+    {
+        glm::vec4 coefficients[SH_COEFFICIENTS]; // Irradiance; w of the first is 0 for probes stuck inside objects
+    };
+    bool gUseProbes = true;
+    ProbeGrid gProbeGrid;
+    std::vector<GLProbe> gProbes;
+    std::vector<glm::vec3> gProbeDirections;
+    std::vector<glm::vec3> gProbeLightPositions; // Where the lights were when their probes were last queued
+    std::vector<int> gDirtyProbes;
+    std::vector<bool> gProbeQueued;
+    GLuint gProbeBuffer = 0;
+    const GLuint PROBE_BUFFER_BINDING = 3;
+    const int PROBE_RAYS = 128;
+    const int PROBES_PER_FRAME = 32;
+    const float PROBE_RAY_LENGTH = 8.0f; // Farther surfaces count as the open room around the probe
+    const float PROBE_BOUNCE_ALBEDO = 0.5f; // Surface colors are only in the textures, so the bounce light is grey
+    // Lights reaching each scene object and each instanced draw, passed with the draw instead of using the clusters
+    bool gUseObjectLightLists = false;
+    LightLists gObjectLightLists;
+    LightLists gBatchLightLists;
+    // Deferred shading: the scene is drawn into the G-buffer, then each pixel is lit once by a fullscreen pass
+    GBuffer gGBuffer;
+    bool gDeferredAvailable = false;
+    bool gUseDeferred = false;
+    GLuint gFullscreenVao; // Empty, the fullscreen triangle is made from gl_VertexID
+    ShadingStats gShadingStats;
+    // Every program a frame or a key press can use is drawn with once before the first frame, since drivers leave part
+    // of their work until a program's first draw. The CPU time of the first frames is logged to show what is left.
+    bool gWarmUpShaders = true;
+    const size_t LOGGED_FRAME_COUNT = 10;
+    std::vector<double> gFirstFrameTimes;
 
     // Lamp animation
     bool gIsLampOrbiting = false;
 
     // View mode
     bool gOrthoView = false;
+
+    // Programs without variants, each made from fixed stages. A reload only compiles the ones in use.
+    enum FixedProgram
+    {
+        PROGRAM_LAMP,
+        PROGRAM_SHADOW,
+        PROGRAM_GBUFFER,
+        PROGRAM_SPHERE_GBUFFER,
+        PROGRAM_CYLINDER_GBUFFER,
+        FIXED_PROGRAM_COUNT
+    };
+    struct FixedProgramInfo
+    {
+        GLuint* programId;
+        ShaderFile stages[4]; // Vertex, tessellation control, tessellation evaluation and fragment
+        bool (*inUse)();
+    };
+    const FixedProgramInfo FIXED_PROGRAMS[FIXED_PROGRAM_COUNT] = {
+        { &gLampProgramId, { SHADER_LAMP_VERT, SHADER_NONE, SHADER_NONE, SHADER_LAMP_FRAG }, [] { return true; } },
+        { &gShadowProgramId, { SHADER_SCENE_VERT, SHADER_NONE, SHADER_NONE, SHADER_SHADOW_FRAG }, [] { return true; } },
+        { &gGBufferProgramId, { SHADER_SCENE_VERT, SHADER_NONE, SHADER_NONE, SHADER_GBUFFER_FRAG }, [] { return gDeferredAvailable; } },
+        { &gSphereGBufferProgramId, { SHADER_PATCH_VERT, SHADER_SPHERE_TESC, SHADER_SPHERE_TESE, SHADER_GBUFFER_FRAG },
+            [] { return gDeferredAvailable && gTessellationAvailable; } },
+        { &gCylinderGBufferProgramId, { SHADER_PATCH_VERT, SHADER_CYLINDER_TESC, SHADER_CYLINDER_TESE, SHADER_GBUFFER_FRAG },
+            [] { return gDeferredAvailable && gTessellationAvailable; } }
+    };
+
+    // Shader hot reload: a thread watches SHADER_DIRECTORY and, when a file changes, compiles every program in use from
+    // the new sources on a hidden window sharing the main window's objects. A reload where everything compiled is swapped
+    // in between frames; otherwise the programs in use are kept.
+    struct ShaderReload
+    {
+        GLFWwindow* context = nullptr; // Current on the reload thread
+        std::thread thread;
+        std::atomic<bool> stop = false;
+
+        std::mutex mutex; // Guards the members below
+        std::vector<ShaderKey> variantKeys; // Variants compiled so far, compiled again by each reload
+        bool ready = false; // A reload is done and waits to be swapped in
+        ShaderSources sources;
+        GLuint fixedPrograms[FIXED_PROGRAM_COUNT] = {}; // 0 for the ones not in use
+        std::vector<std::pair<ShaderKey, GLuint>> variants;
+    };
+    ShaderReload gShaderReload;
+    const int SHADER_RELOAD_POLL_MS = 250; // How often the thread looks for changes or checks whether to stop
 }
 
 /*
@@ -109,138 +692,111 @@ void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
 void UCreateCubeMesh(GLMesh& mesh, float frontHeight = 1.0f, float backHeight = 1.0f);
-void UCreateCylinderMesh(GLMesh& mesh);
+void UCreateCylinderMesh(GLMesh& mesh, int slices = 24);
 void UCreatePlaneMesh(GLMesh& mesh, float frontHeight = 0.5f, float backHeight = 0.5f);
 void UCreatePyramidMesh(GLMesh& mesh);
-void UCreateSphereMesh(GLMesh& mesh);
+void UCreateSphereMesh(GLMesh& mesh, int complexity = 32);
+void UCreateIcoSphereMesh(GLMesh& mesh, int subdivisions = 3);
+void UCreateCubeSphereMesh(GLMesh& mesh, int divisions = 10);
+void UCreateMesh(GLMesh& mesh, const MeshData& data, bool buildMeshlets = false);
+void UCreateMesh(GLMesh& mesh, const GLfloat* verts, GLuint nVertices, const GLushort* indices, GLuint nIndices);
+template <int VertexCount, int IndexCount>
+void UCreateMesh(GLMesh& mesh, const MeshTable<VertexCount, IndexCount>& table);
+void UUploadMesh(GLMesh& mesh, const GLfloat* verts, GLuint nVertices, const GLushort* indices, GLuint nIndices);
+void UDescribeVertexLayout();
+void UCreateMeshLods(GLMeshLods& lods, const MeshData& source, int levels);
+const GLMesh& USelectMeshLod(const GLMeshLods& lods, const glm::vec3& center, float scale);
+void UDestroyMeshLods(GLMeshLods& lods);
+shared_ptr<GLMesh> UAcquireMesh(MeshGenerator generator, float param0 = 0.0f, float param1 = 0.0f);
+shared_ptr<GLMesh> UAcquireSphereMesh(SphereType type);
+void UPrintMeshRegistryStats();
+void UCreateScene();
+glm::vec3 UShapePosition(const glm::vec3& position, const glm::vec2& shapeHeights);
+Aabb UObjectBounds(const GLMesh& mesh, const glm::mat4& model, const glm::vec2& shapeHeights);
+glm::mat4 ULampModel(int lamp);
+void UBuildSceneBvh();
+void URefitLamps();
+float URaycastMesh(const GLMesh& mesh, const glm::mat4& model, const glm::vec2& shapeHeights, const BvhRay& ray, glm::vec3* hitNormal = nullptr);
+void UPickObject();
+void UCreatePatchMeshes();
+void UDestroyPatchMesh(GLPatchMesh& mesh);
+void UDrawPatches(GLuint programId, const GLPatchMesh& patches, PatchShape shape, const glm::mat4& view, const glm::mat4& projection, bool lit = true);
+void UBeginRoundObjectStats();
+void UEndRoundObjectStats();
+void UCreateInstanceBatches();
+void UDestroyInstanceBatches();
+void UDrawMesh(const GLMesh& mesh, GLsizei nInstances = 1);
+void USetFaceCulling(bool twoSided);
+void UDrawMeshlets(const GLMesh& mesh, const glm::mat4& model, const glm::mat4& viewProjection);
+float UMaxScale(const glm::mat4& model);
+void UPrintMeshStats(const char* name, const GLMesh& mesh);
+void UPrintWindingReport(const char* name, const WindingReport& report);
+void UBenchmarkMeshGeneration();
+void UBenchmarkSceneBvh();
 void UDestroyMesh(GLMesh& mesh);
 bool UCreateTexture(const char* filename, GLuint& textureId, bool flipImage = true);
 void UDestroyTexture(GLuint textureId);
 void URender();
+void UUploadLights();
+void UUploadLightClusters(const glm::mat4& view, const glm::mat4& projection);
+void UAddDeskLights(int count);
+void UBuildObjectLightLists();
+bool UCreateShadowMaps();
+void UDestroyShadowMaps();
+void UUpdateShadowMaps();
+void UDrawShadowCasters(const glm::vec3& lightPosition, GLuint maps, int cube, bool dynamic);
+void ULayoutLightmaps();
+void UBakeLightmaps();
+size_t UBakeLightmapTexels(const std::vector<SceneLight>& lights, const Bvh& sceneBvh, ThreadPool& pool, std::vector<glm::vec4>& lightmap);
+void UUploadLightmaps(const std::vector<glm::vec4>& lightmap, const std::vector<SceneLight>& lights);
+void UStartLightmapBake();
+void UFinishLightmapBake(bool wait = false);
+glm::vec3 ULightmapLight(const glm::vec3& position, const glm::vec3& normal);
+glm::vec3 ULightmapLight(const glm::vec3& position, const glm::vec3& normal, const std::vector<SceneLight>& lights, const Bvh& sceneBvh);
+bool ULightmapsCurrent();
+void UCreateProbes();
+void UBakeProbes(const std::vector<int>& probes);
+void UUpdateProbes();
+glm::vec3 UProbeRadiance(const BvhRay& ray, const glm::vec3& environment, bool& backFace);
+void USetObjectLights(const LightLists& lists, size_t item);
+void USetFrameUniforms(const glm::mat4& view, const glm::mat4& projection);
+bool UCreateGBuffer(int width, int height);
+void UDestroyGBuffer();
+void ULightGBuffer(const glm::mat4& view, const glm::mat4& projection);
+void UBeginShadingStats();
+void UEndShadingStats();
+string UExpandShaderSource(const ShaderSources& sources, ShaderFile file, const string& defines = "");
+GLuint UShaderVariant(const ShaderKey& key, bool wait = false);
+void USubmitShaderVariant(const ShaderKey& key, const ShaderSources& sources, PendingProgram& pending);
+void UPrepareShaderVariant(const ShaderKey& key, GLuint programId);
+ShaderKey UDefaultShaderKey(ShaderPipeline pipeline);
+ShaderKey UFrameShaderKey(ShaderPipeline pipeline);
 bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* tessControlShaderSource, const char* tessEvalShaderSource,
+    const char* fragShaderSource, GLuint& programId);
+void USubmitShaderProgram(const char* vtxShaderSource, const char* tessControlShaderSource, const char* tessEvalShaderSource,
+    const char* fragShaderSource, PendingProgram& pending, const SpirvModules* spirv = nullptr);
+void USubmitShaderFiles(const ShaderSources& sources, const ShaderFile stages[4], PendingProgram& pending, const string& defines = "",
+    SpirvModules spirv = {});
+bool UProgramReady(const PendingProgram& pending);
+bool UFinishShaderProgram(PendingProgram& pending, GLuint& programId);
+void UDiscardShaderProgram(PendingProgram& pending);
+bool UCheckShaderCompile(GLuint shaderId, const char* stage);
+string UProgramCachePath(const char* const sources[4]);
+bool ULoadCachedProgram(const string& path, GLuint& programId, ProgramCacheStats& stats);
+void USaveCachedProgram(const string& path, GLuint programId);
 void UDestroyShaderProgram(GLuint programId);
-
-/* Vertex Shader Source Code */
-const GLchar* vertexShaderSource = GLSL(440,
-    layout(location = 0) in vec3 position; // Vertex data from Vertex Attrib Pointer 0
-    layout(location = 1) in vec3 normal; // Normal data from Vertex Attrib Pointer 1
-    layout(location = 2) in vec2 textureCoordinate; // Texture data from Vertex Attrib Pointer 2
-
-    out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
-    out vec3 vertexNormal; // For outgoing normals to fragment shader
-    out vec2 vertexTextureCoordinate; // For outgoing texture coordinate
-
-    // Global variables for the  transform matrices
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
-
-    void main()
-    {
-        gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices to clip coordinates
-        vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
-        vertexNormal = mat3(transpose(inverse(model))) * normal; // Gets normal vectors in world space only and exclude normal translation properties
-        vertexTextureCoordinate = textureCoordinate; // Gets texture coordinate
-    }
-);
-
-/* Fragment Shader Source Code */
-const GLchar* fragmentShaderSource = GLSL(440,
-    in vec3 vertexFragmentPos; // For incoming fragment position
-    in vec3 vertexNormal; // For incoming normals
-    in vec2 vertexTextureCoordinate; // For incoming texture coordinate
-
-    out vec4 fragmentColor; // For outgoing cube color to the GPU
-
-    // Uniform / Global variables for object color, light color, light position, and camera/view position
-    uniform vec3 lightColor;
-    uniform vec3 lightColor2;
-    uniform vec3 lightPos;
-    uniform vec3 lightPos2;
-    uniform vec3 viewPosition;
-    uniform vec3 viewPosition2;
-    uniform sampler2D uTexture; // Useful when working with multiple textures
-    uniform vec2 uvScale;
-
-    void main()
-    {
-        /* Phong lighting model calculations to generate ambient, diffuse, and specular components */
-
-        // LAMP 1: Calculate ambient lighting
-        float ambientStrength = 0.85f; // Set ambient or global lighting strength 85%
-        vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
-
-        // LAMP 2: Calculate ambient lighting
-        float ambientStrength2 = 0.35f; // Set ambient or global lighting strength 35%
-        vec3 ambient2 = ambientStrength2 * lightColor2; // Generate ambient light color
-
-        // LAMP 1: Calculate diffuse lighting
-        vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-        vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-        float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-        vec3 diffuse = impact * lightColor; // Generate diffuse light color
-
-        // LAMP 2: Calculate diffuse lighting
-        vec3 norm2 = normalize(vertexNormal); // Normalize vectors to 1 unit
-        vec3 lightDirection2 = normalize(lightPos2 - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-        float impact2 = max(dot(norm2, lightDirection2), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-        vec3 diffuse2 = impact2 * lightColor2; // Generate diffuse light color
-
-        // LAMP 1: Calculate specular lighting
-        float specularIntensity = 0.1f; // Set specular light strength
-        float highlightSize = 16.0f; // Set specular highlight size
-        vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-        vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-
-        // LAMP 2: Calculate specular lighting
-        float specularIntensity2 = 0.1f; // Set specular light strength
-        float highlightSize2 = 16.0f; // Set specular highlight size
-        vec3 viewDir2 = normalize(viewPosition2 - vertexFragmentPos); // Calculate view direction
-        vec3 reflectDir2 = reflect(-lightDirection2, norm2);// Calculate reflection vector
-
-        // LAMP 1: Calculate specular component
-        float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-        vec3 specular = specularIntensity * specularComponent * lightColor;
-
-        // LAMP 2: Calculate specular component
-        float specularComponent2 = pow(max(dot(viewDir2, reflectDir2), 0.0), highlightSize2);
-        vec3 specular2 = specularIntensity2 * specularComponent2 * lightColor2;
-
-        // Texture holds the color to be used for all three components
-        vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
-
-        // Calculate phong result
-        vec3 phong = (ambient + ambient2 + diffuse + diffuse2 + specular + specular2) * textureColor.xyz;
-
-        // Send lighting results to GPU
-        fragmentColor = vec4(phong, 1.0);
-    }
-);
-
-/* Lamp Shader Source Code */
-const GLchar* lampVertexShaderSource = GLSL(440,
-    layout(location = 0) in vec3 position; // Vertex data from Vertex Attrib Pointer 0
-
-    // Uniform / Global variables for the  transform matrices
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
-
-    void main()
-    {
-        gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
-    }
-);
-
-/* Lamp Fragment Shader Source Code */
-const GLchar* lampFragmentShaderSource = GLSL(440,
-    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
-
-    void main()
-    {
-        fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
-    }
-);
+bool ULoadShaderSources(ShaderSources& sources);
+bool ULoadSpirvModules(ShaderSources& sources);
+void UStartShaderReload();
+void UStopShaderReload();
+void UWatchShaderFiles();
+void UReloadShaders();
+void UApplyShaderReload();
+void UWarmUpShaders();
+void UDrawSceneObjects(const glm::mat4& view, const glm::mat4& projection, bool everyLevel, bool textured = true);
+void UCompareSpecular();
+void ULogFrameTime(double milliseconds);
 
 // Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so flip it
 void flipImageVertically(unsigned char* image, int width, int height, int channels)
@@ -263,31 +819,65 @@ void flipImageVertically(unsigned char* image, int width, int height, int channe
 
 int main(int argc, char* argv[])
 {
+    // Time the procedural generators instead of opening the scene
+    if (argc > 1 && strcmp(argv[1], "--benchmark") == 0)
+    {
+        UBenchmarkMeshGeneration();
+        UBenchmarkSceneBvh();
+        return EXIT_SUCCESS;
+    }
+
     if (!UInitialize(argc, argv, &gWindow))
     {
         return EXIT_FAILURE;
     }
 
-    // Create the scene meshes
-    // -----------------------
-    UCreateCubeMesh(gCubeMesh);
-    UCreateCubeMesh(gWedgeMesh, 0.4f, 1.0f);
-    UCreateCylinderMesh(gCylinderMesh);
-    UCreatePlaneMesh(gPlaneMesh);
-    UCreatePlaneMesh(gPlaneAngledMesh, 0.4f, 1.0f);
-    UCreateSphereMesh(gSphereMesh);
+    // Scatter extra lights over the desk when started with --lights <count>
+    if (argc > 2 && strcmp(argv[1], "--lights") == 0)
+    {
+        UAddDeskLights(atoi(argv[2]));
+    }
 
-    // Create the shader programs
-    if (!UCreateShaderProgram(vertexShaderSource, fragmentShaderSource, gProgramId))
+    // Skip the warm up draws when started with --no-warmup, to compare the first frames without them, and compare the
+    // ways of shading the specular highlights before the first frame when started with --compare-specular
+    bool compareSpecular = false;
+    for (int i = 1; i < argc; i++)
     {
-        cout << "Failed to create shader" << endl;
-        return EXIT_FAILURE;
+        gWarmUpShaders = gWarmUpShaders && strcmp(argv[i], "--no-warmup") != 0;
+        compareSpecular = compareSpecular || strcmp(argv[i], "--compare-specular") == 0;
     }
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
+
+    // Hand every startup program to the driver now, so it compiles them while the meshes and textures load; each is
+    // checked below, before anything draws with it
+    if (!ULoadShaderSources(gShaderSources))
     {
-        cout << "Failed to create lamp shader" << endl;
         return EXIT_FAILURE;
     }
+    if (gSpirvAvailable && !ULoadSpirvModules(gShaderSources))
+    {
+        cout << "INFO: No up to date SPIR-V modules in " << SPIRV_DIRECTORY << ", compiling the shaders from GLSL" << endl;
+    }
+    PendingProgram fixedPrograms[FIXED_PROGRAM_COUNT];
+    for (int program = 0; program < FIXED_PROGRAM_COUNT; program++)
+    {
+        USubmitShaderFiles(gShaderSources, FIXED_PROGRAMS[program].stages, fixedPrograms[program]);
+    }
+    for (ShaderPipeline pipeline : { PIPELINE_FORWARD, PIPELINE_SPHERE_TESS, PIPELINE_CYLINDER_TESS, PIPELINE_DEFERRED_LIGHTING })
+    {
+        ShaderKey key = UDefaultShaderKey(pipeline);
+        USubmitShaderVariant(key, gShaderSources, gPendingVariants[key]);
+    }
+
+    // Simplify a finely tessellated sphere into levels of detail
+    MeshData sphereSource;
+    UGenerateIcoSphere(sphereSource, 4);
+    UCreateMeshLods(gSphereLods, sphereSource, 5);
+    for (size_t i = 0; i < gSphereLods.levels.size(); i++)
+    {
+        string name = "Sphere LOD " + to_string(i) + " (quadric error " + to_string(gSphereLods.quadricErrors[i]) + ")";
+        UPrintMeshStats(name.c_str(), gSphereLods.levels[i]);
+    }
+    cout << endl;
 
     // Load desk texture
     const char* texFilename = "../textures/desk.png";
@@ -296,8 +886,6 @@ int main(int argc, char* argv[])
         cout << "Failed to load texture " << texFilename << endl;
         return EXIT_FAILURE;
     }
-    glUseProgram(gProgramId); // tell opengl texture unit sample belongs to
-    glUniform1i(glGetUniformLocation(gProgramId, "deskTexture"), 0); // Set the texture as texture unit 0
 
     // Load mesh fabric texture
     texFilename = "../textures/black_mesh.png";
@@ -306,8 +894,6 @@ int main(int argc, char* argv[])
         cout << "Failed to load texture " << texFilename << endl;
         return EXIT_FAILURE;
     }
-    glUseProgram(gProgramId); // tell opengl texture unit sample belongs to
-    glUniform1i(glGetUniformLocation(gProgramId, "meshFabricTexture"), 0); // Set the texture as texture unit 0
 
     // Load black rubber texture
     texFilename = "../textures/black_rubber.png";
@@ -316,8 +902,6 @@ int main(int argc, char* argv[])
         cout << "Failed to load texture " << texFilename << endl;
         return EXIT_FAILURE;
     }
-    glUseProgram(gProgramId); // tell opengl texture unit sample belongs to
-    glUniform1i(glGetUniformLocation(gProgramId, "rubberBaseTexture"), 0); // Set the texture as texture unit 0
 
     // Load mouse pad texture
     texFilename = "../textures/mouse_pad.png";
@@ -326,8 +910,6 @@ int main(int argc, char* argv[])
         cout << "Failed to load texture " << texFilename << endl;
         return EXIT_FAILURE;
     }
-    glUseProgram(gProgramId); // tell opengl texture unit sample belongs to
-    glUniform1i(glGetUniformLocation(gProgramId, "mousePadTexture"), 0); // Set the texture as texture unit 0
 
     // Load infinity cube texture
     texFilename = "../textures/infinity_cube.png";
@@ -336,8 +918,6 @@ int main(int argc, char* argv[])
         cout << "Failed to load texture " << texFilename << endl;
         return EXIT_FAILURE;
     }
-    glUseProgram(gProgramId); // tell opengl texture unit sample belongs to
-    glUniform1i(glGetUniformLocation(gProgramId, "infinityCubeTexture"), 0); // Set the texture as texture unit 0
 
     // Load aluminum texture
     texFilename = "../textures/aluminum.png";
@@ -346,8 +926,6 @@ int main(int argc, char* argv[])
         cout << "Failed to load texture " << texFilename << endl;
         return EXIT_FAILURE;
     }
-    glUseProgram(gProgramId); // tell opengl texture unit sample belongs to
-    glUniform1i(glGetUniformLocation(gProgramId, "aluminumTexture"), 0); // Set the texture as texture unit 0
 
     // Load keyboard texture
     texFilename = "../textures/keyboard.png";
@@ -356,8 +934,6 @@ int main(int argc, char* argv[])
         cout << "Failed to load texture " << texFilename << endl;
         return EXIT_FAILURE;
     }
-    glUseProgram(gProgramId); // tell opengl texture unit sample belongs to
-    glUniform1i(glGetUniformLocation(gProgramId, "keyboardTexture"), 0); // Set the texture as texture unit 0
 
     // Load trackpad texture
     texFilename = "../textures/trackpad.png";
@@ -366,8 +942,6 @@ int main(int argc, char* argv[])
         cout << "Failed to load texture " << texFilename << endl;
         return EXIT_FAILURE;
     }
-    glUseProgram(gProgramId); // tell opengl texture unit sample belongs to
-    glUniform1i(glGetUniformLocation(gProgramId, "trackpadTexture"), 0); // Set the texture as texture unit 0
 
     // Load mouse texture
     texFilename = "../textures/mouse.png";
@@ -376,8 +950,6 @@ int main(int argc, char* argv[])
         cout << "Failed to load texture " << texFilename << endl;
         return EXIT_FAILURE;
     }
-    glUseProgram(gProgramId); // tell opengl texture unit sample belongs to
-    glUniform1i(glGetUniformLocation(gProgramId, "mouseTexture"), 0); // Set the texture as texture unit 0
 
     // Load whiteboard texture
     texFilename = "../textures/whiteboard.png";
@@ -386,12 +958,111 @@ int main(int argc, char* argv[])
         cout << "Failed to load texture " << texFilename << endl;
         return EXIT_FAILURE;
     }
-    glUseProgram(gProgramId); // tell opengl texture unit sample belongs to
-    glUniform1i(glGetUniformLocation(gProgramId, "whiteboardTexture"), 0); // Set the texture as texture unit 0
+
+    // Check the shader programs submitted at startup. The lit ones are compiled in variants as the lighting features in
+    // use call for them; the default variants were submitted with the others.
+    gProgramId = UShaderVariant(UDefaultShaderKey(PIPELINE_FORWARD), true);
+    if (!gProgramId)
+    {
+        cout << "Failed to create shader" << endl;
+        return EXIT_FAILURE;
+    }
+    if (!UFinishShaderProgram(fixedPrograms[PROGRAM_LAMP], gLampProgramId))
+    {
+        cout << "Failed to create lamp shader" << endl;
+        return EXIT_FAILURE;
+    }
+    if (!UFinishShaderProgram(fixedPrograms[PROGRAM_SHADOW], gShadowProgramId))
+    {
+        cout << "Failed to create shadow shader" << endl;
+        return EXIT_FAILURE;
+    }
+
+    // The tessellated round objects are optional; without them the levels of detail are drawn
+    gSphereTessProgramId = UShaderVariant(UDefaultShaderKey(PIPELINE_SPHERE_TESS), true);
+    gCylinderTessProgramId = UShaderVariant(UDefaultShaderKey(PIPELINE_CYLINDER_TESS), true);
+    gTessellationAvailable = gSphereTessProgramId && gCylinderTessProgramId;
+    if (gTessellationAvailable)
+    {
+        glGetIntegerv(GL_MAX_TESS_GEN_LEVEL, &gMaxTessLevel);
+        UCreatePatchMeshes();
+    }
+    else
+    {
+        cout << "INFO: Tessellation shaders unavailable, round objects use their levels of detail" << endl;
+    }
+
+    // Deferred shading is optional as well; without it the scene is always shaded forward
+    int framebufferWidth, framebufferHeight;
+    glfwGetFramebufferSize(gWindow, &framebufferWidth, &framebufferHeight);
+    gDeferredLightingProgramId = UShaderVariant(UDefaultShaderKey(PIPELINE_DEFERRED_LIGHTING), true);
+    bool gBufferTessAvailable = UFinishShaderProgram(fixedPrograms[PROGRAM_SPHERE_GBUFFER], gSphereGBufferProgramId);
+    gBufferTessAvailable = UFinishShaderProgram(fixedPrograms[PROGRAM_CYLINDER_GBUFFER], gCylinderGBufferProgramId) && gBufferTessAvailable;
+    gDeferredAvailable =
+        UFinishShaderProgram(fixedPrograms[PROGRAM_GBUFFER], gGBufferProgramId) &&
+        gDeferredLightingProgramId &&
+        (!gTessellationAvailable || gBufferTessAvailable) &&
+        UCreateGBuffer(framebufferWidth, framebufferHeight);
+    if (gDeferredAvailable)
+    {
+        glGenVertexArrays(1, &gFullscreenVao);
+    }
+    else
+    {
+        cout << "INFO: Deferred shading unavailable, the scene is shaded forward" << endl;
+    }
+
+    // A warm start loads every program from the binary cache, a cold one compiles them
+    cout << "INFO: " << (gProgramCacheStats.compiled == 0 ? "Warm" : "Cold") << " shader startup: "
+        << gProgramCacheStats.loaded << " programs from the binary cache, " << gProgramCacheStats.compiled << " compiled ("
+        << gProgramCacheStats.fromSpirv << " from SPIR-V, " << gProgramCacheStats.rejected << " cached binaries rejected) in "
+        << gProgramCacheStats.milliseconds << " ms" << endl;
+
+    // Compile the shaders again whenever their files change
+    UStartShaderReload();
+
+    // Place the objects of the scene, sharing the meshes they have in common
+    UCreateScene();
+    ULayoutLightmaps();
+    UCreateInstanceBatches();
+    UBuildSceneBvh();
+    UPrintMeshRegistryStats();
+
+    // Shadows of the scene's casters, drawn once and then whenever a light moves
+    if (!UCreateShadowMaps())
+    {
+        cout << "Failed to create shadow maps" << endl;
+        return EXIT_FAILURE;
+    }
+
+    // Ambient light probes through the scene, all baked now and then again near lights that move
+    UCreateProbes();
+
+    // The lights and their clusters are copied into these buffers every frame
+    glGenBuffers(1, &gLightBuffer);
+    glGenBuffers(2, gClusterBuffers);
+
+    // Commands for the meshlets that survive culling are streamed through this buffer
+    glGenBuffers(1, &gIndirectBuffer);
+
+    // Queries measuring what the round objects cost
+    glGenQueries(2, gRoundObjectStats.primitivesQueries);
+    glGenQueries(2, gRoundObjectStats.timeQueries);
+    glGenQueries(4, &gShadingStats.timestampQueries[0][0]);
 
     // Sets the background color of the window (it will be implicitely used by glClear)
     glClearColor(0.412f, 0.412f, 0.412f, 1.0f);
 
+    // Draw with every program before the first frame
+    if (gWarmUpShaders)
+    {
+        UWarmUpShaders();
+    }
+    if (compareSpecular)
+    {
+        UCompareSpecular();
+    }
+
     // Render loop
     // -----------
     while (!glfwWindowShouldClose(gWindow))
@@ -406,19 +1077,45 @@ int main(int argc, char* argv[])
         // -----
         UProcessInput(gWindow);
 
+        // Programs reloaded since the last frame replace the ones in use
+        UApplyShaderReload();
+
         // Render this frame
+        auto frameStart = chrono::steady_clock::now();
         URender();
+        ULogFrameTime(chrono::duration<double, milli>(chrono::steady_clock::now() - frameStart).count());
 
         glfwPollEvents();
     }
 
-    // Release mesh data
-    UDestroyMesh(gCubeMesh);
-    UDestroyMesh(gCylinderMesh);
-    UDestroyMesh(gPlaneMesh);
-    UDestroyMesh(gPlaneAngledMesh);
-    UDestroyMesh(gSphereMesh);
-    UDestroyMesh(gWedgeMesh);
+    // Release mesh data; shared meshes are destroyed with their last object
+    UDestroyInstanceBatches();
+    gSceneObjects.clear();
+    gLampMesh.reset();
+    UDestroyMeshLods(gSphereLods);
+    if (gTessellationAvailable)
+    {
+        UDestroyPatchMesh(gSpherePatches);
+        UDestroyPatchMesh(gCylinderPatches);
+    }
+    glDeleteBuffers(1, &gIndirectBuffer);
+    glDeleteBuffers(1, &gLightBuffer);
+    glDeleteBuffers(2, gClusterBuffers);
+    glDeleteQueries(2, gRoundObjectStats.primitivesQueries);
+    glDeleteQueries(2, gRoundObjectStats.timeQueries);
+    glDeleteQueries(4, &gShadingStats.timestampQueries[0][0]);
+    if (gDeferredAvailable)
+    {
+        UDestroyGBuffer();
+        glDeleteVertexArrays(1, &gFullscreenVao);
+    }
+    UDestroyShadowMaps();
+    glDeleteBuffers(1, &gProbeBuffer);
+    UFinishLightmapBake(true);
+    if (gLightmapTextureId)
+    {
+        UDestroyTexture(gLightmapTextureId);
+    }
 
     // Release texture
     UDestroyTexture(gDeskTextureId);
@@ -433,8 +1130,26 @@ int main(int argc, char* argv[])
     UDestroyTexture(gWhiteboardTextureId);
 
     // Release shader program
-    UDestroyShaderProgram(gProgramId);
+    UStopShaderReload();
+    for (const auto& variant : gShaderVariants)
+    {
+        UDestroyShaderProgram(variant.second);
+    }
+    for (auto& variant : gPendingVariants)
+    {
+        UDiscardShaderProgram(variant.second);
+    }
     UDestroyShaderProgram(gLampProgramId);
+    UDestroyShaderProgram(gShadowProgramId);
+    if (gDeferredAvailable)
+    {
+        UDestroyShaderProgram(gGBufferProgramId);
+        if (gTessellationAvailable)
+        {
+            UDestroyShaderProgram(gSphereGBufferProgramId);
+            UDestroyShaderProgram(gCylinderGBufferProgramId);
+        }
+    }
 
     exit(EXIT_SUCCESS); // Terminates the program successfully
 }
@@ -463,6 +1178,7 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
         return false;
     }
     glfwMakeContextCurrent(*window);
+    glfwGetFramebufferSize(*window, &gFramebufferWidth, &gFramebufferHeight);
     glfwSetFramebufferSizeCallback(*window, UResizeWindow);
     glfwSetCursorPosCallback(*window, UMousePositionCallback);
     glfwSetScrollCallback(*window, UMouseScrollCallback);
@@ -486,6 +1202,27 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     // Displays GPU OpenGL version
     cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl << endl;
 
+    // Programs can be saved and loaded as binaries when the driver has a format for them
+    GLint binaryFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormats);
+    gProgramCacheAvailable = binaryFormats > 0;
+
+    // Let the driver compile shaders on as many threads as it likes, and be asked whether a program is done
+    gParallelShaderCompile = GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+    if (GLEW_KHR_parallel_shader_compile)
+    {
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    }
+    else if (GLEW_ARB_parallel_shader_compile)
+    {
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+    }
+    cout << "INFO: Parallel shader compile " << (gParallelShaderCompile ? "available" : "unavailable") << endl;
+
+    // Shaders compiled to SPIR-V at build time skip the driver's GLSL compiler
+    gSpirvAvailable = GLEW_ARB_gl_spirv;
+    cout << "INFO: SPIR-V shaders " << (gSpirvAvailable ? "available" : "unavailable") << endl;
+
     // Displays scene controls
     // -----------------------
     cout << "Movement controls" << endl;
@@ -496,9 +1233,21 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     cout << "Other controls" << endl;
     cout << "L / K keys : Start / stop light orbit" << endl;
     cout << "O / P keys : Switch between orthographic and perspective views" << endl;
+    cout << "T / Y keys : Switch between tessellated and level of detail round objects" << endl;
+    cout << "C / V keys : Enable / disable back face culling" << endl;
+    cout << "G / H keys : Enable / disable clustered lighting" << endl;
+    cout << "N / M keys : Show / hide the light cluster heatmap" << endl;
+    cout << "X / Z keys : Switch between deferred and forward shading" << endl;
+    cout << "U / I keys : Enable / disable per object light lists" << endl;
+    cout << "R / F keys : Enable / disable shadows" << endl;
+    cout << "B / J keys : Enable / disable baked lightmaps while the lights stand still" << endl;
+    cout << "1 / 2 keys : Enable / disable ambient light probes" << endl;
+    cout << "3 / 4 keys : Switch between Blinn-Phong and Phong specular highlights" << endl;
+    cout << "5 / 6 keys : Enable / disable the approximate specular power" << endl;
     cout << "Shift key + mouse scroll : Zoom in or out" << endl << endl;
     cout << "Reset controls" << endl;
     cout << "Left click : Reset view" << endl;
+    cout << "Middle click : Select the object at the center of the view" << endl;
     cout << "Right click : Reset movement speed" << endl;
     cout << "Shift key + right click : Reset zoom" << endl << endl;
     cout << "Exit program" << endl;
@@ -533,38 +1282,186 @@ void UProcessInput(GLFWwindow* window)
         cout << "Switched to projection view" << endl;
     }
 
-    // Enable/disable lamp orbiting
-    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS && !gIsLampOrbiting)
+    // Switch how the round objects are drawn
+    if (glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS && !gUseTessellation)
     {
-        gIsLampOrbiting = true;
-        cout << "Light orbit enabled" << endl;
+        if (gTessellationAvailable)
+        {
+            gUseTessellation = true;
+            cout << "Switched to tessellated round objects" << endl;
+        }
     }
-    else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS && gIsLampOrbiting)
+    else if (glfwGetKey(window, GLFW_KEY_Y) == GLFW_PRESS && gUseTessellation)
     {
-        gIsLampOrbiting = false;
-        cout << "Light orbit disabled" << endl;
+        gUseTessellation = false;
+        cout << "Switched to level of detail round objects" << endl;
     }
-}
-
-// GLFW: whenever the window size changed (by OS or user resize) this callback function executes
-// -------------------------------------------------------
-void UResizeWindow(GLFWwindow* window, int width, int height)
-{
-    glViewport(0, 0, width, height);
-}
 
-// GLFW: whenever the mouse moves, this callback is called
-// -------------------------------------------------------
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
-{
-    if (gFirstMouse)
+    // Enable/disable back face culling
+    if (glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS && !gCullBackFaces)
     {
-        gLastX = xpos;
-        gLastY = ypos;
-        gFirstMouse = false;
+        gCullBackFaces = true;
+        cout << "Back face culling enabled" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS && gCullBackFaces)
+    {
+        gCullBackFaces = false;
+        cout << "Back face culling disabled" << endl;
     }
 
-    float xoffset = xpos - gLastX;
+    // Switch between clustered lighting and shading every light
+    if (glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS && !gUseLightClusters)
+    {
+        gUseLightClusters = true;
+        cout << "Clustered lighting enabled" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_H) == GLFW_PRESS && gUseLightClusters)
+    {
+        gUseLightClusters = false;
+        cout << "Clustered lighting disabled" << endl;
+    }
+
+    // Show/hide the light cluster heatmap
+    if (glfwGetKey(window, GLFW_KEY_N) == GLFW_PRESS && !gShowClusterHeatmap)
+    {
+        gShowClusterHeatmap = true;
+        cout << "Light cluster heatmap shown" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS && gShowClusterHeatmap)
+    {
+        gShowClusterHeatmap = false;
+        cout << "Light cluster heatmap hidden" << endl;
+    }
+
+    // Enable/disable shadows
+    if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS && !gUseShadows)
+    {
+        gUseShadows = true;
+        cout << "Shadows enabled" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS && gUseShadows)
+    {
+        gUseShadows = false;
+        cout << "Shadows disabled" << endl;
+    }
+
+    // Enable/disable the ambient light probes
+    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS && !gUseProbes)
+    {
+        gUseProbes = true;
+        cout << "Ambient light probes enabled" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS && gUseProbes)
+    {
+        gUseProbes = false;
+        cout << "Ambient light probes disabled" << endl;
+    }
+
+    // Switch how the specular highlights are shaded
+    if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS && !gUseBlinnPhong)
+    {
+        gUseBlinnPhong = true;
+        cout << "Switched to Blinn-Phong specular highlights" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS && gUseBlinnPhong)
+    {
+        gUseBlinnPhong = false;
+        cout << "Switched to Phong specular highlights" << endl;
+    }
+    if (glfwGetKey(window, GLFW_KEY_5) == GLFW_PRESS && !gUseFastSpecular)
+    {
+        gUseFastSpecular = true;
+        cout << "Approximate specular power enabled" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_6) == GLFW_PRESS && gUseFastSpecular)
+    {
+        gUseFastSpecular = false;
+        cout << "Approximate specular power disabled" << endl;
+    }
+
+    // Enable/disable the baked lightmaps
+    if (glfwGetKey(window, GLFW_KEY_B) == GLFW_PRESS && !gUseLightmaps)
+    {
+        gUseLightmaps = true;
+        cout << "Baked lightmaps enabled" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_J) == GLFW_PRESS && gUseLightmaps)
+    {
+        gUseLightmaps = false;
+        cout << "Baked lightmaps disabled" << endl;
+    }
+
+    // Enable/disable the per object light lists
+    if (glfwGetKey(window, GLFW_KEY_U) == GLFW_PRESS && !gUseObjectLightLists)
+    {
+        gUseObjectLightLists = true;
+        cout << "Per object light lists enabled" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS && gUseObjectLightLists)
+    {
+        gUseObjectLightLists = false;
+        cout << "Per object light lists disabled" << endl;
+    }
+
+    // Switch between deferred and forward shading
+    if (glfwGetKey(window, GLFW_KEY_X) == GLFW_PRESS && !gUseDeferred)
+    {
+        if (gDeferredAvailable)
+        {
+            gUseDeferred = true;
+            cout << "Switched to deferred shading" << endl;
+        }
+    }
+    else if (glfwGetKey(window, GLFW_KEY_Z) == GLFW_PRESS && gUseDeferred)
+    {
+        gUseDeferred = false;
+        cout << "Switched to forward shading" << endl;
+    }
+
+    // Enable/disable lamp orbiting
+    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS && !gIsLampOrbiting)
+    {
+        gIsLampOrbiting = true;
+        cout << "Light orbit enabled" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS && gIsLampOrbiting)
+    {
+        gIsLampOrbiting = false;
+        cout << "Light orbit disabled" << endl;
+    }
+}
+
+// GLFW: whenever the window size changed (by OS or user resize) this callback function executes
+// -------------------------------------------------------
+void UResizeWindow(GLFWwindow* window, int width, int height)
+{
+    glViewport(0, 0, width, height);
+    if (width > 0 && height > 0)
+    {
+        gFramebufferWidth = width;
+        gFramebufferHeight = height;
+    }
+
+    // The G-buffer follows the size of the window; a minimized window keeps the old one
+    if (gDeferredAvailable && width > 0 && height > 0)
+    {
+        UDestroyGBuffer();
+        UCreateGBuffer(width, height);
+    }
+}
+
+// GLFW: whenever the mouse moves, this callback is called
+// -------------------------------------------------------
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+{
+    if (gFirstMouse)
+    {
+        gLastX = xpos;
+        gLastY = ypos;
+        gFirstMouse = false;
+    }
+
+    float xoffset = xpos - gLastX;
     float yoffset = gLastY - ypos; // reversed since y-coordinates go from bottom to top
 
     gLastX = xpos;
@@ -603,6 +1500,12 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
             gCamera.ResetCameraPosition();
         }
         break;
+    case GLFW_MOUSE_BUTTON_MIDDLE:
+        if (action == GLFW_PRESS)
+        {
+            UPickObject();
+        }
+        break;
     case GLFW_MOUSE_BUTTON_RIGHT:
         if (action == GLFW_PRESS &&
             (glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS ||
@@ -626,19 +1529,40 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 // Function called to render a frame
 void URender()
 {
-    // Lamp orbits around the origin
+    // Lights orbit around the origin
     const float angularVelocity = glm::radians(45.0f);
     if (gIsLampOrbiting)
     {
-        glm::vec4 newPosition = glm::rotate(angularVelocity * gDeltaTime, glm::vec3(0.0f, -1.0f, 0.0f)) * glm::vec4(gLightPosition, 1.0f);
-        gLightPosition.x = newPosition.x;
-        gLightPosition.y = newPosition.y;
-        gLightPosition.z = newPosition.z;
+        for (SceneLight& light : gLights)
+        {
+            if (light.orbitAxis != glm::vec3(0.0f))
+            {
+                light.position = glm::vec3(glm::rotate(angularVelocity * gDeltaTime, light.orbitAxis) * glm::vec4(light.position, 1.0f));
+            }
+        }
+
+        URefitLamps();
+    }
+    UUploadLights();
+    if (gUseObjectLightLists)
+    {
+        UBuildObjectLightLists();
+    }
+    if (gUseShadows)
+    {
+        UUpdateShadowMaps();
+    }
+
+    UUpdateProbes();
 
-        glm::vec4 newPosition2 = glm::rotate(angularVelocity * gDeltaTime, glm::vec3(1.0f, 1.0f, 1.0f)) * glm::vec4(gLightPosition2, 1.0f);
-        gLightPosition2.x = newPosition2.x;
-        gLightPosition2.y = newPosition2.y;
-        gLightPosition2.z = newPosition2.z;
+    // Static objects take their light from the lightmaps while the lights stand still. Once they stop somewhere new the
+    // lightmaps are baked again in the background, and the static objects are lit like the rest until the bake is in.
+    UFinishLightmapBake();
+    bool useLightmaps = gUseLightmaps && !gIsLampOrbiting;
+    if (useLightmaps && !ULightmapsCurrent())
+    {
+        UStartLightmapBake();
+        useLightmaps = false;
     }
 
     // Enable z-depth
@@ -649,1162 +1573,2000 @@ void URender()
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     // Declare variables for rendering
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glm::vec2 uvScale;
     glm::mat4 view,
-        projection,
-        scale,
-        rotation,
-        translation,
-        model;
-    GLint texWrapMode = GL_REPEAT,
-        uvScaleLoc,
-        viewLoc,
-        projLoc,
-        modelLoc,
-        lightColorLoc,
-        lightPositionLoc,
-        viewPositionLoc,
-        lightColorLoc2,
-        lightPositionLoc2,
-        viewPositionLoc2;
+        projection;
 
     if (gOrthoView)
     {
         // Camera/view transformation
         view = gCamera.GetViewMatrix();
         // Creates an orthographic (2D) projection
-        projection = glm::ortho(-(GLfloat)WINDOW_WIDTH * 0.01f, (GLfloat)WINDOW_WIDTH * 0.01f, -(GLfloat)WINDOW_HEIGHT * 0.01f, (GLfloat)WINDOW_HEIGHT * 0.01f, 0.1f, 100.0f);
+        projection = glm::ortho(-(GLfloat)WINDOW_WIDTH * 0.01f, (GLfloat)WINDOW_WIDTH * 0.01f, -(GLfloat)WINDOW_HEIGHT * 0.01f, (GLfloat)WINDOW_HEIGHT * 0.01f, NEAR_PLANE, FAR_PLANE);
     }
     else
     {
         // Camera/view transformation
         view = gCamera.GetViewMatrix();
         // Creates a perspective (3D) projection
-        projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+        projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, NEAR_PLANE, FAR_PLANE);
     }
 
-    // DESK: draw desk
-    //----------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gPlaneMesh.vao);
-
-    // Set the shader to be used
-    glUseProgram(gProgramId);
-
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(10.0f, 1.0f, 4.0f));
-    translation = glm::translate(glm::vec3(0.0f, -1.0f, 0.0f));
-    model = translation * scale; // Creates transform matrix
+    // Lights of each cluster of this view
+    UUploadLightClusters(view, projection);
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-
-    // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(1.0f, 1.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gDeskTextureId);
+    // Measure the GPU time of shading the scene
+    UBeginShadingStats();
 
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gPlaneMesh.nIndices, GL_UNSIGNED_SHORT, NULL);
+    // Forward shading uses the variant of the lit program for the lighting features in use, and the batches of static
+    // objects the lightmapped one while the lightmaps are current. Deferred shading draws the scene into the G-buffer
+    // with programs that only store the surfaces, lit afterwards.
+    const ShaderKey sceneKey = UFrameShaderKey(PIPELINE_FORWARD);
+    GLuint sceneProgramId = UShaderVariant(sceneKey);
+    GLuint batchProgramId = useLightmaps ? UShaderVariant({ PIPELINE_FORWARD, sceneKey.features | FEATURE_LIGHTMAP, sceneKey.lightCount }) : sceneProgramId;
+    if (gUseDeferred)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, gGBuffer.fbo);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        sceneProgramId = gGBufferProgramId;
+        batchProgramId = gGBufferProgramId;
+    }
 
-    // HOMEPOD: draw speaker
-    //----------------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gSphereMesh.vao);
+    // Set the shader to be used and its uniforms for the frame
+    auto useSceneProgram = [&](GLuint programId)
+    {
+        glUseProgram(programId);
+        USetFrameUniforms(view, projection);
+    };
 
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+    // Draw the batches of objects sharing a mesh and texture
+    useSceneProgram(batchProgramId);
+    glUniform1i(UNIFORM_INSTANCED, GL_TRUE);
+    for (size_t b = 0; b < gInstanceBatches.size(); b++)
+    {
+        const GLInstanceBatch& batch = gInstanceBatches[b];
 
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(0.75f, 0.75f, 0.75f));
-    translation = glm::translate(glm::vec3(6.5f, -0.25f, -2.0f));
-    model = translation * scale; // Creates transform matrix
+        // Activate the VBOs of the mesh and the instance attributes
+        glBindVertexArray(batch.vao);
+        USetFaceCulling(batch.mesh->twoSided);
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
+        // Pass the texture scale and the lights reaching any of the instances
+        glUniform2fv(UNIFORM_UV_SCALE, 1, glm::value_ptr(batch.uvScale));
+        USetObjectLights(gBatchLightLists, b);
 
-    // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(15.0f, 15.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gMeshFabricTextureId);
+        // Bind textures on corresponding texture units
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, batch.textureId);
 
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gSphereMesh.nIndices, GL_UNSIGNED_SHORT, NULL);
+        // Draws the triangles of every instance
+        UDrawMesh(*batch.mesh, batch.nInstances);
+    }
+    glUniform1i(UNIFORM_INSTANCED, GL_FALSE);
+    if (batchProgramId != sceneProgramId)
+    {
+        useSceneProgram(sceneProgramId);
+    }
 
-    // HOMEPOD: draw base
-    //-------------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gCylinderMesh.vao);
+    // Draw the round objects, measuring the triangles they cost
+    UBeginRoundObjectStats();
 
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+    // Scene objects in the view, found through the scene tree
+    MeshletCamera frustum = UMeshletCamera(projection * view, glm::mat4(1.0f), gCamera.Position, gCamera.Front, gOrthoView);
+    gVisibleObjects.assign(gSceneObjects.size(), false);
+    gSceneBvh.QueryFrustum(frustum.planes, [](unsigned int item)
+    {
+        if (item < gVisibleObjects.size())
+        {
+            gVisibleObjects[item] = true;
+        }
+    });
 
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(0.5f, 0.25f, 0.5f));
-    rotation = glm::rotate(glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-    translation = glm::translate(glm::vec3(6.5f, -0.499f, -2.0f));
-    model = translation * rotation * scale; // Creates transform matrix
+    // Without tessellation, the round objects in view draw their meshes or the level of detail that fits their size on screen.
+    // Moving objects are drawn here as well, outside the instanced draws.
+    for (size_t i = 0; i < gSceneObjects.size(); i++)
+    {
+        const SceneObject& object = gSceneObjects[i];
+        bool batched = !object.lods && object.patchShape == PATCH_NONE && !object.dynamic;
+        if (batched || (gUseTessellation && object.patchShape != PATCH_NONE) || !gVisibleObjects[i])
+        {
+            continue;
+        }
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
+        const GLMesh& mesh = object.lods && gUseMeshLods
+            ? USelectMeshLod(*object.lods, glm::vec3(object.model[3]), UMaxScale(object.model))
+            : *object.mesh;
 
-    // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(1.0f, 1.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gRubberBaseTextureId);
+        // Activate the VBOs contained within the mesh's VAO
+        glBindVertexArray(mesh.vao);
+        USetFaceCulling(mesh.twoSided);
 
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gCylinderMesh.nIndices, GL_UNSIGNED_SHORT, NULL);
+        // Pass the object's transform, shape, texture scale and lights
+        glUniformMatrix4fv(UNIFORM_MODEL, 1, GL_FALSE, glm::value_ptr(object.model));
+        glUniform2fv(UNIFORM_SHAPE_HEIGHTS, 1, glm::value_ptr(object.shapeHeights));
+        glUniform2fv(UNIFORM_UV_SCALE, 1, glm::value_ptr(object.uvScale));
+        USetObjectLights(gObjectLightLists, i);
 
-    // MOUSE PAD: draw mouse pad
-    //--------------------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gPlaneMesh.vao);
+        // Bind textures on corresponding texture units
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, object.textureId);
 
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+        // Draws the triangles; meshes split into meshlets only draw the ones the camera can see
+        if (gUseMeshletCulling && !mesh.meshlets.empty())
+        {
+            UDrawMeshlets(mesh, object.model, projection * view);
+        }
+        else
+        {
+            UDrawMesh(mesh);
+        }
+    }
 
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(2.25f, 1.0f, 2.0f));
-    translation = glm::translate(glm::vec3(6.0f, -0.999f, 1.9f));
-    model = translation * scale; // Creates transform matrix
+    // With tessellation, the round objects are refined from patches on the GPU
+    if (gUseTessellation)
+    {
+        UDrawPatches(gUseDeferred ? gSphereGBufferProgramId : UShaderVariant(UFrameShaderKey(PIPELINE_SPHERE_TESS)),
+            gSpherePatches, PATCH_SPHERE, view, projection);
+        UDrawPatches(gUseDeferred ? gCylinderGBufferProgramId : UShaderVariant(UFrameShaderKey(PIPELINE_CYLINDER_TESS)),
+            gCylinderPatches, PATCH_CYLINDER, view, projection);
+    }
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
+    UEndRoundObjectStats();
 
-    // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(1.0f, 1.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gMousePadTextureId);
+    // Light the G-buffer into the window
+    if (gUseDeferred)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        ULightGBuffer(view, projection);
+    }
 
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gPlaneMesh.nIndices, GL_UNSIGNED_SHORT, NULL);
+    UEndShadingStats();
 
-    // INFINITY CUBE: draw infinity cube
-    //----------------------------------
+    // Lamps: a marker at each light
+    //-----------------------------
     // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gCubeMesh.vao);
+    glBindVertexArray(gLampMesh->vao);
+    USetFaceCulling(gLampMesh->twoSided);
 
     // Set the shader to be used
-    glUseProgram(gProgramId);
-
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(0.375f, 0.375f, 0.375f));
-    rotation = glm::rotate(glm::radians(35.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    translation = glm::translate(glm::vec3(-6.0f, -0.624f, -1.0f));
-    model = translation * rotation * scale; // Creates transform matrix
+    glUseProgram(gLampProgramId);
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
+    // Pass matrix data to the lamp shader program's matrix uniforms
+    glUniformMatrix4fv(UNIFORM_VIEW, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(UNIFORM_PROJECTION, 1, GL_FALSE, glm::value_ptr(projection));
 
-    // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(1.0f, 1.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gInfinityCubeTextureId);
+    // Draws the triangles of every marker, placed from the light buffer
+    UDrawMesh(*gLampMesh, gLights.size());
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gCubeMesh.nIndices);
+    // Deactivate the Vertex Array Object and shader program
+    glBindVertexArray(0);
+    glUseProgram(0);
 
-    // WHITEBOARD: draw whiteboard
-    //----------------------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gWedgeMesh.vao);
+    // GLFW: Swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+    glfwSwapBuffers(gWindow); // Flips the the back buffer with the front buffer every frame.
+}
 
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+// Copy the lights into the light buffer the shaders read
+void UUploadLights()
+{
+    // The first MAX_SHADOW_LIGHTS lights casting shadows each get a cube of the shadow maps
+    vector<GLLight> lights;
+    const vector<int> previousLights = move(gShadowMaps.lights);
+    gShadowMaps.lights.clear();
+    for (size_t i = 0; i < gLights.size(); i++)
+    {
+        const SceneLight& light = gLights[i];
+        float shadowMap = -1.0f;
+        if (light.castsShadows && gShadowMaps.lights.size() < MAX_SHADOW_LIGHTS)
+        {
+            shadowMap = gShadowMaps.lights.size();
+            gShadowMaps.lights.push_back(i);
+        }
+        lights.push_back({ glm::vec4(light.position, light.markerScale), glm::vec4(light.color, light.ambientStrength),
+            glm::vec4(light.specularIntensity, light.highlightSize, light.range, shadowMap) });
+    }
 
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(4.5f, 0.625f, 1.5f));
-    translation = glm::translate(glm::vec3(0.0f, -0.374f, -2.0f));
-    model = translation * scale; // Creates transform matrix
+    // A cube handed to another light no longer holds that light's static casters
+    for (size_t cube = 0; cube < gShadowMaps.lights.size() && cube < gShadowMaps.renderedPositions.size(); cube++)
+    {
+        if (cube >= previousLights.size() || previousLights[cube] != gShadowMaps.lights[cube])
+        {
+            gShadowMaps.renderedPositions[cube] = glm::vec3(FLT_MAX);
+        }
+    }
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
+    // Replacing the whole store lets the driver hand out new memory instead of waiting on last frame's draws
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gLightBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, lights.size() * sizeof(GLLight), lights.data(), GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_BUFFER_BINDING, gLightBuffer);
+}
 
-    // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(1.0f, 1.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gAluminumTextureId);
+// Bin the lights into the clusters of the view and copy the lists into the cluster buffers
+void UUploadLightClusters(const glm::mat4& view, const glm::mat4& projection)
+{
+    if (!gUseLightClusters)
+    {
+        return;
+    }
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gWedgeMesh.nIndices);
+    vector<glm::vec4> lights;
+    for (const SceneLight& light : gLights)
+    {
+        lights.push_back(glm::vec4(glm::vec3(view * glm::vec4(light.position, 1.0f)), light.range));
+    }
+    UBuildLightClusters(projection, NEAR_PLANE, FAR_PLANE, lights, gLightClusters, &gThreadPool);
 
-    // WHITEBOARD: draw whiteboard surface
-    //------------------------------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gPlaneAngledMesh.vao);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gClusterBuffers[0]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gLightClusters.ranges.size() * sizeof(glm::uvec2), gLightClusters.ranges.data(), GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_BUFFER_BINDING, gClusterBuffers[0]);
 
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+    // An empty buffer can't be bound, keep at least one index
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gClusterBuffers[1]);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, max<size_t>(gLightClusters.indices.size(), 1) * sizeof(GLuint), gLightClusters.indices.data(), GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_INDEX_BUFFER_BINDING, gClusterBuffers[1]);
+}
 
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(4.5f, 0.625f, 1.5f));
-    translation = glm::translate(glm::vec3(0.0f, -0.373f, -2.0f));
-    model = translation * scale; // Creates transform matrix
+// Scatter small short range lights over the desk, to see how lighting scales with the number of lights
+void UAddDeskLights(int count)
+{
+    mt19937 random(330);
+    uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (int i = 0; i < count; i++)
+    {
+        SceneLight light;
+        light.position = glm::vec3(-9.5f + 19.0f * unit(random), -0.9f + 1.5f * unit(random), -3.5f + 7.0f * unit(random));
+        light.color = glm::vec3(unit(random), unit(random), unit(random)) * 0.6f;
+        light.ambientStrength = 0.0f;
+        light.markerScale = 0.05f;
+        light.range = 1.0f + 2.0f * unit(random);
+        gLights.push_back(light);
+    }
+    cout << "INFO: " << gLights.size() << " lights in the scene" << endl;
+}
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
+// Pass the camera and light data shared by every object of the frame to the program in use
+void USetFrameUniforms(const glm::mat4& view, const glm::mat4& projection)
+{
+    const glm::vec3 cameraPosition = gCamera.Position;
 
     // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(1.0f, 1.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gWhiteboardTextureId);
+    glUniformMatrix4fv(UNIFORM_VIEW, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(UNIFORM_PROJECTION, 1, GL_FALSE, glm::value_ptr(projection));
+
+    // Pass the number of lights in the light buffer and the camera position
+    glUniform1i(UNIFORM_LIGHT_COUNT, gLights.size());
+    glUniform3f(UNIFORM_VIEW_POSITION, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+
+    // Pass how fragments find their light cluster; tiles are in framebuffer pixels, like gl_FragCoord
+    glUniform1i(UNIFORM_SHOW_CLUSTER_HEATMAP, gShowClusterHeatmap);
+    glUniform3i(UNIFORM_CLUSTER_COUNTS, CLUSTERS_X, CLUSTERS_Y, CLUSTERS_Z);
+    glUniform2f(UNIFORM_CLUSTER_TILE_SIZE, (GLfloat)gFramebufferWidth / CLUSTERS_X, (GLfloat)gFramebufferHeight / CLUSTERS_Y);
+    glUniform1f(UNIFORM_CLUSTER_DEPTH_SCALE, gLightClusters.depthScale);
+    glUniform1f(UNIFORM_CLUSTER_DEPTH_BIAS, gLightClusters.depthBias);
+
+    // Draws without a light list of their own use the clusters
+    glUniform1i(UNIFORM_OBJECT_LIGHT_COUNT, -1);
+
+    // Pass where the shadow maps are
+    glUniform1i(UNIFORM_SHADOW_MAPS, SHADOW_MAP_UNIT);
+    glUniform1i(UNIFORM_DYNAMIC_SHADOW_MAPS, DYNAMIC_SHADOW_MAP_UNIT);
+    glUniform1i(UNIFORM_DYNAMIC_SHADOWS, gShadowMaps.hasDynamicCasters);
+    glUniform1f(UNIFORM_SHADOW_FAR_PLANE, FAR_PLANE);
+
+    // Pass where the lightmap is
+    glUniform1i(UNIFORM_LIGHTMAP, LIGHTMAP_UNIT);
+
+    // Pass the probe grid
+    glUniform3fv(UNIFORM_PROBE_GRID_ORIGIN, 1, glm::value_ptr(gProbeGrid.origin));
+    glUniform3fv(UNIFORM_PROBE_GRID_SPACING, 1, glm::value_ptr(gProbeGrid.spacing));
+    glUniform3iv(UNIFORM_PROBE_GRID_COUNTS, 1, glm::value_ptr(gProbeGrid.counts));
+}
 
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gPlaneAngledMesh.nIndices, GL_UNSIGNED_SHORT, NULL);
+// Give each instanced object a part of the lightmap atlas. These are the static cubes and planes, whose flat faces
+// box unwrap without overlapping.
+void ULayoutLightmaps()
+{
+    vector<SceneObject*> objects;
+    vector<LightmapRect> rects;
+    vector<glm::vec2> cellWorldSizes; // World size of a grid cell, the largest face it holds
+    for (SceneObject& object : gSceneObjects)
+    {
+        if (object.lods || object.patchShape != PATCH_NONE || object.dynamic)
+        {
+            continue;
+        }
 
-    // KEYBOARD: draw keyboard
-    //------------------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gWedgeMesh.vao);
+        // Faces of the mesh: a face across the x axis spans z by y, one across y spans x by z and one across z spans x by y
+        const vector<glm::vec3>& corners = object.mesh->bvh.corners;
+        const glm::vec3 axes = 2.0f * glm::vec3(glm::length(object.model[0]), glm::length(object.model[1]), glm::length(object.model[2]));
+        glm::ivec2 low(3, 2), high(0);
+        glm::vec2 cellWorldSize(0.0f);
+        for (size_t i = 0; i < corners.size(); i += 3)
+        {
+            int face = ULightmapFace(glm::cross(corners[i + 1] - corners[i], corners[i + 2] - corners[i]));
+            glm::ivec2 cell(face % 3, face / 3);
+            low = glm::min(low, cell);
+            high = glm::max(high, cell);
+            cellWorldSize = glm::max(cellWorldSize, face < 2 ? glm::vec2(axes.z, axes.y) : (face < 4 ? glm::vec2(axes.x, axes.z) : glm::vec2(axes.x, axes.y)));
+        }
 
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+        objects.push_back(&object);
+        rects.push_back({ glm::ivec2(0), low, high - low + 1, glm::ivec2(0), glm::vec4(0.0f) });
+        cellWorldSizes.push_back(cellWorldSize);
+    }
 
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(4.125f, 0.125f, 1.125f));
-    translation = glm::translate(glm::vec3(-0.75f, -0.874f, 2.0f));
-    model = translation * scale; // Creates transform matrix
+    // Lower the texel density until everything fits
+    float density = LIGHTMAP_TEXELS_PER_UNIT;
+    for (;; density /= 2.0f)
+    {
+        for (size_t i = 0; i < rects.size(); i++)
+        {
+            rects[i].cellSize = glm::clamp(glm::ivec2(glm::ceil(cellWorldSizes[i] * density)), glm::ivec2(16), glm::ivec2(LIGHTMAP_SIZE / 3));
+        }
+        if (UPackLightmapAtlas(rects, LIGHTMAP_SIZE))
+        {
+            break;
+        }
+    }
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        objects[i]->lightmap = rects[i].scaleOffset;
+    }
+    cout << "INFO: Lightmap atlas holds " << objects.size() << " objects at " << density << " texels per unit" << endl;
+}
 
-    // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(1.0f, 1.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gAluminumTextureId);
+// Bake the lightmaps for the lights where they are now and upload them, waiting for the bake
+void UBakeLightmaps()
+{
+    auto start = chrono::steady_clock::now();
+    vector<glm::vec4> lightmap;
+    size_t texels = UBakeLightmapTexels(gLights, gSceneBvh, gThreadPool, lightmap);
+    UUploadLightmaps(lightmap, gLights);
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gWedgeMesh.nIndices);
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    cout << "INFO: Baked " << texels << " lightmap texels for " << gLights.size() << " lights in " << elapsed.count() << " ms" << endl;
+}
 
-    // KEYBOARD: draw keyboard surface
-    //--------------------------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gPlaneAngledMesh.vao);
+// Bake the ambient and diffuse light of the given lights reaching the lightmapped objects into an atlas, across the pool's
+// threads, and return the number of texels lit. Only reads the scene objects, so it can run beside the frames.
+size_t UBakeLightmapTexels(const vector<SceneLight>& lights, const Bvh& sceneBvh, ThreadPool& pool, vector<glm::vec4>& lightmap)
+{
+    // The point and normal under each atlas texel covered by a triangle
+    struct LightmapTexel
+    {
+        int index;
+        glm::vec3 position;
+        glm::vec3 normal;
+    };
+    vector<LightmapTexel> texels;
+    vector<bool> covered(LIGHTMAP_SIZE * LIGHTMAP_SIZE, false);
+    for (const SceneObject& object : gSceneObjects)
+    {
+        if (object.lightmap == glm::vec4(0.0f))
+        {
+            continue;
+        }
 
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+        // The atlas coordinates come from the mesh as the vertex shader finds them, the points from the reshaped and placed mesh
+        const vector<glm::vec3>& corners = object.mesh->bvh.corners;
+        for (size_t i = 0; i < corners.size(); i += 3)
+        {
+            glm::vec3 faceNormal = glm::cross(corners[i + 1] - corners[i], corners[i + 2] - corners[i]);
+            glm::vec3 world[3];
+            glm::vec2 atlas[3];
+            for (int k = 0; k < 3; k++)
+            {
+                world[k] = glm::vec3(object.model * glm::vec4(UShapePosition(corners[i + k], object.shapeHeights), 1.0f));
+                atlas[k] = (UBoxUnwrap(corners[i + k], faceNormal) * glm::vec2(object.lightmap) + glm::vec2(object.lightmap.z, object.lightmap.w)) * float(LIGHTMAP_SIZE);
+            }
+            glm::vec3 normal = glm::normalize(glm::cross(world[1] - world[0], world[2] - world[0]));
+            URasterizeLightmapTriangle(atlas, LIGHTMAP_SIZE, [&](int x, int y, const glm::vec3& barycentric)
+            {
+                int index = y * LIGHTMAP_SIZE + x;
+                if (!covered[index])
+                {
+                    covered[index] = true;
+                    texels.push_back({ index, barycentric.x * world[0] + barycentric.y * world[1] + barycentric.z * world[2], normal });
+                }
+            });
+        }
+    }
 
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(4.125f, 0.125f, 1.125f));
-    translation = glm::translate(glm::vec3(-0.75f, -0.873f, 2.0f));
-    model = translation * scale; // Creates transform matrix
+    // Light every texel, then spread the results into the margins around them
+    lightmap.assign(LIGHTMAP_SIZE * LIGHTMAP_SIZE, glm::vec4(0.0f));
+    pool.ParallelFor(texels.size(), 256, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            lightmap[texels[i].index] = glm::vec4(ULightmapLight(texels[i].position, texels[i].normal, lights, sceneBvh), 1.0f);
+        }
+    });
+    UDilateLightmap(lightmap, LIGHTMAP_SIZE, 4);
+    return texels.size();
+}
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
+// Copy a baked atlas into the lightmap texture and bind it, noting where the lights were for it
+void UUploadLightmaps(const vector<glm::vec4>& lightmap, const vector<SceneLight>& lights)
+{
+    if (!gLightmapTextureId)
+    {
+        glGenTextures(1, &gLightmapTextureId);
+        glBindTexture(GL_TEXTURE_2D, gLightmapTextureId);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+    glBindTexture(GL_TEXTURE_2D, gLightmapTextureId);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, LIGHTMAP_SIZE, LIGHTMAP_SIZE, 0, GL_RGBA, GL_FLOAT, lightmap.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
 
-    // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(1.0f, 1.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
+    glActiveTexture(GL_TEXTURE0 + LIGHTMAP_UNIT);
+    glBindTexture(GL_TEXTURE_2D, gLightmapTextureId);
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gKeyboardTextureId);
 
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gPlaneAngledMesh.nIndices, GL_UNSIGNED_SHORT, NULL);
+    gBakedLightPositions.clear();
+    for (const SceneLight& light : lights)
+    {
+        gBakedLightPositions.push_back(light.position);
+    }
+}
 
-    // TRACKPAD: draw trackpad
-    //------------------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gWedgeMesh.vao);
+// Start baking the lightmaps for the lights where they are now on the bake thread, unless a bake is already running
+void UStartLightmapBake()
+{
+    LightmapBake& bake = gLightmapBake;
+    if (bake.thread.joinable())
+    {
+        return;
+    }
+    bake.lights = gLights;
+    bake.sceneBvh = gSceneBvh;
+    bake.done = false;
+    bake.thread = thread([&bake]
+    {
+        auto start = chrono::steady_clock::now();
+        bake.bakedTexels = UBakeLightmapTexels(bake.lights, bake.sceneBvh, gBakeThreadPool, bake.texels);
+        bake.milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        bake.done = true;
+    });
+}
 
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+// Upload a finished background bake, or drop it when the lights have moved since it started. wait blocks until a running
+// bake is done.
+void UFinishLightmapBake(bool wait)
+{
+    LightmapBake& bake = gLightmapBake;
+    if (!bake.thread.joinable() || (!wait && !bake.done))
+    {
+        return;
+    }
+    bake.thread.join();
 
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(1.5625f, 0.125f, 1.125f));
-    rotation = glm::rotate(glm::radians(20.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    translation = glm::translate(glm::vec3(-7.5f, -0.874f, 1.5f));
-    model = translation * rotation * scale; // Creates transform matrix
+    bool current = bake.lights.size() == gLights.size();
+    for (size_t i = 0; current && i < gLights.size(); i++)
+    {
+        current = bake.lights[i].position == gLights[i].position;
+    }
+    if (current)
+    {
+        UUploadLightmaps(bake.texels, bake.lights);
+        cout << "INFO: Baked " << bake.bakedTexels << " lightmap texels for " << bake.lights.size() << " lights in "
+            << bake.milliseconds << " ms in the background" << endl;
+    }
+    bake.texels.clear();
+}
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
+// Ambient and diffuse light at a point of a lightmapped surface: the fragment shader's Phong terms without the view
+// dependent specular, with shadows found by rays through the scene tree
+glm::vec3 ULightmapLight(const glm::vec3& position, const glm::vec3& normal)
+{
+    return ULightmapLight(position, normal, gLights, gSceneBvh);
+}
 
-    // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(1.0f, 1.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gAluminumTextureId);
+// The same from copies of the lights and the scene tree, for bakes running beside the frames
+glm::vec3 ULightmapLight(const glm::vec3& position, const glm::vec3& normal, const vector<SceneLight>& lights, const Bvh& sceneBvh)
+{
+    glm::vec3 lighting(0.0f);
+    for (const SceneLight& light : lights)
+    {
+        glm::vec3 toLight = light.position - position;
+        float distance = glm::length(toLight);
+        if (light.range > 0.0f && distance >= light.range)
+        {
+            continue;
+        }
+        float fade = light.range > 0.0f ? glm::pow(glm::clamp(1.0f - glm::pow(distance / light.range, 4.0f), 0.0f, 1.0f), 2.0f) : 1.0f;
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gWedgeMesh.nIndices);
+        // A ray from just off the surface to the light; the lamp markers don't block their own light
+        glm::vec3 direction = toLight / distance;
+        float impact = glm::max(glm::dot(normal, direction), 0.0f);
+        if (impact > 0.0f)
+        {
+            BvhRay ray = { position + normal * 0.005f, direction, distance };
+            float hit = sceneBvh.Raycast(ray, [](unsigned int item, const BvhRay& search)
+            {
+                return item < gSceneObjects.size()
+                    ? URaycastMesh(*gSceneObjects[item].mesh, gSceneObjects[item].model, gSceneObjects[item].shapeHeights, search)
+                    : FLT_MAX;
+            });
+            impact = hit == FLT_MAX ? impact : 0.0f;
+        }
 
-    // TRACKPAD: draw trackpad surface
-    //--------------------------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gPlaneAngledMesh.vao);
+        lighting += (light.ambientStrength + impact) * light.color * fade;
+    }
+    return lighting;
+}
 
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+// Whether the lightmaps were baked with the lights where they are now
+bool ULightmapsCurrent()
+{
+    if (gBakedLightPositions.size() != gLights.size())
+    {
+        return false;
+    }
+    for (size_t i = 0; i < gLights.size(); i++)
+    {
+        if (gBakedLightPositions[i] != gLights[i].position)
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(1.5625f, 0.125f, 1.125f));
-    rotation = glm::rotate(glm::radians(20.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    translation = glm::translate(glm::vec3(-7.5f, -0.873f, 1.5f));
-    model = translation * rotation * scale; // Creates transform matrix
+// Place the probe grid over the scene objects, bake every probe and bind the buffer holding them
+void UCreateProbes()
+{
+    Aabb bounds;
+    for (size_t item = 0; item < gSceneObjects.size(); item++)
+    {
+        bounds.Grow(gSceneBounds[item]);
+    }
+    gProbeGrid.Fit(bounds.min - glm::vec3(0.25f), bounds.max + glm::vec3(0.25f), 1.5f, 12);
+    gProbeDirections = USphereDirections(PROBE_RAYS);
+    gProbes.assign(gProbeGrid.Count(), GLProbe());
+    gProbeQueued.assign(gProbeGrid.Count(), false);
+    gDirtyProbes.clear();
+
+    glGenBuffers(1, &gProbeBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gProbeBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gProbes.size() * sizeof(GLProbe), nullptr, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PROBE_BUFFER_BINDING, gProbeBuffer);
+
+    auto start = chrono::steady_clock::now();
+    vector<int> all(gProbeGrid.Count());
+    for (int probe = 0; probe < gProbeGrid.Count(); probe++)
+    {
+        all[probe] = probe;
+    }
+    UBakeProbes(all);
+    gProbeLightPositions.clear();
+    for (const SceneLight& light : gLights)
+    {
+        gProbeLightPositions.push_back(light.position);
+    }
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    cout << "INFO: Baked " << gProbeGrid.counts.x << " x " << gProbeGrid.counts.y << " x " << gProbeGrid.counts.z
+        << " light probes in " << elapsed.count() << " ms" << endl;
+}
 
-    // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(1.0f, 1.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTrackpadTextureId);
+// Bake the listed probes across the worker threads and upload them
+void UBakeProbes(const vector<int>& probes)
+{
+    gThreadPool.ParallelFor(probes.size(), 1, [&](int begin, int end)
+    {
+        const float weight = 4.0f * std::numbers::pi_v<float> / PROBE_RAYS;
+        for (int i = begin; i < end; i++)
+        {
+            const glm::vec3 position = gProbeGrid.Position(probes[i]);
+
+            // Light from the open room, which is what the flat ambient terms stood for, reaches the probe past the objects around it
+            glm::vec3 environment(0.0f);
+            for (const SceneLight& light : gLights)
+            {
+                float distance = glm::length(light.position - position);
+                float fade = light.range > 0.0f ? glm::pow(glm::clamp(1.0f - glm::pow(distance / light.range, 4.0f), 0.0f, 1.0f), 2.0f) : 1.0f;
+                environment += light.ambientStrength * light.color * fade / std::numbers::pi_v<float>;
+            }
+
+            SHProbe sh;
+            int backFaces = 0;
+            for (const glm::vec3& direction : gProbeDirections)
+            {
+                bool backFace = false;
+                USHAddRadiance(sh, direction, UProbeRadiance({ position, direction, PROBE_RAY_LENGTH }, environment, backFace), weight);
+                backFaces += backFace ? 1 : 0;
+            }
+            USHConvolveCosine(sh);
+
+            // A probe that sees the inside of an object is stuck in it, and would darken the surfaces next to it
+            GLProbe& probe = gProbes[probes[i]];
+            for (int k = 0; k < SH_COEFFICIENTS; k++)
+            {
+                probe.coefficients[k] = glm::vec4(sh.coefficients[k], 0.0f);
+            }
+            probe.coefficients[0].w = backFaces > PROBE_RAYS / 4 ? 0.0f : 1.0f;
+        }
+    });
 
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gPlaneAngledMesh.nIndices, GL_UNSIGNED_SHORT, NULL);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gProbeBuffer);
+    for (int probe : probes)
+    {
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, probe * sizeof(GLProbe), sizeof(GLProbe), &gProbes[probe]);
+    }
+}
 
-    // MOUSE: draw mouse surface
-    //--------------------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gSphereMesh.vao);
+// Queue the probes the lights that moved can reach, then bake the oldest few in the queue
+void UUpdateProbes()
+{
+    const bool countChanged = gProbeLightPositions.size() != gLights.size();
+    gProbeLightPositions.resize(gLights.size());
+    for (size_t i = 0; i < gLights.size(); i++)
+    {
+        const SceneLight& light = gLights[i];
+        if (!countChanged && gProbeLightPositions[i] == light.position)
+        {
+            continue;
+        }
 
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+        // Its light reaches surfaces within its range of where it was or is now, which probes see up to a ray length away
+        const float reach = light.range + PROBE_RAY_LENGTH;
+        for (int probe = 0; probe < gProbeGrid.Count(); probe++)
+        {
+            glm::vec3 position = gProbeGrid.Position(probe);
+            if (!gProbeQueued[probe] && (countChanged || light.range <= 0.0f
+                || glm::length(position - gProbeLightPositions[i]) < reach || glm::length(position - light.position) < reach))
+            {
+                gProbeQueued[probe] = true;
+                gDirtyProbes.push_back(probe);
+            }
+        }
+        gProbeLightPositions[i] = light.position;
+    }
 
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(0.5f, 0.75f, 0.1f));
-    rotation = glm::rotate(glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-    translation = glm::translate(glm::vec3(6.0f, -0.9f, 1.9f));
-    model = translation * rotation * scale; // Creates transform matrix
+    if (gDirtyProbes.empty())
+    {
+        return;
+    }
+    size_t count = glm::min<size_t>(gDirtyProbes.size(), PROBES_PER_FRAME);
+    vector<int> batch(gDirtyProbes.begin(), gDirtyProbes.begin() + count);
+    gDirtyProbes.erase(gDirtyProbes.begin(), gDirtyProbes.begin() + count);
+    for (int probe : batch)
+    {
+        gProbeQueued[probe] = false;
+    }
+    UBakeProbes(batch);
+}
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
+// Light arriving at a probe along a ray: the open room's when it reaches nothing, or the direct and ambient light
+// a grey surface it hits reflects. backFace is set when the ray hits the inside of an object.
+glm::vec3 UProbeRadiance(const BvhRay& ray, const glm::vec3& environment, bool& backFace)
+{
+    unsigned int item = 0;
+    float distance = gSceneBvh.Raycast(ray, [](unsigned int item, const BvhRay& search)
+    {
+        return item < gSceneObjects.size()
+            ? URaycastMesh(*gSceneObjects[item].mesh, gSceneObjects[item].model, gSceneObjects[item].shapeHeights, search)
+            : FLT_MAX;
+    }, &item);
+    if (distance == FLT_MAX)
+    {
+        return environment;
+    }
 
-    // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(1.0f, 1.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gMouseTextureId);
+    // Find the normal of the triangle hit, testing only up to the hit
+    const SceneObject& object = gSceneObjects[item];
+    glm::vec3 normal(0.0f);
+    BvhRay hit = { ray.origin, ray.direction, distance * 1.001f + 1e-4f };
+    URaycastMesh(*object.mesh, object.model, object.shapeHeights, hit, &normal);
+    if (glm::dot(normal, ray.direction) > 0.0f)
+    {
+        backFace = true;
+        return glm::vec3(0.0f);
+    }
+    return PROBE_BOUNCE_ALBEDO / std::numbers::pi_v<float> * ULightmapLight(ray.origin + ray.direction * distance, normal);
+}
 
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gSphereMesh.nIndices, GL_UNSIGNED_SHORT, NULL);
+// Create the framebuffer and cube map arrays the shadows are drawn into
+bool UCreateShadowMaps()
+{
+    // Dynamic casters get maps of their own only when the scene has any
+    for (const SceneObject& object : gSceneObjects)
+    {
+        gShadowMaps.hasDynamicCasters |= object.dynamic;
+    }
 
-    // MOUSE: draw mouse base
-    //-----------------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gCubeMesh.vao);
+    auto createMaps = [](GLuint& textureId)
+    {
+        glGenTextures(1, &textureId);
+        glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, textureId);
+        glTexImage3D(GL_TEXTURE_CUBE_MAP_ARRAY, 0, GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, MAX_SHADOW_LIGHTS * 6, 0,
+            GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    };
+    createMaps(gShadowMaps.staticMaps);
+    gShadowMaps.dynamicMaps = 0;
+    if (gShadowMaps.hasDynamicCasters)
+    {
+        createMaps(gShadowMaps.dynamicMaps);
+    }
+    glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, 0);
+
+    // Only depth is drawn; each face of each cube is attached in turn
+    glGenFramebuffers(1, &gShadowMaps.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gShadowMaps.fbo);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, gShadowMaps.staticMaps, 0, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Nothing has been drawn yet
+    gShadowMaps.renderedPositions.assign(MAX_SHADOW_LIGHTS, glm::vec3(FLT_MAX));
+    return complete;
+}
 
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+void UDestroyShadowMaps()
+{
+    glDeleteFramebuffers(1, &gShadowMaps.fbo);
+    glDeleteTextures(1, &gShadowMaps.staticMaps);
+    if (gShadowMaps.hasDynamicCasters)
+    {
+        glDeleteTextures(1, &gShadowMaps.dynamicMaps);
+    }
+}
 
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(0.5f, 0.04f, 0.75f));
-    translation = glm::translate(glm::vec3(6.0f, -0.949f, 1.9f));
-    model = translation * scale; // Creates transform matrix
+// Draw the static casters again for the lights that moved since their maps were drawn, and the dynamic casters for every
+// light, then bind the maps for the lit programs. With the lights standing still only the dynamic casters are drawn.
+void UUpdateShadowMaps()
+{
+    bool drawn = false;
+    for (size_t cube = 0; cube < gShadowMaps.lights.size(); cube++)
+    {
+        const glm::vec3& position = gLights[gShadowMaps.lights[cube]].position;
+        if (position != gShadowMaps.renderedPositions[cube])
+        {
+            UDrawShadowCasters(position, gShadowMaps.staticMaps, cube, false);
+            gShadowMaps.renderedPositions[cube] = position;
+            drawn = true;
+        }
+        if (gShadowMaps.hasDynamicCasters)
+        {
+            UDrawShadowCasters(position, gShadowMaps.dynamicMaps, cube, true);
+            drawn = true;
+        }
+    }
 
-    // Reference matrix uniforms from the shader program
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-    modelLoc = glGetUniformLocation(gProgramId, "model");
+    // Back to the window
+    if (drawn)
+    {
+        int width, height;
+        glfwGetFramebufferSize(gWindow, &width, &height);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
+    }
 
-    // Pass matrix data to the shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Reference matrix uniforms
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    lightColorLoc2 = glGetUniformLocation(gProgramId, "lightColor2");
-    lightPositionLoc2 = glGetUniformLocation(gProgramId, "lightPos2");
-    viewPositionLoc2 = glGetUniformLocation(gProgramId, "viewPosition2");
-
-    // Pass color, light, and camera data to the shader program's corresponding uniforms
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-    glUniform3f(lightColorLoc2, gLightColor2.r, gLightColor2.g, gLightColor2.b);
-    glUniform3f(lightPositionLoc2, gLightPosition2.x, gLightPosition2.y, gLightPosition2.z);
-    glUniform3f(viewPositionLoc2, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    // Set texture scale
-    uvScale = glm::vec2(1.0f, 1.0f);
-    uvScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(uvScaleLoc, 1, glm::value_ptr(uvScale));
-
-    // Bind textures on corresponding texture units
+    glActiveTexture(GL_TEXTURE0 + SHADOW_MAP_UNIT);
+    glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, gShadowMaps.staticMaps);
+    glActiveTexture(GL_TEXTURE0 + DYNAMIC_SHADOW_MAP_UNIT);
+    glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, gShadowMaps.dynamicMaps);
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gAluminumTextureId);
-
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gCubeMesh.nIndices);
-
-    // LAMP 1: draw lamp
-    //----------------
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gSphereMesh.vao);
-
-    // Set the shader to be used
-    glUseProgram(gLampProgramId);
-
-    // Set scale, rotation, and translation
-    scale = glm::scale(glm::vec3(1.0f, 0.5f, 1.0f));
-    rotation = glm::rotate(45.0f, glm::vec3(0.0f, 1.0f, 0.0f));
-    translation = glm::translate(glm::vec3(0.0f, 0.0f, 0.0f));
-    model = translation * rotation * scale; // Creates transform matrix
-
-    // Transform the smaller sphere used as a visual clue for the light source
-    model = glm::translate(gLightPosition) * glm::scale(gLightScale);
-
-    // Reference matrix uniforms from the lamp shader program
-    viewLoc = glGetUniformLocation(gLampProgramId, "view");
-    projLoc = glGetUniformLocation(gLampProgramId, "projection");
-    modelLoc = glGetUniformLocation(gLampProgramId, "model");
-
-    // Pass matrix data to the lamp shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gSphereMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
-
-    // LAMP 2: draw lamp
-    //------------------
-    // Set the shader to be used
-    glUseProgram(gLampProgramId);
-
-    // Transform the smaller sphere used as a visual clue for the light source
-    model = glm::translate(gLightPosition2) * glm::scale(gLightScale2);
-
-    // Reference matrix uniforms from the lamp shader program
-    modelLoc = glGetUniformLocation(gLampProgramId, "model");
-    viewLoc = glGetUniformLocation(gLampProgramId, "view");
-    projLoc = glGetUniformLocation(gLampProgramId, "projection");
-
-    // Pass matrix data to the lamp shader program's matrix uniforms
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gSphereMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
-
-    // Deactivate the Vertex Array Object and shader program
-    glBindVertexArray(0);
-    glUseProgram(0);
-
-    // GLFW: Swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-    glfwSwapBuffers(gWindow); // Flips the the back buffer with the front buffer every frame.
 }
 
-// Create cube mesh, specifying height of front and back (0 to 1, default to 1)
-void UCreateCubeMesh(GLMesh& mesh, float frontHeight, float backHeight)
+// Draw the distance from a light to the static or dynamic casters into the six faces of one cube of a cube map array
+void UDrawShadowCasters(const glm::vec3& lightPosition, GLuint maps, int cube, bool dynamic)
 {
-    if (frontHeight < 0 || frontHeight > 1 || backHeight < 0 || backHeight > 1)
-    {
-        throw invalid_argument("Height must be between 0 and 1");
-    }
-
-    float fh = -1 + (frontHeight * 2), bh = -1 + (backHeight * 2);
-
-    GLfloat verts[] = {
-        // Positions           // Normals            //Textures
-        // ----------------------------------------------------
-        // Back Face          Negative Z Normal     Texture Coords.
-       -1.0f, -1.0f, -1.0f,   0.0f,  0.0f, -1.0f,   0.0f, 0.0f,
-        1.0f, -1.0f, -1.0f,   0.0f,  0.0f, -1.0f,   1.0f, 0.0f,
-        1.0f,  bh,   -1.0f,   0.0f,  0.0f, -1.0f,   1.0f, 1.0f,
-        1.0f,  bh,   -1.0f,   0.0f,  0.0f, -1.0f,   1.0f, 1.0f,
-       -1.0f,  bh,   -1.0f,   0.0f,  0.0f, -1.0f,   0.0f, 1.0f,
-       -1.0f, -1.0f, -1.0f,   0.0f,  0.0f, -1.0f,   0.0f, 0.0f,
-
-        // Front Face         Positive Z Normal     Texture Coords.
-       -1.0f, -1.0f,  1.0f,   0.0f,  0.0f,  1.0f,   0.0f, 0.0f,
-        1.0f, -1.0f,  1.0f,   0.0f,  0.0f,  1.0f,   1.0f, 0.0f,
-        1.0f,  fh,    1.0f,   0.0f,  0.0f,  1.0f,   1.0f, 1.0f,
-        1.0f,  fh,    1.0f,   0.0f,  0.0f,  1.0f,   1.0f, 1.0f,
-       -1.0f,  fh,    1.0f,   0.0f,  0.0f,  1.0f,   0.0f, 1.0f,
-       -1.0f, -1.0f,  1.0f,   0.0f,  0.0f,  1.0f,   0.0f, 0.0f,
-
-        // Left Face           Negative X Normal    Texture Coords.
-       -1.0f,  fh,    1.0f,  -1.0f,  0.0f,  0.0f,   1.0f, 0.0f,
-       -1.0f,  bh,   -1.0f,  -1.0f,  0.0f,  0.0f,   1.0f, 1.0f,
-       -1.0f, -1.0f, -1.0f,  -1.0f,  0.0f,  0.0f,   0.0f, 1.0f,
-       -1.0f, -1.0f, -1.0f,  -1.0f,  0.0f,  0.0f,   0.0f, 1.0f,
-       -1.0f, -1.0f,  1.0f,  -1.0f,  0.0f,  0.0f,   0.0f, 0.0f,
-       -1.0f,  fh,    1.0f,  -1.0f,  0.0f,  0.0f,   1.0f, 0.0f,
-
-        // Right Face         Positive X Normal     Texture Coords.
-        1.0f,  fh,    1.0f,   1.0f,  0.0f,  0.0f,   1.0f, 0.0f,
-        1.0f,  bh,   -1.0f,   1.0f,  0.0f,  0.0f,   1.0f, 1.0f,
-        1.0f, -1.0f, -1.0f,   1.0f,  0.0f,  0.0f,   0.0f, 1.0f,
-        1.0f, -1.0f, -1.0f,   1.0f,  0.0f,  0.0f,   0.0f, 1.0f,
-        1.0f, -1.0f,  1.0f,   1.0f,  0.0f,  0.0f,   0.0f, 0.0f,
-        1.0f,  fh,    1.0f,   1.0f,  0.0f,  0.0f,   1.0f, 0.0f,
-
-        // Bottom Face        Negative Y Normal     Texture Coords.
-       -1.0f, -1.0f, -1.0f,   0.0f, -1.0f,  0.0f,   0.0f, 1.0f,
-        1.0f, -1.0f, -1.0f,   0.0f, -1.0f,  0.0f,   1.0f, 1.0f,
-        1.0f, -1.0f,  1.0f,   0.0f, -1.0f,  0.0f,   1.0f, 0.0f,
-        1.0f, -1.0f,  1.0f,   0.0f, -1.0f,  0.0f,   1.0f, 0.0f,
-       -1.0f, -1.0f,  1.0f,   0.0f, -1.0f,  0.0f,   0.0f, 0.0f,
-       -1.0f, -1.0f, -1.0f,   0.0f, -1.0f,  0.0f,   0.0f, 1.0f,
-
-        // Top Face           Positive Y Normal     Texture Coords.
-       -1.0f,  bh,   -1.0f,   0.0f,  1.0f,  0.0f,   0.0f, 1.0f,
-        1.0f,  bh,   -1.0f,   0.0f,  1.0f,  0.0f,   1.0f, 1.0f,
-        1.0f,  fh,    1.0f,   0.0f,  1.0f,  0.0f,   1.0f, 0.0f,
-        1.0f,  fh,    1.0f,   0.0f,  1.0f,  0.0f,   1.0f, 0.0f,
-       -1.0f,  fh,    1.0f,   0.0f,  1.0f,  0.0f,   0.0f, 0.0f,
-       -1.0f,  bh,   -1.0f,   0.0f,  1.0f,  0.0f,   0.0f, 1.0f
-    };
-
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+    // Cube map faces in layer order (+x, -x, +y, -y, +z, -z), each looking out of the light with the up vector the cube map expects
+    const glm::vec3 directions[6] = { { 1.0f, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, -1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, -1.0f } };
+    const glm::vec3 ups[6] = { { 0.0f, -1.0f, 0.0f }, { 0.0f, -1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, -1.0f }, { 0.0f, -1.0f, 0.0f }, { 0.0f, -1.0f, 0.0f } };
+    const glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, NEAR_PLANE, FAR_PLANE);
 
-    mesh.nIndices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
-
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbos[0]);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    glBindFramebuffer(GL_FRAMEBUFFER, gShadowMaps.fbo);
+    glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+    glEnable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE); // The planes cast shadows from both sides
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+    glUseProgram(gShadowProgramId);
+    glUniformMatrix4fv(UNIFORM_PROJECTION, 1, GL_FALSE, glm::value_ptr(projection));
+    glUniform3fv(UNIFORM_LIGHT_POSITION, 1, glm::value_ptr(lightPosition));
+    glUniform1f(UNIFORM_SHADOW_FAR_PLANE, FAR_PLANE);
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    for (int face = 0; face < 6; face++)
+    {
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, maps, 0, cube * 6 + face);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glm::mat4 view = glm::lookAt(lightPosition, lightPosition + directions[face], ups[face]);
+        glUniformMatrix4fv(UNIFORM_VIEW, 1, GL_FALSE, glm::value_ptr(view));
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+        // The instanced draws hold only static objects
+        if (!dynamic)
+        {
+            glUniform1i(UNIFORM_INSTANCED, GL_TRUE);
+            for (const GLInstanceBatch& batch : gInstanceBatches)
+            {
+                glBindVertexArray(batch.vao);
+                UDrawMesh(*batch.mesh, batch.nInstances);
+            }
+            glUniform1i(UNIFORM_INSTANCED, GL_FALSE);
+        }
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+        // The rest cast their shadows with their full meshes
+        for (const SceneObject& object : gSceneObjects)
+        {
+            bool batched = !object.lods && object.patchShape == PATCH_NONE && !object.dynamic;
+            if (batched || object.dynamic != dynamic)
+            {
+                continue;
+            }
+            glBindVertexArray(object.mesh->vao);
+            glUniformMatrix4fv(UNIFORM_MODEL, 1, GL_FALSE, glm::value_ptr(object.model));
+            glUniform2fv(UNIFORM_SHAPE_HEIGHTS, 1, glm::value_ptr(object.shapeHeights));
+            UDrawMesh(*object.mesh);
+        }
+    }
 }
 
-// Create cylinder mesh
-void UCreateCylinderMesh(GLMesh& mesh)
+// List the lights reaching the bounds of each scene object, and merge the lists of the objects of each instanced draw
+void UBuildObjectLightLists()
 {
-    // Set number of sections making up the cylinder
-    const int slices = 24;
-    const float angle = 2 * numbers::pi / slices;
-
-    const int secCircOffset = slices + 1;
-    const int triangleSize = 3;
-
-    glm::vec3 vertex[(slices + 1) * 2];
-
-    const int numVerts = sizeof(vertex) / sizeof(vertex[0]) * 8;
-    const int numIndices = slices * triangleSize * 4;
-
-    GLfloat verts[numVerts];
-    GLushort indices[numIndices];
+    vector<glm::vec4> lights;
+    for (const SceneLight& light : gLights)
+    {
+        lights.push_back(glm::vec4(light.position, light.range));
+    }
+    UBuildLightLists(lights, gSceneBounds.data(), gSceneObjects.size(), gObjectLightLists);
 
-    for (int i = 0; i <= slices; i++)
+    // An instanced draw shades every light reaching one of its instances, each once
+    vector<bool> listed(gLights.size(), false);
+    gBatchLightLists.ranges.resize(gInstanceBatches.size());
+    gBatchLightLists.indices.clear();
+    for (size_t batch = 0; batch < gInstanceBatches.size(); batch++)
     {
-        if (i == slices)
+        glm::uvec2& range = gBatchLightLists.ranges[batch];
+        range.x = gBatchLightLists.indices.size();
+        for (unsigned int object : gInstanceBatches[batch].objects)
         {
-            vertex[i] = glm::vec3(0, 0, 1);
-            vertex[i + secCircOffset] = glm::vec3(0, 0, -1);
+            const glm::uvec2 objectRange = gObjectLightLists.ranges[object];
+            for (unsigned int k = objectRange.x; k < objectRange.x + objectRange.y; k++)
+            {
+                unsigned int light = gObjectLightLists.indices[k];
+                if (!listed[light])
+                {
+                    listed[light] = true;
+                    gBatchLightLists.indices.push_back(light);
+                }
+            }
         }
-        else
+        range.y = gBatchLightLists.indices.size() - range.x;
+        for (unsigned int k = range.x; k < range.x + range.y; k++)
         {
-            vertex[i] = glm::vec3(glm::cos(angle * i), glm::sin(angle * i), 1);
-            vertex[i + secCircOffset] = glm::vec3(glm::cos(angle * i), glm::sin(angle * i), -1);
+            listed[gBatchLightLists.indices[k]] = false;
         }
     }
+}
 
-    // Position, normal, and texture data
-    for (int i = 0; i < numVerts / 8; i++)
+// Pass a draw its list of lights. Without lists, or when the list is too long, the draw uses the clusters.
+void USetObjectLights(const LightLists& lists, size_t item)
+{
+    if (!gUseObjectLightLists || lists.ranges[item].y > MAX_OBJECT_LIGHTS)
     {
-        int pointer = i * 8;
-
-        // Vertex positions
-        verts[pointer] = vertex[i].x;
-        verts[pointer + 1] = vertex[i].y;
-        verts[pointer + 2] = vertex[i].z;
-
-        // Normal
-        verts[pointer + 3] = vertex[i].x;
-        verts[pointer + 4] = vertex[i].y;
-        verts[pointer + 5] = vertex[i].z;
-
-        // Texture
-        verts[pointer + 6] = vertex[i].x;
-        verts[pointer + 7] = vertex[i].y;
+        glUniform1i(UNIFORM_OBJECT_LIGHT_COUNT, -1);
+        return;
     }
+    const glm::uvec2 range = lists.ranges[item];
+    glUniform1uiv(UNIFORM_OBJECT_LIGHTS, range.y, lists.indices.data() + range.x);
+    glUniform1i(UNIFORM_OBJECT_LIGHT_COUNT, range.y);
+}
 
-    // Index data to share position data
-    for (int i = 0; i < slices; i++)
-    {
-        int pointer = i * triangleSize;
-
-        indices[pointer] = i;
-        indices[pointer + 1] = slices;
-        indices[pointer + 2] = i + 1 < slices ? i + 1 : 0;
-
-        pointer += slices * triangleSize;
-
-        indices[pointer] = i + secCircOffset;
-        indices[pointer + 1] = slices + secCircOffset;
-        indices[pointer + 2] = i + 1 < slices ? i + 1 + secCircOffset : secCircOffset;
+// Create the render targets of the deferred path at the size of the window
+bool UCreateGBuffer(int width, int height)
+{
+    gGBuffer.width = width;
+    gGBuffer.height = height;
 
-        pointer += slices * triangleSize;
+    glGenFramebuffers(1, &gGBuffer.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gGBuffer.fbo);
 
-        indices[pointer] = i;
-        indices[pointer + 1] = i + secCircOffset;
-        indices[pointer + 2] = i + 1 < slices ? i + 1 : 0;
+    // Each target is read back one texel per pixel, so no filtering or mipmaps
+    auto createTarget = [width, height](GLuint& textureId, GLenum internalFormat, GLenum format, GLenum type, GLenum attachment)
+    {
+        glGenTextures(1, &textureId);
+        glBindTexture(GL_TEXTURE_2D, textureId);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, textureId, 0);
+    };
+    createTarget(gGBuffer.albedo, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_COLOR_ATTACHMENT0);
+    createTarget(gGBuffer.normal, GL_RG16, GL_RG, GL_UNSIGNED_SHORT, GL_COLOR_ATTACHMENT1);
+    createTarget(gGBuffer.depth, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, GL_DEPTH_ATTACHMENT);
+    glBindTexture(GL_TEXTURE_2D, 0);
 
-        pointer += slices * triangleSize;
+    const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, drawBuffers);
 
-        indices[pointer] = i + secCircOffset;
-        indices[pointer + 1] = i + 1 < slices ? i + 1 : 0;
-        indices[pointer + 2] = i + 1 < slices ? i + 1 + secCircOffset : secCircOffset;
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (!complete)
+    {
+        cout << "ERROR::FRAMEBUFFER::G_BUFFER_INCOMPLETE" << endl;
     }
+    return complete;
+}
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+void UDestroyGBuffer()
+{
+    glDeleteFramebuffers(1, &gGBuffer.fbo);
+    const GLuint textures[] = { gGBuffer.albedo, gGBuffer.normal, gGBuffer.depth };
+    glDeleteTextures(3, textures);
+}
 
-    glGenVertexArrays(1, &mesh.vao); // We can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+// Shade every pixel of the G-buffer once with the lights of its cluster. The pass writes the stored depth so anything
+// drawn forward afterwards is still hidden behind the scene.
+void ULightGBuffer(const glm::mat4& view, const glm::mat4& projection)
+{
+    const GLuint programId = UShaderVariant(UFrameShaderKey(PIPELINE_DEFERRED_LIGHTING));
+    glUseProgram(programId);
+    USetFrameUniforms(view, projection);
+    glUniformMatrix4fv(UNIFORM_INVERSE_VIEW_PROJECTION, 1, GL_FALSE, glm::value_ptr(glm::inverse(projection * view)));
+    glUniform2f(UNIFORM_VIEWPORT_SIZE, gGBuffer.width, gGBuffer.height);
+
+    // Bind the G-buffer on texture units 0 to 2
+    const GLuint textures[] = { gGBuffer.albedo, gGBuffer.normal, gGBuffer.depth };
+    for (int unit = 0; unit < 3; unit++)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, textures[unit]);
+    }
+    glActiveTexture(GL_TEXTURE0);
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    // One triangle covers the screen; it passes the depth test everywhere and takes its depth from the G-buffer
+    glDepthFunc(GL_ALWAYS);
+    glDisable(GL_CULL_FACE);
+    glBindVertexArray(gFullscreenVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glDepthFunc(GL_LESS);
+}
 
-    mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+// Create cube mesh, specifying height of front and back (0 to 1, default to 1)
+void UCreateCubeMesh(GLMesh& mesh, float frontHeight, float backHeight)
+{
+    // The scene's cube and wedge are already built
+    if (frontHeight == 1.0f && backHeight == 1.0f)
+    {
+        UCreateMesh(mesh, CUBE_TABLE);
+    }
+    else if (frontHeight == 0.4f && backHeight == 1.0f)
+    {
+        UCreateMesh(mesh, WEDGE_TABLE);
+    }
+    else
+    {
+        UCreateMesh(mesh, UCubeTable(frontHeight, backHeight));
+    }
+}
 
-    // Strides between vertex coordinates
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV); // The number of floats before each
+// Create cylinder mesh with the given number of sections around it
+void UCreateCylinderMesh(GLMesh& mesh, int slices)
+{
+    // Counts out of range are clamped, so a bad setting still gives a usable mesh
+    const int maxSlices = MAX_MESH_VERTICES / 2 - 1;
+    if (slices < 3 || slices > maxSlices)
+    {
+        int clamped = glm::clamp(slices, 3, maxSlices);
+        cout << "INFO: Cylinder slices must be between 3 and " << maxSlices << ", using " << clamped << " instead of " << slices << endl;
+        slices = clamped;
+    }
+    const int numVerts = CylinderVertexCount(slices);
+    const int numIndices = CylinderIndexCount(slices);
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    // Build the mesh in staging memory, released once it is uploaded
+    StagingArena::Scope staging(gStagingArena);
+    GLfloat* verts = gStagingArena.Allocate<GLfloat>(numVerts * FLOATS_PER_ELEMENT);
+    GLushort* indices = gStagingArena.Allocate<GLushort>(numIndices);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    // Position, normal, texture and index data
+    UGenerateCylinder(verts, indices, slices, &gThreadPool);
+    UPrintWindingReport("Cylinder", UCheckWinding(verts, indices, numIndices));
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    UCreateMesh(mesh, verts, numVerts, indices, numIndices);
 }
 
 // Create plane mesh (default angle set to 0)
 void UCreatePlaneMesh(GLMesh& mesh, float frontHeight, float backHeight)
 {
-    if (frontHeight < 0 || frontHeight > 1 || backHeight < 0 || backHeight > 1)
+    // The scene's flat and angled planes are already built
+    if (frontHeight == 0.5f && backHeight == 0.5f)
     {
-        throw invalid_argument("Height must be between 0 and 1");
+        UCreateMesh(mesh, PLANE_TABLE);
     }
+    else if (frontHeight == 0.4f && backHeight == 1.0f)
+    {
+        UCreateMesh(mesh, PLANE_ANGLED_TABLE);
+    }
+    else
+    {
+        UCreateMesh(mesh, UPlaneTable(frontHeight, backHeight));
+    }
+}
 
-    float fh = -1 + (frontHeight * 2), bh = -1 + (backHeight * 2);
-
-    GLfloat verts[] = {
-        // Positions        // Normals            //Textures
-        // -------------------------------------------------
-       -1.0f,  fh,  1.0f,   0.0f,  1.0f,  0.0f,   0.0f, 1.0f, // Index 0 - top left
-        1.0f,  fh,  1.0f,   0.0f,  1.0f,  0.0f,   1.0f, 1.0f, // Index 1 - top right
-        1.0f,  bh, -1.0f,   0.0f,  1.0f,  0.0f,   1.0f, 0.0f, // Index 2 - bottom right
-       -1.0f,  bh, -1.0f,   0.0f,  1.0f,  0.0f,   0.0f, 0.0f, // Index 3 - bottom left
-    };
-
-    // Index data to share position data
-    GLushort indices[] = {
-        0, 1, 3,  // Triangle 1
-        1, 2, 3   // Triangle 2
-    };
+// Create pyramid mesh
+void UCreatePyramidMesh(GLMesh& mesh)
+{
+    UCreateMesh(mesh, PYRAMID_TABLE);
+}
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+// Create sphere mesh with the given number of latitude and longitude divisions
+void UCreateSphereMesh(GLMesh& mesh, int complexity)
+{
+    // Counts out of range are clamped, so a bad setting still gives a usable mesh
+    const int maxComplexity = static_cast<int>(sqrt(static_cast<double>(MAX_MESH_VERTICES))) - 1;
+    if (complexity < 2 || complexity > maxComplexity)
+    {
+        int clamped = glm::clamp(complexity, 2, maxComplexity);
+        cout << "INFO: Sphere complexity must be between 2 and " << maxComplexity << ", using " << clamped << " instead of " << complexity << endl;
+        complexity = clamped;
+    }
+    const int numVerts = UVSphereVertexCount(complexity);
+    const int numIndices = UVSphereIndexCount(complexity);
 
-    glGenVertexArrays(1, &mesh.vao); // We can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+    // Build the mesh in staging memory, released once it is uploaded
+    StagingArena::Scope staging(gStagingArena);
+    GLfloat* verts = gStagingArena.Allocate<GLfloat>(numVerts * FLOATS_PER_ELEMENT);
+    GLushort* indices = gStagingArena.Allocate<GLushort>(numIndices);
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    // Position, normal, texture and index data
+    UGenerateUVSphere(verts, indices, complexity, &gThreadPool);
+    UPrintWindingReport("UV sphere", UCheckWinding(verts, indices, numIndices));
 
-    mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+    UCreateMesh(mesh, verts, numVerts, indices, numIndices);
+}
 
-    // Strides between vertex coordinates
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV); // The number of floats before each
+// Create icosphere mesh
+void UCreateIcoSphereMesh(GLMesh& mesh, int subdivisions)
+{
+    // Counts out of range are clamped, so a bad setting still gives a usable mesh
+    if (subdivisions < 0 || subdivisions > MAX_ICO_SPHERE_SUBDIVISIONS)
+    {
+        int clamped = glm::clamp(subdivisions, 0, MAX_ICO_SPHERE_SUBDIVISIONS);
+        cout << "INFO: Icosphere subdivisions must be between 0 and " << MAX_ICO_SPHERE_SUBDIVISIONS << ", using " << clamped << " instead of " << subdivisions << endl;
+        subdivisions = clamped;
+    }
+    UGenerateIcoSphere(gStagingMesh, subdivisions);
+    UPrintWindingReport("Icosphere", UCheckWinding(gStagingMesh));
+    UCreateMesh(mesh, gStagingMesh);
+}
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+// Create cube sphere mesh
+void UCreateCubeSphereMesh(GLMesh& mesh, int divisions)
+{
+    // Counts out of range are clamped, so a bad setting still gives a usable mesh
+    if (divisions < 1 || divisions > MAX_CUBE_SPHERE_DIVISIONS)
+    {
+        int clamped = glm::clamp(divisions, 1, MAX_CUBE_SPHERE_DIVISIONS);
+        cout << "INFO: Cube sphere divisions must be between 1 and " << MAX_CUBE_SPHERE_DIVISIONS << ", using " << clamped << " instead of " << divisions << endl;
+        divisions = clamped;
+    }
+    UGenerateCubeSphere(gStagingMesh, divisions);
+    UPrintWindingReport("Cube sphere", UCheckWinding(gStagingMesh));
+    UCreateMesh(mesh, gStagingMesh);
+}
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Upload generated vertex and index data to a new indexed mesh
+void UCreateMesh(GLMesh& mesh, const MeshData& data, bool buildMeshlets)
+{
+    if (!buildMeshlets)
+    {
+        UCreateMesh(mesh, data.verts.data(), data.VertexCount(), data.indices.data(), data.indices.size());
+        return;
+    }
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    // Upload the triangles grouped by meshlet, so each meshlet is a range of the index buffer
+    MeshletData meshlets;
+    UBuildMeshlets(data, meshlets);
+    UCreateMesh(mesh, data.verts.data(), data.VertexCount(), meshlets.indices.data(), meshlets.indices.size());
+    mesh.meshlets = move(meshlets.meshlets);
 }
 
-// Create pyramid mesh
-void UCreatePyramidMesh(GLMesh& mesh)
+// Upload interleaved vertex data and 16 bit indices to a new indexed mesh
+void UCreateMesh(GLMesh& mesh, const GLfloat* verts, GLuint nVertices, const GLushort* indices, GLuint nIndices)
 {
-    GLfloat verts[] = {
-        // Positions           // Normals            //Textures
-        // ----------------------------------------------------
-        0.0f,  0.75f,  0.0f,   0.0f,  1.0f,  0.0f,   0.5f, 0.5f, // Index 0 - top point
-        0.5f, -0.75f,  0.5f,   1.0f,  0.5f,  1.0f,   0.0f, 0.0f, // Index 1 - base point 1
-       -0.5f, -0.75f,  0.5f,  -1.0f,  0.5f,  1.0f,   1.0f, 0.0f, // Index 2 - base point 2
-        0.5f, -0.75f, -0.5f,   1.0f,  0.5f, -1.0f,   0.0f, 1.0f, // Index 3 - base point 3
-       -0.5f, -0.75f, -0.5f,  -1.0f,  0.5f, -1.0f,   0.0f, 0.0f, // Index 4 - base point 4
+    UUploadMesh(mesh, verts, nVertices, indices, nIndices);
 
-    };
-
-    // Index data to share position data
-    GLushort indices[] = {
-        1, 0, 3, // Triangle 1, pyramid side 1
-        3, 0, 4, // Triangle 2, pyramid side 2
-        4, 0, 2, // Triangle 3, pyramid side 3
-        2, 0, 1, // Triangle 4, pyramid side 4
-        2, 1, 3, // Triangle 5, pyramid bottom 1
-        2, 4, 3, // Triangle 6, pyramid bottom 2
-    };
+    // Bounding box of the vertex positions
+    mesh.boundsMin = mesh.boundsMax = glm::make_vec3(verts);
+    for (GLuint i = 1; i < nVertices; i++)
+    {
+        glm::vec3 position = glm::make_vec3(verts + i * FLOATS_PER_ELEMENT);
+        mesh.boundsMin = glm::min(mesh.boundsMin, position);
+        mesh.boundsMax = glm::max(mesh.boundsMax, position);
+    }
+}
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+// Upload a compile time mesh table; its bounds were computed with it
+template <int VertexCount, int IndexCount>
+void UCreateMesh(GLMesh& mesh, const MeshTable<VertexCount, IndexCount>& table)
+{
+    UUploadMesh(mesh, table.verts, VertexCount, IndexCount > 0 ? table.indices : nullptr, IndexCount);
+    mesh.boundsMin = glm::make_vec3(table.boundsMin);
+    mesh.boundsMax = glm::make_vec3(table.boundsMax);
+}
 
+// Send vertex data, and indices when the mesh has them, to the GPU and describe the vertex layout
+void UUploadMesh(GLMesh& mesh, const GLfloat* verts, GLuint nVertices, const GLushort* indices, GLuint nIndices)
+{
     glGenVertexArrays(1, &mesh.vao); // We can also generate multiple VAOs or buffers at the same time
     glBindVertexArray(mesh.vao);
 
     // Create 2 buffers: first one for the vertex data; second one for the indices
     glGenBuffers(2, mesh.vbos);
     glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    glBufferData(GL_ARRAY_BUFFER, nVertices * FLOATS_PER_ELEMENT * sizeof(GLfloat), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+
+    // Unindexed meshes draw their vertices in order
+    mesh.indexed = indices != nullptr;
+    mesh.twoSided = false;
+    mesh.nIndices = indices ? nIndices : nVertices;
+    mesh.nVertices = nVertices;
+    mesh.nBytes = nVertices * FLOATS_PER_ELEMENT * sizeof(GLfloat) + (indices ? nIndices * sizeof(GLushort) : 0);
+    mesh.bvh.Build(verts, nVertices, indices, nIndices);
+    if (indices)
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, nIndices * sizeof(GLushort), indices, GL_STATIC_DRAW);
+    }
 
-    mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+    UDescribeVertexLayout();
+}
 
+// Describe the interleaved position, normal and texture coordinate layout of the bound vertex buffer
+void UDescribeVertexLayout()
+{
     // Strides between vertex coordinates
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV); // The number of floats before each
+    GLint stride = sizeof(float) * FLOATS_PER_ELEMENT; // The number of floats before each
 
     // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
+    glVertexAttribPointer(0, FLOATS_PER_VERTEX, GL_FLOAT, GL_FALSE, stride, 0);
     glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * floatsPerVertex));
+    glVertexAttribPointer(1, FLOATS_PER_NORMAL, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * FLOATS_PER_VERTEX));
     glEnableVertexAttribArray(1);
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
+    glVertexAttribPointer(2, FLOATS_PER_UV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (FLOATS_PER_VERTEX + FLOATS_PER_NORMAL)));
     glEnableVertexAttribArray(2);
 }
 
-// Create sphere mesh
-void UCreateSphereMesh(GLMesh& mesh)
+// Get the shared mesh built by a generator with the given parameters, generating and uploading it on first use
+shared_ptr<GLMesh> UAcquireMesh(MeshGenerator generator, float param0, float param1)
 {
-    const int complexity = 32;
-
-    glm::vec3 vertex[complexity + 1][complexity + 1];
-
-    const int numVerts = (complexity + 1) * (complexity + 1) * 8;
-    const int numIndices = numVerts / 8 * 2 * 3;
-
-    GLfloat verts[numVerts];
-    GLushort indices[numIndices];
+    const MeshKey key = { generator, { param0, param1 } };
+    gMeshRegistry.requests++;
 
-    // Position, normal, and texture data
-    for (int i = 0; i < complexity + 1; i++)
+    auto found = gMeshRegistry.meshes.find(key);
+    if (found != gMeshRegistry.meshes.end())
     {
-        float lat = (((i - 0) * (numbers::pi + numbers::pi)) / complexity) - numbers::pi;
-
-        for (int j = 0; j < complexity + 1; j++)
+        if (shared_ptr<GLMesh> mesh = found->second.lock())
         {
-            float log = (((j - 0) * (numbers::pi / 2 + numbers::pi / 2)) / complexity) - numbers::pi / 2;
-
-            vertex[i][j] = glm::vec3
-            (
-                glm::sin(lat) * glm::cos(log),
-                glm::sin(lat) * glm::sin(log),
-                glm::cos(lat)
-            );
-
-            int pointer = ((i * (complexity + 1)) + j) * 8;
-
-            // Vertex positions
-            verts[pointer] = vertex[i][j].x;
-            verts[pointer + 1] = vertex[i][j].y;
-            verts[pointer + 2] = vertex[i][j].z;
-
-            // Normal
-            verts[pointer + 3] = vertex[i][j].x;
-            verts[pointer + 4] = vertex[i][j].y;
-            verts[pointer + 5] = vertex[i][j].z;
-
-            // Texture
-            verts[pointer + 6] = vertex[i][j].x / 2 + 0.5;
-            verts[pointer + 7] = vertex[i][j].y / 2 + 0.5;
-
-            pointer = ((i * (complexity + 1)) + j) * 6;
-
-            indices[pointer] = i * (complexity + 1) + j;
-            indices[pointer + 1] = (i + 1) * (complexity + 1) + j;
-            indices[pointer + 2] = i * (complexity + 1) + (j + 1);
-
-            indices[pointer + 3] = (i + 1) * (complexity + 1) + (j + 1);
-            indices[pointer + 4] = (i + 1) * (complexity + 1) + j;
-            indices[pointer + 5] = i * (complexity + 1) + (j + 1);
+            gMeshRegistry.bytesSaved += mesh->nBytes;
+            return mesh;
         }
     }
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+    GLMesh created;
+    switch (generator)
+    {
+    case MESH_CUBE:
+        UCreateCubeMesh(created, param0, param1);
+        break;
+    case MESH_PLANE:
+        UCreatePlaneMesh(created, param0, param1);
+        created.twoSided = true; // Planes have no back, both sides are drawn
+        break;
+    case MESH_PYRAMID:
+        UCreatePyramidMesh(created);
+        break;
+    case MESH_CYLINDER:
+        UCreateCylinderMesh(created, static_cast<int>(param0));
+        break;
+    case MESH_UV_SPHERE:
+        UCreateSphereMesh(created, static_cast<int>(param0));
+        break;
+    case MESH_ICO_SPHERE:
+        UCreateIcoSphereMesh(created, static_cast<int>(param0));
+        break;
+    case MESH_CUBE_SPHERE:
+        UCreateCubeSphereMesh(created, static_cast<int>(param0));
+        break;
+    }
+    gMeshRegistry.uploads++;
+    gMeshRegistry.bytesUploaded += created.nBytes;
 
-    glGenVertexArrays(1, &mesh.vao); // We can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+    // The last owner releases the GPU buffers and the registry entry
+    shared_ptr<GLMesh> mesh(new GLMesh(move(created)), [key](GLMesh* released)
+    {
+        UDestroyMesh(*released);
+        gMeshRegistry.bytesUploaded -= released->nBytes;
+        auto entry = gMeshRegistry.meshes.find(key);
+        if (entry != gMeshRegistry.meshes.end() && entry->second.expired())
+        {
+            gMeshRegistry.meshes.erase(entry);
+        }
+        delete released;
+    });
+    gMeshRegistry.meshes[key] = mesh;
+    return mesh;
+}
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+// Get the shared sphere mesh of a tessellation type
+shared_ptr<GLMesh> UAcquireSphereMesh(SphereType type)
+{
+    switch (type)
+    {
+    case SPHERE_ICO:
+        return UAcquireMesh(MESH_ICO_SPHERE, 3);
+    case SPHERE_CUBE:
+        return UAcquireMesh(MESH_CUBE_SPHERE, 10);
+    default:
+        return UAcquireMesh(MESH_UV_SPHERE, 32);
+    }
+}
 
-    mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+// Print how many meshes were asked for, how many were uploaded and the GPU memory sharing saved
+void UPrintMeshRegistryStats()
+{
+    cout << "INFO: Mesh registry: " << gMeshRegistry.requests << " meshes requested, "
+        << gMeshRegistry.meshes.size() << " unique on the GPU using " << gMeshRegistry.bytesUploaded << " bytes, "
+        << gMeshRegistry.bytesSaved << " bytes saved by sharing" << endl << endl;
+}
 
-    // Strides between vertex coordinates
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV); // The number of floats before each
+// Place the objects of the scene
+void UCreateScene()
+{
+    const glm::vec3 xAxis(1.0f, 0.0f, 0.0f), yAxis(0.0f, 1.0f, 0.0f);
+    const glm::vec2 uvScale(1.0f, 1.0f);
+
+    // Shapes used by the objects
+    shared_ptr<GLMesh> plane = UAcquireMesh(MESH_PLANE, 0.5f, 0.5f);
+    shared_ptr<GLMesh> cube = UAcquireMesh(MESH_CUBE, 1.0f, 1.0f);
+    shared_ptr<GLMesh> cylinder = UAcquireMesh(MESH_CYLINDER, 24);
+
+    // Wedges and angled planes either reshape the cube and plane in the vertex shader or have baked meshes of their own.
+    // Shader heights are relative to the mesh, and the flat plane is at half height.
+    shared_ptr<GLMesh> wedge = gUseParametricShapes ? cube : UAcquireMesh(MESH_CUBE, 0.4f, 1.0f);
+    shared_ptr<GLMesh> planeAngled = gUseParametricShapes ? plane : UAcquireMesh(MESH_PLANE, 0.4f, 1.0f);
+    const glm::vec2 wedgeHeights = gUseParametricShapes ? glm::vec2(0.4f, 1.0f) : glm::vec2(1.0f);
+    const glm::vec2 planeAngledHeights = gUseParametricShapes ? glm::vec2(0.4f, 1.0f) / 0.5f : glm::vec2(1.0f);
+
+    gSceneObjects = {
+        { "Desk", plane, nullptr, gDeskTextureId, uvScale,
+            glm::translate(glm::vec3(0.0f, -1.0f, 0.0f)) * glm::scale(glm::vec3(10.0f, 1.0f, 4.0f)) },
+        { "HomePod speaker", UAcquireSphereMesh(gHomePodSphereType), &gSphereLods, gMeshFabricTextureId, glm::vec2(15.0f, 15.0f),
+            glm::translate(glm::vec3(6.5f, -0.25f, -2.0f)) * glm::scale(glm::vec3(0.75f, 0.75f, 0.75f)), glm::vec2(1.0f), PATCH_SPHERE },
+        { "HomePod base", cylinder, nullptr, gRubberBaseTextureId, uvScale,
+            glm::translate(glm::vec3(6.5f, -0.499f, -2.0f)) * glm::rotate(glm::radians(90.0f), xAxis) * glm::scale(glm::vec3(0.5f, 0.25f, 0.5f)), glm::vec2(1.0f), PATCH_CYLINDER },
+        { "Mouse pad", plane, nullptr, gMousePadTextureId, uvScale,
+            glm::translate(glm::vec3(6.0f, -0.999f, 1.9f)) * glm::scale(glm::vec3(2.25f, 1.0f, 2.0f)) },
+        { "Infinity cube", cube, nullptr, gInfinityCubeTextureId, uvScale,
+            glm::translate(glm::vec3(-6.0f, -0.624f, -1.0f)) * glm::rotate(glm::radians(35.0f), yAxis) * glm::scale(glm::vec3(0.375f, 0.375f, 0.375f)) },
+        { "Whiteboard", wedge, nullptr, gAluminumTextureId, uvScale,
+            glm::translate(glm::vec3(0.0f, -0.374f, -2.0f)) * glm::scale(glm::vec3(4.5f, 0.625f, 1.5f)), wedgeHeights },
+        { "Whiteboard surface", planeAngled, nullptr, gWhiteboardTextureId, uvScale,
+            glm::translate(glm::vec3(0.0f, -0.373f, -2.0f)) * glm::scale(glm::vec3(4.5f, 0.625f, 1.5f)), planeAngledHeights },
+        { "Keyboard", wedge, nullptr, gAluminumTextureId, uvScale,
+            glm::translate(glm::vec3(-0.75f, -0.874f, 2.0f)) * glm::scale(glm::vec3(4.125f, 0.125f, 1.125f)), wedgeHeights },
+        { "Keyboard surface", planeAngled, nullptr, gKeyboardTextureId, uvScale,
+            glm::translate(glm::vec3(-0.75f, -0.873f, 2.0f)) * glm::scale(glm::vec3(4.125f, 0.125f, 1.125f)), planeAngledHeights },
+        { "Trackpad", wedge, nullptr, gAluminumTextureId, uvScale,
+            glm::translate(glm::vec3(-7.5f, -0.874f, 1.5f)) * glm::rotate(glm::radians(20.0f), yAxis) * glm::scale(glm::vec3(1.5625f, 0.125f, 1.125f)), wedgeHeights },
+        { "Trackpad surface", planeAngled, nullptr, gTrackpadTextureId, uvScale,
+            glm::translate(glm::vec3(-7.5f, -0.873f, 1.5f)) * glm::rotate(glm::radians(20.0f), yAxis) * glm::scale(glm::vec3(1.5625f, 0.125f, 1.125f)), planeAngledHeights },
+        { "Mouse", UAcquireSphereMesh(gMouseSphereType), &gSphereLods, gMouseTextureId, uvScale,
+            glm::translate(glm::vec3(6.0f, -0.9f, 1.9f)) * glm::rotate(glm::radians(90.0f), xAxis) * glm::scale(glm::vec3(0.5f, 0.75f, 0.1f)), glm::vec2(1.0f), PATCH_SPHERE },
+        { "Mouse base", cube, nullptr, gAluminumTextureId, uvScale,
+            glm::translate(glm::vec3(6.0f, -0.949f, 1.9f)) * glm::scale(glm::vec3(0.5f, 0.04f, 0.75f)) }
+    };
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    gLampMesh = UAcquireSphereMesh(gLampSphereType);
+}
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Reshape a mesh position like the vertex shader does: the height above y = -1 scales from the back height to the front height along z
+glm::vec3 UShapePosition(const glm::vec3& position, const glm::vec2& shapeHeights)
+{
+    float raise = glm::mix(shapeHeights.y, shapeHeights.x, (position.z + 1.0f) / 2.0f);
+    return glm::vec3(position.x, -1.0f + (position.y + 1.0f) * raise, position.z);
+}
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+// World bounds of a mesh drawn with a transform and shape heights
+Aabb UObjectBounds(const GLMesh& mesh, const glm::mat4& model, const glm::vec2& shapeHeights)
+{
+    // Reshaping scales heights above y = -1 by no less than the lower height and no more than the higher one
+    glm::vec3 boundsMin = mesh.boundsMin, boundsMax = mesh.boundsMax;
+    boundsMin.y = -1.0f + (boundsMin.y + 1.0f) * glm::min(shapeHeights.x, shapeHeights.y);
+    boundsMax.y = -1.0f + (boundsMax.y + 1.0f) * glm::max(shapeHeights.x, shapeHeights.y);
+    return UTransformBounds(boundsMin, boundsMax, model);
+}
+
+// Transform of the marker drawn at a light
+glm::mat4 ULampModel(int lamp)
+{
+    return glm::translate(gLights[lamp].position) * glm::scale(glm::vec3(gLights[lamp].markerScale));
+}
+
+// Build the tree over the scene objects and the lamps
+void UBuildSceneBvh()
+{
+    gSceneBounds.clear();
+    for (const SceneObject& object : gSceneObjects)
+    {
+        gSceneBounds.push_back(UObjectBounds(*object.mesh, object.model, object.shapeHeights));
+    }
+    for (size_t lamp = 0; lamp < gLights.size(); lamp++)
+    {
+        gSceneBounds.push_back(UObjectBounds(*gLampMesh, ULampModel(lamp), glm::vec2(1.0f)));
+    }
+    gSceneBvh.Build(gSceneBounds);
+}
+
+// Move the lamps' boxes in the tree after they orbit, without rebuilding it
+void URefitLamps()
+{
+    for (size_t lamp = 0; lamp < gLights.size(); lamp++)
+    {
+        unsigned int item = gSceneObjects.size() + lamp;
+        gSceneBounds[item] = UObjectBounds(*gLampMesh, ULampModel(lamp), glm::vec2(1.0f));
+        gSceneBvh.Refit(gSceneBounds, item);
+    }
+}
+
+// Distance along a world space ray to a mesh drawn with a transform and shape heights, FLT_MAX when it misses.
+// hitNormal, when given, gets the world space face normal of the triangle hit.
+float URaycastMesh(const GLMesh& mesh, const glm::mat4& model, const glm::vec2& shapeHeights, const BvhRay& ray, glm::vec3* hitNormal)
+{
+    // Test in the mesh's own coordinates; the direction isn't normalized again so distances along the ray don't change
+    glm::mat4 inverseModel = glm::inverse(model);
+    BvhRay local = { glm::vec3(inverseModel * glm::vec4(ray.origin, 1.0f)), glm::vec3(inverseModel * glm::vec4(ray.direction, 0.0f)), ray.tMax };
+    const vector<glm::vec3>& corners = mesh.bvh.corners;
+    float nearest = FLT_MAX;
+    unsigned int triangle = 0;
+    if (shapeHeights == glm::vec2(1.0f))
+    {
+        nearest = mesh.bvh.Raycast(local, &triangle);
+    }
+    else
+    {
+        // Reshaped meshes are the cube and plane, few enough triangles to reshape and test each one
+        for (size_t i = 0; i < corners.size(); i += 3)
+        {
+            float distance = URayTriangle(local, UShapePosition(corners[i], shapeHeights),
+                UShapePosition(corners[i + 1], shapeHeights), UShapePosition(corners[i + 2], shapeHeights));
+            if (distance < nearest)
+            {
+                nearest = distance;
+                triangle = i / 3;
+            }
+        }
+    }
+
+    if (hitNormal && nearest != FLT_MAX)
+    {
+        glm::vec3 world[3];
+        for (int k = 0; k < 3; k++)
+        {
+            world[k] = glm::vec3(model * glm::vec4(UShapePosition(corners[triangle * 3 + k], shapeHeights), 1.0f));
+        }
+        *hitNormal = glm::normalize(glm::cross(world[1] - world[0], world[2] - world[0]));
+    }
+    return nearest;
+}
+
+// Print the object under the center of the view, where the camera looks
+void UPickObject()
+{
+    BvhRay ray = { gCamera.Position, gCamera.Front };
+    unsigned int item = 0;
+    float distance = gSceneBvh.Raycast(ray, [](unsigned int item, const BvhRay& search)
+    {
+        return item < gSceneObjects.size()
+            ? URaycastMesh(*gSceneObjects[item].mesh, gSceneObjects[item].model, gSceneObjects[item].shapeHeights, search)
+            : URaycastMesh(*gLampMesh, ULampModel(item - gSceneObjects.size()), glm::vec2(1.0f), search);
+    }, &item);
+
+    if (distance == FLT_MAX)
+    {
+        cout << "Nothing selected" << endl;
+    }
+    else if (item < gSceneObjects.size())
+    {
+        cout << "Selected " << gSceneObjects[item].name << " at distance " << distance << endl;
+    }
+    else
+    {
+        cout << "Selected lamp " << item - gSceneObjects.size() + 1 << " at distance " << distance << endl;
+    }
+}
+
+// Upload the patches the tessellation shaders turn into the sphere and cylinder
+void UCreatePatchMeshes()
+{
+    // Sphere: the eight faces of an octahedron, counter clockwise seen from outside
+    vector<glm::vec4> sphere;
+    for (int face = 0; face < 8; face++)
+    {
+        glm::vec4 x((face & 1) ? -1.0f : 1.0f, 0.0f, 0.0f, 0.0f);
+        glm::vec4 y(0.0f, (face & 2) ? -1.0f : 1.0f, 0.0f, 0.0f);
+        glm::vec4 z(0.0f, 0.0f, (face & 4) ? -1.0f : 1.0f, 0.0f);
+        bool flipped = (x.x * y.y * z.z) < 0.0f;
+        sphere.insert(sphere.end(), { x, flipped ? z : y, flipped ? y : z });
+    }
+
+    // Cylinder: four quarters of the side and of each cap, as (angle, height, radius, cap normal).
+    // Corners run u = 0 to 1 along the first two points and v = 0 to 1 towards the last two.
+    vector<glm::vec4> cylinder;
+    const float quarter = numbers::pi / 2;
+    for (int i = 0; i < 4; i++)
+    {
+        float a0 = quarter * i, a1 = quarter * (i + 1);
+        cylinder.insert(cylinder.end(), {
+            { a0, -1.0f, 1.0f, 0.0f }, { a1, -1.0f, 1.0f, 0.0f }, { a1, 1.0f, 1.0f, 0.0f }, { a0, 1.0f, 1.0f, 0.0f }, // Side
+            { a0, 1.0f, 1.0f, 1.0f }, { a1, 1.0f, 1.0f, 1.0f }, { a1, 1.0f, 0.0f, 1.0f }, { a0, 1.0f, 0.0f, 1.0f }, // Top, rim to center
+            { a0, -1.0f, 0.0f, -1.0f }, { a1, -1.0f, 0.0f, -1.0f }, { a1, -1.0f, 1.0f, -1.0f }, { a0, -1.0f, 1.0f, -1.0f } // Bottom, center to rim
+        });
+    }
+
+    auto upload = [](GLPatchMesh& mesh, const vector<glm::vec4>& points, GLint verticesPerPatch)
+    {
+        glGenVertexArrays(1, &mesh.vao);
+        glBindVertexArray(mesh.vao);
+        glGenBuffers(1, &mesh.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+        glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(glm::vec4), points.data(), GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), 0);
+        glEnableVertexAttribArray(0);
+        mesh.verticesPerPatch = verticesPerPatch;
+        mesh.nVertices = points.size();
+    };
+    upload(gSpherePatches, sphere, 3);
+    upload(gCylinderPatches, cylinder, 4);
+    glBindVertexArray(0);
+}
+
+void UDestroyPatchMesh(GLPatchMesh& mesh)
+{
+    glDeleteVertexArrays(1, &mesh.vao);
+    glDeleteBuffers(1, &mesh.vbo);
+}
+
+// Draw every scene object of a patch shape with a tessellation program. Programs that only store the surfaces, like
+// the G-buffer ones, pass lit as false to leave out the lighting uniforms they don't have.
+void UDrawPatches(GLuint programId, const GLPatchMesh& patches, PatchShape shape, const glm::mat4& view, const glm::mat4& projection, bool lit)
+{
+    glUseProgram(programId);
+    if (lit)
+    {
+        USetFrameUniforms(view, projection);
+    }
+    else
+    {
+        glUniformMatrix4fv(UNIFORM_VIEW, 1, GL_FALSE, glm::value_ptr(view));
+        glUniformMatrix4fv(UNIFORM_PROJECTION, 1, GL_FALSE, glm::value_ptr(projection));
+    }
+
+    // Tessellation levels come from the edge lengths on screen
+    glUniform1f(UNIFORM_VIEWPORT_HEIGHT, gFramebufferHeight);
+    glUniform1f(UNIFORM_PIXELS_PER_EDGE, gTessPixelsPerEdge);
+    glUniform1f(UNIFORM_MAX_TESS_LEVEL, gMaxTessLevel);
+
+    glBindVertexArray(patches.vao);
+    USetFaceCulling(false);
+    glPatchParameteri(GL_PATCH_VERTICES, patches.verticesPerPatch);
+    for (size_t i = 0; i < gSceneObjects.size(); i++)
+    {
+        const SceneObject& object = gSceneObjects[i];
+        if (object.patchShape != shape)
+        {
+            continue;
+        }
+
+        // Pass the object's transform, texture scale and lights
+        glUniformMatrix4fv(UNIFORM_MODEL, 1, GL_FALSE, glm::value_ptr(object.model));
+        glUniform2fv(UNIFORM_UV_SCALE, 1, glm::value_ptr(object.uvScale));
+        if (lit)
+        {
+            USetObjectLights(gObjectLightLists, i);
+        }
+
+        // Bind textures on corresponding texture units
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, object.textureId);
+
+        glDrawArrays(GL_PATCHES, 0, patches.nVertices);
+    }
+}
+
+// Start counting the triangles and GPU time of the round objects
+void UBeginRoundObjectStats()
+{
+    RoundObjectStats& stats = gRoundObjectStats;
+    glBeginQuery(GL_PRIMITIVES_GENERATED, stats.primitivesQueries[stats.frame % 2]);
+    glBeginQuery(GL_TIME_ELAPSED, stats.timeQueries[stats.frame % 2]);
+}
+
+// Stop counting, add the previous frame's results and report the throughput every few seconds
+void UEndRoundObjectStats()
+{
+    RoundObjectStats& stats = gRoundObjectStats;
+    glEndQuery(GL_PRIMITIVES_GENERATED);
+    glEndQuery(GL_TIME_ELAPSED);
+
+    if (stats.frame > 0)
+    {
+        GLuint64 triangles, nanoseconds;
+        glGetQueryObjectui64v(stats.primitivesQueries[(stats.frame - 1) % 2], GL_QUERY_RESULT, &triangles);
+        glGetQueryObjectui64v(stats.timeQueries[(stats.frame - 1) % 2], GL_QUERY_RESULT, &nanoseconds);
+        stats.triangles += triangles;
+        stats.nanoseconds += nanoseconds;
+        stats.frames++;
+    }
+    stats.frame++;
+
+    float now = glfwGetTime();
+    if (now - stats.lastReport >= 2.0f && stats.frames > 0)
+    {
+        double milliseconds = stats.nanoseconds / 1e6 / stats.frames;
+        cout << "INFO: Round objects (" << (gUseTessellation ? "tessellated" : "levels of detail") << "): "
+            << stats.triangles / stats.frames << " triangles per frame, " << milliseconds << " ms GPU, "
+            << (stats.nanoseconds > 0 ? stats.triangles * 1e3 / stats.nanoseconds : 0.0) << " M triangles/s" << endl;
+        if (stats.meshletTrianglesTotal > 0)
+        {
+            cout << "INFO: Meshlet culling drew " << stats.meshletTriangles / stats.frames << " of "
+                << stats.meshletTrianglesTotal / stats.frames << " triangles per frame" << endl;
+        }
+        stats.triangles = stats.nanoseconds = 0;
+        stats.meshletTriangles = stats.meshletTrianglesTotal = 0;
+        stats.frames = 0;
+        stats.lastReport = now;
+    }
+}
+
+// Mark the start of the frame's shading
+void UBeginShadingStats()
+{
+    ShadingStats& stats = gShadingStats;
+    glQueryCounter(stats.timestampQueries[stats.frame % 2][0], GL_TIMESTAMP);
+}
+
+// Mark the end of the frame's shading, add the previous frame's time and report it every few seconds, so forward and
+// deferred shading can be compared at different light counts
+void UEndShadingStats()
+{
+    ShadingStats& stats = gShadingStats;
+    glQueryCounter(stats.timestampQueries[stats.frame % 2][1], GL_TIMESTAMP);
+
+    if (stats.frame > 0)
+    {
+        GLuint64 start, end;
+        glGetQueryObjectui64v(stats.timestampQueries[(stats.frame - 1) % 2][0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(stats.timestampQueries[(stats.frame - 1) % 2][1], GL_QUERY_RESULT, &end);
+        stats.nanoseconds += end - start;
+        stats.frames++;
+    }
+    stats.frame++;
+
+    float now = glfwGetTime();
+    if (now - stats.lastReport >= 2.0f && stats.frames > 0)
+    {
+        cout << "INFO: " << (gUseDeferred ? "Deferred" : "Forward") << " shading, " << gLights.size() << " lights: "
+            << stats.nanoseconds / 1e6 / stats.frames << " ms GPU per frame" << endl;
+        stats.nanoseconds = 0;
+        stats.frames = 0;
+        stats.lastReport = now;
+    }
+}
+
+// Group the scene objects without levels of detail or patches by mesh, texture and texture scale, and upload each group's instance attributes
+void UCreateInstanceBatches()
+{
+    vector<vector<InstanceData>> instances;
+    for (const SceneObject& object : gSceneObjects)
+    {
+        if (object.lods || object.patchShape != PATCH_NONE || object.dynamic)
+        {
+            continue;
+        }
+
+        size_t batch = 0;
+        while (batch < gInstanceBatches.size() &&
+            (gInstanceBatches[batch].mesh != object.mesh || gInstanceBatches[batch].textureId != object.textureId || gInstanceBatches[batch].uvScale != object.uvScale))
+        {
+            batch++;
+        }
+        if (batch == gInstanceBatches.size())
+        {
+            gInstanceBatches.push_back({ 0, 0, object.mesh, object.textureId, object.uvScale, 0, {} });
+            instances.emplace_back();
+        }
+        instances[batch].push_back({ object.model, object.shapeHeights, object.lightmap });
+        gInstanceBatches[batch].nInstances++;
+        gInstanceBatches[batch].objects.push_back(&object - gSceneObjects.data());
+    }
+
+    for (size_t batch = 0; batch < gInstanceBatches.size(); batch++)
+    {
+        GLInstanceBatch& group = gInstanceBatches[batch];
+
+        // A VAO of its own reading the shared mesh's buffers, so the mesh's VAO is left as it is
+        glGenVertexArrays(1, &group.vao);
+        glBindVertexArray(group.vao);
+        glBindBuffer(GL_ARRAY_BUFFER, group.mesh->vbos[0]);
+        if (group.mesh->indexed)
+        {
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, group.mesh->vbos[1]);
+        }
+        UDescribeVertexLayout();
+
+        glGenBuffers(1, &group.instanceVbo);
+        glBindBuffer(GL_ARRAY_BUFFER, group.instanceVbo);
+        glBufferData(GL_ARRAY_BUFFER, instances[batch].size() * sizeof(InstanceData), instances[batch].data(), GL_STATIC_DRAW);
+
+        // The model matrix takes one attribute per column; each attribute advances once per instance
+        GLsizei stride = sizeof(InstanceData);
+        for (int column = 0; column < 4; column++)
+        {
+            glVertexAttribPointer(3 + column, 4, GL_FLOAT, GL_FALSE, stride, (void*)(offsetof(InstanceData, model) + sizeof(glm::vec4) * column));
+            glEnableVertexAttribArray(3 + column);
+            glVertexAttribDivisor(3 + column, 1);
+        }
+        glVertexAttribPointer(7, 2, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(InstanceData, shapeHeights));
+        glEnableVertexAttribArray(7);
+        glVertexAttribDivisor(7, 1);
+        glVertexAttribPointer(8, 4, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(InstanceData, lightmap));
+        glEnableVertexAttribArray(8);
+        glVertexAttribDivisor(8, 1);
+    }
+    glBindVertexArray(0);
+
+    cout << "INFO: " << gSceneObjects.size() << " scene objects drawn in " << gInstanceBatches.size() << " instanced draws" << endl;
+}
+
+void UDestroyInstanceBatches()
+{
+    for (GLInstanceBatch& batch : gInstanceBatches)
+    {
+        glDeleteVertexArrays(1, &batch.vao);
+        glDeleteBuffers(1, &batch.instanceVbo);
+    }
+    gInstanceBatches.clear();
+}
+
+// Draw the triangles of a mesh bound with its VAO, once or for each instance
+void UDrawMesh(const GLMesh& mesh, GLsizei nInstances)
+{
+    if (mesh.indexed)
+    {
+        glDrawElementsInstanced(GL_TRIANGLES, mesh.nIndices, GL_UNSIGNED_SHORT, NULL, nInstances);
+    }
+    else
+    {
+        glDrawArraysInstanced(GL_TRIANGLES, 0, mesh.nIndices, nInstances);
+    }
+}
+
+// Cull back faces for the next draws, unless culling is off or the mesh is seen from both sides
+void USetFaceCulling(bool twoSided)
+{
+    if (gCullBackFaces && !twoSided)
+    {
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_BACK);
+    }
+    else
+    {
+        glDisable(GL_CULL_FACE);
+    }
+}
+
+// Cull the meshlets of a mesh bound with its VAO on the CPU and draw the rest with one indirect call
+void UDrawMeshlets(const GLMesh& mesh, const glm::mat4& model, const glm::mat4& viewProjection)
+{
+    const MeshletCamera camera = UMeshletCamera(viewProjection, model, gCamera.Position, gCamera.Front, gOrthoView);
+
+    // Neighbouring visible meshlets are contiguous in the index buffer and merge into one command
+    gIndirectCommands.clear();
+    GLuint drawn = 0, total = 0;
+    for (const Meshlet& meshlet : mesh.meshlets)
+    {
+        total += meshlet.triangleCount;
+        if (!UMeshletVisible(meshlet, camera))
+        {
+            continue;
+        }
+        drawn += meshlet.triangleCount;
+
+        if (!gIndirectCommands.empty() && gIndirectCommands.back().firstIndex + gIndirectCommands.back().count == meshlet.firstIndex)
+        {
+            gIndirectCommands.back().count += meshlet.triangleCount * 3;
+        }
+        else
+        {
+            gIndirectCommands.push_back({ meshlet.triangleCount * 3, 1, meshlet.firstIndex, 0, 0 });
+        }
+    }
+    gRoundObjectStats.meshletTriangles += drawn;
+    gRoundObjectStats.meshletTrianglesTotal += total;
+
+    if (gIndirectCommands.empty())
+    {
+        return;
+    }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, gIndirectCommands.size() * sizeof(DrawElementsIndirectCommand), gIndirectCommands.data(), GL_STREAM_DRAW);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, 0, gIndirectCommands.size(), 0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+// Largest scale factor of a transform, the size of a unit object after it
+float UMaxScale(const glm::mat4& model)
+{
+    return glm::max(glm::length(glm::vec3(model[0])), glm::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+}
+
+// Simplify source mesh data into a chain of levels of detail and upload each level
+void UCreateMeshLods(GLMeshLods& lods, const MeshData& source, int levels)
+{
+    // The simplifier never folds a triangle over, so every level keeps the winding of the source
+    WindingReport winding;
+    for (MeshLod& lod : UBuildLodChain(source, levels))
+    {
+        WindingReport level = UCheckWinding(lod.data);
+        winding.triangles += level.triangles;
+        winding.flipped += level.flipped;
+        winding.degenerate += level.degenerate;
+
+        // Meshlets pay off once a level has several of them
+        GLMesh mesh;
+        UCreateMesh(mesh, lod.data, lod.data.TriangleCount() > 4 * MESHLET_MAX_TRIANGLES);
+        lods.levels.push_back(mesh);
+        lods.quadricErrors.push_back(lod.quadricError);
+    }
+    UPrintWindingReport("Levels of detail", winding);
+}
+
+// Select the coarsest level of detail whose accumulated quadric error covers at most a pixel from the current camera
+const GLMesh& USelectMeshLod(const GLMeshLods& lods, const glm::vec3& center, float scale)
+{
+    // Framebuffer pixels covered by one world unit at the object's distance; the orthographic view spans
+    // WINDOW_HEIGHT * 0.02 units from bottom to top
+    float pixelsPerUnit;
+    if (gOrthoView)
+    {
+        pixelsPerUnit = gFramebufferHeight / (WINDOW_HEIGHT * 0.02f);
+    }
+    else
+    {
+        float distance = glm::max(glm::length(center - gCamera.Position), 0.1f);
+        pixelsPerUnit = gFramebufferHeight / (2.0f * distance * glm::tan(glm::radians(gCamera.Zoom) / 2.0f));
+    }
+
+    return lods.levels[USelectLod(lods.quadricErrors, scale, pixelsPerUnit)];
+}
+
+void UDestroyMeshLods(GLMeshLods& lods)
+{
+    for (GLMesh& mesh : lods.levels)
+    {
+        UDestroyMesh(mesh);
+    }
+    lods.levels.clear();
+    lods.quadricErrors.clear();
+}
+
+// Print the vertex and triangle count of a mesh
+void UPrintMeshStats(const char* name, const GLMesh& mesh)
+{
+    cout << "INFO: " << name << ": " << mesh.nVertices << " vertices, " << mesh.nIndices / 3 << " triangles" << endl;
+}
+
+// Print the winding check of a generated mesh. The generators wind every triangle counter clockwise, so a clockwise
+// one is a generator bug to fix rather than hide, and stops debug builds.
+void UPrintWindingReport(const char* name, const WindingReport& report)
+{
+    cout << "INFO: " << name << " winding: " << report.triangles << " triangles, " << report.flipped << " clockwise, "
+        << report.degenerate << " degenerate" << endl;
+    if (report.flipped > 0)
+    {
+        cout << "ERROR: " << name << " has " << report.flipped << " clockwise triangles, culled from the outside" << endl;
+    }
+    assert(report.flipped == 0 && "Generated triangles must be counter clockwise");
+}
+
+// Time UV sphere and cylinder generation at increasing complexity:
+// the original per vertex glm::sin/glm::cos loop, the vectorized generator, and the vectorized generator on the thread pool
+void UBenchmarkMeshGeneration()
+{
+    const int runs = 5;
+    auto time = [&](auto generate)
+    {
+        generate(); // Touch the output once so page faults aren't timed
+        auto start = chrono::steady_clock::now();
+        for (int run = 0; run < runs; run++)
+        {
+            generate();
+        }
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / runs;
+    };
+
+    cout << "Mesh generation benchmark (" << gThreadPool.Size() << " threads, mean of " << runs << " runs)" << endl;
+    cout << "complexity  vertices  scalar ms  simd ms  simd+threads ms" << endl;
+
+    for (int complexity = 32; complexity <= 2048; complexity *= 2)
+    {
+        // Indices past 65535 need 32 bits; the generators are templated on the index type
+        vector<GLfloat> verts(UVSphereVertexCount(complexity) * FLOATS_PER_ELEMENT);
+        vector<GLuint> indices(UVSphereIndexCount(complexity));
+
+        // The scalar baselines write the same vertices and indices as the generators, evaluating glm::sin and
+        // glm::cos for every vertex
+        double scalar = time([&]
+        {
+            const int ring = complexity + 1;
+            for (int i = 0; i <= complexity; i++)
+            {
+                float lat = ((i * (numbers::pi + numbers::pi)) / complexity) - numbers::pi;
+                for (int j = 0; j <= complexity; j++)
+                {
+                    float log = ((j * (numbers::pi / 2 + numbers::pi / 2)) / complexity) - numbers::pi / 2;
+                    glm::vec3 vertex(glm::sin(lat) * glm::cos(log), glm::sin(lat) * glm::sin(log), glm::cos(lat));
+                    GLfloat* v = &verts[(i * ring + j) * FLOATS_PER_ELEMENT];
+                    v[0] = v[3] = vertex.x;
+                    v[1] = v[4] = vertex.y;
+                    v[2] = v[5] = vertex.z;
+                    v[6] = vertex.x / 2 + 0.5f;
+                    v[7] = vertex.y / 2 + 0.5f;
+                }
+            }
+
+            // Each triangle is wound from its own normal, as the generator does
+            for (int i = 0; i < complexity; i++)
+            {
+                for (int j = 0; j < complexity; j++)
+                {
+                    const GLuint quad[2][3] = {
+                        { GLuint(i * ring + j), GLuint((i + 1) * ring + j), GLuint(i * ring + (j + 1)) },
+                        { GLuint((i + 1) * ring + (j + 1)), GLuint(i * ring + (j + 1)), GLuint((i + 1) * ring + j) }
+                    };
+                    for (int t = 0; t < 2; t++)
+                    {
+                        const GLuint* corners = quad[t];
+                        glm::vec3 p0 = glm::make_vec3(&verts[corners[0] * FLOATS_PER_ELEMENT]);
+                        glm::vec3 p1 = glm::make_vec3(&verts[corners[1] * FLOATS_PER_ELEMENT]);
+                        glm::vec3 p2 = glm::make_vec3(&verts[corners[2] * FLOATS_PER_ELEMENT]);
+                        const bool inward = glm::dot(glm::cross(p1 - p0, p2 - p0), p0 + p1 + p2) < 0.0f;
+                        GLuint* index = &indices[(i * complexity + j) * 6 + t * 3];
+                        index[0] = corners[0];
+                        index[inward ? 2 : 1] = corners[1];
+                        index[inward ? 1 : 2] = corners[2];
+                    }
+                }
+            }
+        });
+        double simd = time([&] { UGenerateUVSphere(verts.data(), indices.data(), complexity); });
+        double threaded = time([&] { UGenerateUVSphere(verts.data(), indices.data(), complexity, &gThreadPool); });
+        cout << "sphere " << complexity << "  " << UVSphereVertexCount(complexity) << "  " << scalar << "  " << simd << "  " << threaded << endl;
+
+        verts.resize(CylinderVertexCount(complexity) * FLOATS_PER_ELEMENT);
+        indices.resize(CylinderIndexCount(complexity));
+        scalar = time([&]
+        {
+            const float angle = 2 * numbers::pi / complexity;
+            const int secCircOffset = complexity + 1;
+            for (int i = 0; i <= complexity; i++)
+            {
+                // Both caps' ring vertex, or their centers after the rings
+                for (int cap = 0; cap < 2; cap++)
+                {
+                    GLfloat* v = &verts[(i + cap * secCircOffset) * FLOATS_PER_ELEMENT];
+                    v[0] = v[3] = v[6] = i == complexity ? 0.0f : glm::cos(angle * i);
+                    v[1] = v[4] = v[7] = i == complexity ? 0.0f : glm::sin(angle * i);
+                    v[2] = v[5] = cap == 0 ? 1.0f : -1.0f;
+                }
+                if (i == complexity)
+                {
+                    continue;
+                }
+
+                // Top cap, bottom cap, then the two halves of the side quad
+                const GLuint next = i + 1 < complexity ? i + 1 : 0;
+                const GLuint triangles[4][3] = {
+                    { GLuint(i), next, GLuint(complexity) },
+                    { GLuint(i + secCircOffset), GLuint(complexity + secCircOffset), next + secCircOffset },
+                    { GLuint(i), GLuint(i + secCircOffset), next },
+                    { GLuint(i + secCircOffset), next + secCircOffset, next }
+                };
+                for (int part = 0; part < 4; part++)
+                {
+                    copy(triangles[part], triangles[part] + 3, &indices[(part * complexity + i) * 3]);
+                }
+            }
+        });
+        simd = time([&] { UGenerateCylinder(verts.data(), indices.data(), complexity); });
+        threaded = time([&] { UGenerateCylinder(verts.data(), indices.data(), complexity, &gThreadPool); });
+        cout << "cylinder " << complexity << "  " << CylinderVertexCount(complexity) << "  " << scalar << "  " << simd << "  " << threaded << endl;
+    }
+}
+
+// Time building, refitting and querying the scene tree over 100000 random objects against testing every object
+void UBenchmarkSceneBvh()
+{
+    const int objects = 100000, rays = 10000, bruteRays = 100;
+    mt19937 random(330);
+    uniform_real_distribution<float> position(-500.0f, 500.0f), size(0.1f, 3.0f);
+    vector<Aabb> bounds(objects);
+    for (Aabb& box : bounds)
+    {
+        glm::vec3 center(position(random), position(random), position(random));
+        glm::vec3 extent(size(random), size(random), size(random));
+        box = { center - extent, center + extent };
+    }
+    vector<BvhRay> tests(rays);
+    for (BvhRay& ray : tests)
+    {
+        ray = { glm::vec3(position(random), position(random), position(random)), glm::vec3(position(random), position(random), position(random)) };
+    }
+    auto hitBox = [&](unsigned int item, const BvhRay& ray) { return URayBox(ray, bounds[item]); };
+    auto elapsed = [](chrono::steady_clock::time_point start) { return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count(); };
+
+    Bvh bvh;
+    auto start = chrono::steady_clock::now();
+    bvh.Build(bounds);
+    double build = elapsed(start);
+
+    start = chrono::steady_clock::now();
+    bvh.Refit(bounds);
+    double refit = elapsed(start);
+
+    start = chrono::steady_clock::now();
+    for (unsigned int item = 0; item < 1000; item++)
+    {
+        bvh.Refit(bounds, item);
+    }
+    double refitItem = elapsed(start) / 1000;
+
+    int hits = 0;
+    start = chrono::steady_clock::now();
+    for (const BvhRay& ray : tests)
+    {
+        hits += bvh.Raycast(ray, hitBox) < FLT_MAX ? 1 : 0;
+    }
+    double traced = elapsed(start) / rays;
+
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < bruteRays; r++)
+    {
+        float nearest = FLT_MAX;
+        for (const Aabb& box : bounds)
+        {
+            nearest = glm::min(nearest, URayBox(tests[r], box));
+        }
+        hits += nearest < FLT_MAX ? 1 : 0;
+    }
+    double brute = elapsed(start) / bruteRays;
+
+    MeshletCamera frustum = UMeshletCamera(glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 1000.0f) * glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f)),
+        glm::mat4(1.0f), glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), false);
+    int visible = 0;
+    start = chrono::steady_clock::now();
+    bvh.QueryFrustum(frustum.planes, [&](unsigned int) { visible++; });
+    double query = elapsed(start);
+
+    cout << "Scene tree benchmark (" << objects << " objects, " << bvh.NodeCount() << " nodes)" << endl;
+    cout << "build ms  refit ms  refit one ms  ray ms  ray without tree ms  frustum ms (" << hits << " rays hit, " << visible << " visible)" << endl;
+    cout << build << "  " << refit << "  " << refitItem << "  " << traced << "  " << brute << "  " << query << endl;
 }
 
 void UDestroyMesh(GLMesh& mesh)
@@ -1863,67 +3625,433 @@ bool UCreateTexture(const char* filename, GLuint& textureId, bool flipImage)
 
 void UDestroyTexture(GLuint textureId)
 {
-    glGenTextures(1, &textureId);
+    glDeleteTextures(1, &textureId);
 }
 
 // Implements the UCreateShaders function
 bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+{
+    return UCreateShaderProgram(vtxShaderSource, nullptr, nullptr, fragShaderSource, programId);
+}
+
+// Create a program with tessellation stages; they are left out when their sources are null
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* tessControlShaderSource, const char* tessEvalShaderSource,
+    const char* fragShaderSource, GLuint& programId)
+{
+    PendingProgram pending;
+    USubmitShaderProgram(vtxShaderSource, tessControlShaderSource, tessEvalShaderSource, fragShaderSource, pending);
+    return UFinishShaderProgram(pending, programId);
+}
+
+// Start creating a program: load it from the binary cache, or compile each stage and link them without waiting for
+// the driver to report how it went. Stages are loaded from SPIR-V modules when they are given, which skips the driver's
+// GLSL compiler; the sources still name the program in the binary cache.
+void USubmitShaderProgram(const char* vtxShaderSource, const char* tessControlShaderSource, const char* tessEvalShaderSource,
+    const char* fragShaderSource, PendingProgram& pending, const SpirvModules* spirv)
+{
+    auto start = chrono::steady_clock::now();
+
+    // Programs linked before by this driver load from their saved binary
+    if (gProgramCacheAvailable)
+    {
+        const char* const sources[4] = { vtxShaderSource, tessControlShaderSource, tessEvalShaderSource, fragShaderSource };
+        pending.cachePath = UProgramCachePath(sources);
+        pending.fromCache = ULoadCachedProgram(pending.cachePath, pending.programId, *pending.stats);
+    }
+
+    if (!pending.fromCache)
+    {
+        // Create a Shader program object.
+        pending.programId = glCreateProgram();
+        if (gProgramCacheAvailable)
+        {
+            glProgramParameteri(pending.programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
+
+        // Compile each stage and attach it to the shader program
+        struct Stage { GLenum type; const char* source; const char* name; };
+        const Stage stages[] = {
+            { GL_VERTEX_SHADER, vtxShaderSource, "VERTEX" },
+            { GL_TESS_CONTROL_SHADER, tessControlShaderSource, "TESS_CONTROL" },
+            { GL_TESS_EVALUATION_SHADER, tessEvalShaderSource, "TESS_EVALUATION" },
+            { GL_FRAGMENT_SHADER, fragShaderSource, "FRAGMENT" }
+        };
+        pending.fromSpirv = spirv != nullptr;
+        for (int i = 0; i < 4; i++)
+        {
+            const Stage& stage = stages[i];
+            if (!stage.source)
+            {
+                continue;
+            }
+
+            GLuint shaderId = glCreateShader(stage.type);
+            if (spirv)
+            {
+                // The module is already parsed and checked; specializing it picks the entry point and sets the constants
+                const vector<char>& module = *spirv->stages[i];
+                glShaderBinary(1, &shaderId, GL_SHADER_BINARY_FORMAT_SPIR_V_ARB, module.data(), module.size());
+                bool specialized = stage.type == GL_FRAGMENT_SHADER;
+                glSpecializeShaderARB(shaderId, "main", specialized ? spirv->constantIds.size() : 0,
+                    spirv->constantIds.data(), spirv->constantValues.data());
+            }
+            else
+            {
+                glShaderSource(shaderId, 1, &stage.source, NULL);
+                glCompileShader(shaderId);
+            }
+            glAttachShader(pending.programId, shaderId);
+            pending.shaders.push_back({ shaderId, stage.name });
+        }
+
+        glLinkProgram(pending.programId); // Links the shader program
+    }
+
+    pending.milliseconds += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Whether checking a submitted program can be done without waiting for the driver. Without parallel shader compile
+// this is always true, as the check waits just as long whenever it is done.
+bool UProgramReady(const PendingProgram& pending)
+{
+    GLint done = GL_TRUE;
+    if (gParallelShaderCompile && !pending.fromCache)
+    {
+        glGetProgramiv(pending.programId, GL_COMPLETION_STATUS_KHR, &done);
+    }
+    return done == GL_TRUE;
+}
+
+// Check a submitted program, waiting for the driver when it isn't done, and print compilation and linking errors (if any)
+bool UFinishShaderProgram(PendingProgram& pending, GLuint& programId)
 {
     // Compilation and linkage error reporting
     int success = 0;
     char infoLog[512];
+    auto start = chrono::steady_clock::now();
 
-    // Create a Shader program object.
-    programId = glCreateProgram();
+    programId = pending.programId;
+    if (pending.fromCache)
+    {
+        pending.stats->loaded++;
+    }
+    else
+    {
+        // Check for linking errors, and for the compile errors that caused them
+        glGetProgramiv(programId, GL_LINK_STATUS, &success);
+        if (!success)
+        {
+            for (const auto& shader : pending.shaders)
+            {
+                UCheckShaderCompile(shader.first, shader.second);
+            }
+            glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
+            cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << endl;
+        }
+        else if (gProgramCacheAvailable)
+        {
+            USaveCachedProgram(pending.cachePath, programId);
+        }
 
-    // Create the vertex and fragment shader objects
-    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+        // The program keeps its code; the shaders are deleted once the program lets go of them
+        for (const auto& shader : pending.shaders)
+        {
+            glDetachShader(programId, shader.first);
+            glDeleteShader(shader.first);
+        }
+        pending.shaders.clear();
+        if (!success)
+        {
+            return false;
+        }
+        pending.stats->compiled++;
+        pending.stats->fromSpirv += pending.fromSpirv ? 1 : 0;
+    }
 
-    // Retrive the shader source
-    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
-    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
+    pending.milliseconds += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    pending.stats->milliseconds += pending.milliseconds;
 
-    // Compile the vertex shader, and print compilation errors (if any)
-    glCompileShader(vertexShaderId); // Compile the vertex shader
-    // Check for shader compile errors
-    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
+    glUseProgram(programId); // Uses the shader program
+
+    return true;
+}
+
+// Delete a submitted program that is no longer wanted, without waiting for the driver to finish it
+void UDiscardShaderProgram(PendingProgram& pending)
+{
+    for (const auto& shader : pending.shaders)
     {
-        glGetShaderInfoLog(vertexShaderId, 512, NULL, infoLog);
-        cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << endl;
+        glDeleteShader(shader.first);
+    }
+    pending.shaders.clear();
+    glDeleteProgram(pending.programId);
+    pending.programId = 0;
+}
 
+// Cache file of a program: a hash of its stage sources (null for the stages it doesn't have) and of the driver that
+// links it, since binaries only load on the renderer and driver version that made them
+string UProgramCachePath(const char* const sources[4])
+{
+    // 64 bit FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&hash](const char* text)
+    {
+        for (const char* c = text ? text : "(none)"; ; c++)
+        {
+            hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+            if (!*c)
+            {
+                break;
+            }
+        }
+    };
+    for (int stage = 0; stage < 4; stage++)
+    {
+        add(sources[stage]);
+    }
+    add((const char*)glGetString(GL_RENDERER));
+    add((const char*)glGetString(GL_VERSION));
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+    return string(PROGRAM_CACHE_DIRECTORY) + "/" + name;
+}
+
+// Create a program from a saved binary: its format followed by the binary itself. Fails when there is no file
+// or the driver rejects the binary, and the program is compiled from source instead.
+bool ULoadCachedProgram(const string& path, GLuint& programId, ProgramCacheStats& stats)
+{
+    ifstream file(path, ios::binary);
+    GLenum format = 0;
+    if (!file.read((char*)&format, sizeof(format)))
+    {
         return false;
     }
+    vector<char> binary((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
 
-    glCompileShader(fragmentShaderId); // Compile the fragment shader
-    // Check for shader compile errors
-    glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
+    programId = glCreateProgram();
+    glProgramBinary(programId, format, binary.data(), binary.size());
+    GLint success = 0;
+    glGetProgramiv(programId, GL_LINK_STATUS, &success);
     if (!success)
     {
-        glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
-        cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << endl;
-
+        glDeleteProgram(programId);
+        programId = 0;
+        stats.rejected++;
+        cout << "INFO: Cached program binary " << path << " was rejected, compiling it again" << endl;
         return false;
     }
+    return true;
+}
 
-    // Attached compiled shaders to the shader program
-    glAttachShader(programId, vertexShaderId);
-    glAttachShader(programId, fragmentShaderId);
+// Save a linked program's binary for the next run; a cache that can't be written only costs the next startup time
+void USaveCachedProgram(const string& path, GLuint programId)
+{
+    GLint length = 0;
+    glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+    {
+        return;
+    }
+    vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(programId, length, nullptr, &format, binary.data());
+
+    error_code error;
+    filesystem::create_directories(PROGRAM_CACHE_DIRECTORY, error);
+    ofstream file(path, ios::binary);
+    file.write((const char*)&format, sizeof(format));
+    file.write(binary.data(), binary.size());
+}
 
-    glLinkProgram(programId); // Links the shader program
-    // Check for linking errors
-    glGetProgramiv(programId, GL_LINK_STATUS, &success);
+// GLSL source of a shader file as the driver compiles it: the defines given go under its #version line, and each
+// #include of another shader file is replaced by that file, as glslang does when it builds the SPIR-V modules
+string UExpandShaderSource(const ShaderSources& sources, ShaderFile file, const string& defines)
+{
+    istringstream lines(sources.text[file]);
+    string expanded, line;
+    while (getline(lines, line))
+    {
+        if (line.rfind("#version", 0) == 0)
+        {
+            expanded += line + "\n" + defines;
+            continue;
+        }
+        if (line.rfind("#extension GL_GOOGLE_include_directive", 0) == 0)
+        {
+            continue; // Only glslang knows the directive
+        }
+        if (line.rfind("#include \"", 0) == 0)
+        {
+            string name = line.substr(10, line.find('"', 10) - 10);
+            auto included = find(begin(SHADER_FILE_NAMES), end(SHADER_FILE_NAMES), name);
+            if (included != end(SHADER_FILE_NAMES))
+            {
+                expanded += sources.text[included - begin(SHADER_FILE_NAMES)] + "\n";
+                continue;
+            }
+        }
+        expanded += line + "\n";
+    }
+    return expanded;
+}
+
+// The lit program variant for a key, submitted for compiling the first time it is asked for. Until it is ready, and
+// when it fails to compile, its pipeline's default variant is used instead; wait makes the call block until it is ready.
+GLuint UShaderVariant(const ShaderKey& key, bool wait)
+{
+    auto found = gShaderVariants.find(key);
+    if (found == gShaderVariants.end())
+    {
+        if (!gPendingVariants.count(key))
+        {
+            USubmitShaderVariant(key, gShaderSources, gPendingVariants[key]);
+        }
+        PendingProgram& pending = gPendingVariants[key];
+        if (!wait && !UProgramReady(pending))
+        {
+            found = gShaderVariants.find(UDefaultShaderKey(key.pipeline));
+            return found != gShaderVariants.end() ? found->second : 0;
+        }
+
+        GLuint programId = 0;
+        bool compiled = UFinishShaderProgram(pending, programId);
+        if (compiled)
+        {
+            UPrepareShaderVariant(key, programId);
+
+            // Reloads compile it again from the changed sources
+            lock_guard<mutex> lock(gShaderReload.mutex);
+            gShaderReload.variantKeys.push_back(key);
+        }
+        else if (programId)
+        {
+            UDestroyShaderProgram(programId);
+            programId = 0;
+        }
+
+        string names;
+        for (const auto& feature : SHADER_FEATURES)
+        {
+            names += (key.features & feature.feature) ? string(" ") + feature.name : string();
+        }
+        const char* pipelineNames[] = { "forward", "sphere tessellation", "cylinder tessellation", "deferred lighting" };
+        cout << "INFO: " << (compiled ? "Created " : "Failed to compile ") << pipelineNames[key.pipeline] << " shader variant ("
+            << (key.lightCount ? to_string(key.lightCount) + " fixed lights" : string("light count from the buffer")) << ";" << names
+            << ") in " << pending.milliseconds << " ms" << endl;
+
+        gPendingVariants.erase(key);
+        found = gShaderVariants.emplace(key, programId).first;
+    }
+
+    if (!found->second && !(key == UDefaultShaderKey(key.pipeline)))
+    {
+        auto fallback = gShaderVariants.find(UDefaultShaderKey(key.pipeline));
+        return fallback != gShaderVariants.end() ? fallback->second : 0;
+    }
+    return found->second;
+}
+
+// Hand a variant to the driver to compile, with its features defined above the lighting shader source
+void USubmitShaderVariant(const ShaderKey& key, const ShaderSources& sources, PendingProgram& pending)
+{
+    // Every feature is defined, true or false, since the shader tests them in ordinary if statements
+    string defines = "#define LIGHT_COUNT " + to_string(key.lightCount) + "\n";
+    for (const auto& feature : SHADER_FEATURES)
+    {
+        defines += string("#define ") + feature.name + ((key.features & feature.feature) ? " true\n" : " false\n");
+    }
+
+    // From SPIR-V, the same values are given to the lighting shader's specialization constants: the light count is
+    // constant 0 and each feature the one after its bit
+    SpirvModules spirv;
+    spirv.constantIds.push_back(0);
+    spirv.constantValues.push_back(key.lightCount);
+    for (int bit = 0; bit < (int)size(SHADER_FEATURES); bit++)
+    {
+        spirv.constantIds.push_back(bit + 1);
+        spirv.constantValues.push_back((key.features & SHADER_FEATURES[bit].feature) ? 1 : 0);
+    }
+    USubmitShaderFiles(sources, PIPELINE_STAGES[key.pipeline], pending, defines, spirv);
+}
+
+// Hand a program made of shader files to the driver, from their SPIR-V modules when every stage has one and from their
+// GLSL otherwise. spirv holds the specialization constants matching the defines.
+void USubmitShaderFiles(const ShaderSources& sources, const ShaderFile stages[4], PendingProgram& pending, const string& defines,
+    SpirvModules spirv)
+{
+    string text[4];
+    const char* stageSources[4] = {};
+    bool useSpirv = gSpirvAvailable;
+    for (int stage = 0; stage < 4; stage++)
+    {
+        if (stages[stage] == SHADER_NONE)
+        {
+            continue;
+        }
+        text[stage] = UExpandShaderSource(sources, stages[stage], defines);
+        stageSources[stage] = text[stage].c_str();
+        spirv.stages[stage] = &sources.spirv[stages[stage]];
+        useSpirv = useSpirv && !sources.spirv[stages[stage]].empty();
+    }
+    USubmitShaderProgram(stageSources[0], stageSources[1], stageSources[2], stageSources[3], pending, useSpirv ? &spirv : nullptr);
+}
+
+// Set the uniforms of a new variant that never change
+void UPrepareShaderVariant(const ShaderKey& key, GLuint programId)
+{
+    if (key.pipeline == PIPELINE_DEFERRED_LIGHTING)
+    {
+        // The lighting pass reads the G-buffer from texture units 0 to 2
+        glUseProgram(programId);
+        glUniform1i(UNIFORM_G_ALBEDO, 0);
+        glUniform1i(UNIFORM_G_NORMAL, 1);
+        glUniform1i(UNIFORM_G_DEPTH, 2);
+    }
+}
+
+// Variant compiled at startup for a pipeline; the deferred pass has no per object light lists
+ShaderKey UDefaultShaderKey(ShaderPipeline pipeline)
+{
+    return { pipeline, DEFAULT_SHADER_FEATURES & ~(pipeline == PIPELINE_DEFERRED_LIGHTING ? FEATURE_OBJECT_LIGHTS : 0), 0 };
+}
+
+// Key of the lit program variant for the lighting features in use this frame. Fewer lights than MAX_FIXED_LIGHT_COUNT
+// get a loop of fixed length when nothing picks a subset of them per fragment.
+ShaderKey UFrameShaderKey(ShaderPipeline pipeline)
+{
+    unsigned int features = 0;
+    for (const SceneLight& light : gLights)
+    {
+        features |= light.specularIntensity > 0.0f ? FEATURE_SPECULAR : 0;
+    }
+    features |= gUseShadows ? FEATURE_SHADOWS : 0;
+    features |= gUseProbes ? FEATURE_PROBES : 0;
+    features |= gUseLightClusters ? FEATURE_CLUSTERS : 0;
+    features |= gUseObjectLightLists && pipeline != PIPELINE_DEFERRED_LIGHTING ? FEATURE_OBJECT_LIGHTS : 0;
+    features |= gUseBlinnPhong ? FEATURE_BLINN_PHONG : 0;
+    features |= gUseFastSpecular ? FEATURE_FAST_SPECULAR : 0;
+
+    bool fixedCount = !(features & (FEATURE_CLUSTERS | FEATURE_OBJECT_LIGHTS)) && gLights.size() <= MAX_FIXED_LIGHT_COUNT;
+    return { pipeline, features, fixedCount ? (unsigned int)gLights.size() : 0 };
+}
+
+// Print a shader stage's compilation errors (if any)
+bool UCheckShaderCompile(GLuint shaderId, const char* stage)
+{
+    int success = 0;
+    char infoLog[512];
+
+    // Check for shader compile errors
+    glGetShaderiv(shaderId, GL_COMPILE_STATUS, &success);
     if (!success)
     {
-        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
-        cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << endl;
+        glGetShaderInfoLog(shaderId, sizeof(infoLog), NULL, infoLog);
+        cout << "ERROR::SHADER::" << stage << "::COMPILATION_FAILED\n" << infoLog << endl;
 
         return false;
     }
 
-    glUseProgram(programId); // Uses the shader program
-
     return true;
 }
 
@@ -1931,3 +4059,692 @@ void UDestroyShaderProgram(GLuint programId)
 {
     glDeleteProgram(programId);
 }
+
+// Read every shader file from SHADER_DIRECTORY, naming the first one that can't be read
+bool ULoadShaderSources(ShaderSources& sources)
+{
+    for (int file = 0; file < SHADER_FILE_COUNT; file++)
+    {
+        string path = string(SHADER_DIRECTORY) + "/" + SHADER_FILE_NAMES[file];
+        ifstream stream(path);
+        if (!stream)
+        {
+            cout << "Failed to load shader " << path << endl;
+            return false;
+        }
+        sources.text[file].assign(istreambuf_iterator<char>(stream), istreambuf_iterator<char>());
+    }
+    return true;
+}
+
+// Read the SPIR-V module of every stage file, built by compile_spirv.bat or compile_spirv.sh. They are only used when
+// all of them are there and newer than every shader file, since an old module would bring back the shader as it was
+// when it was built.
+bool ULoadSpirvModules(ShaderSources& sources)
+{
+    error_code error;
+    filesystem::file_time_type newestSource;
+    for (int file = 0; file < SHADER_FILE_COUNT; file++)
+    {
+        newestSource = max(newestSource, filesystem::last_write_time(string(SHADER_DIRECTORY) + "/" + SHADER_FILE_NAMES[file], error));
+    }
+
+    for (int file = 0; file < SHADER_FILE_COUNT; file++)
+    {
+        // The lighting shader is only included by the lit fragment shaders, it has no module of its own
+        if (file == SHADER_LIGHTING)
+        {
+            continue;
+        }
+        string path = string(SPIRV_DIRECTORY) + "/" + SHADER_FILE_NAMES[file] + ".spv";
+        filesystem::file_time_type built = filesystem::last_write_time(path, error);
+        ifstream stream(path, ios::binary);
+        if (error || built < newestSource || !stream)
+        {
+            for (vector<char>& module : sources.spirv)
+            {
+                module.clear();
+            }
+            return false;
+        }
+        sources.spirv[file].assign(istreambuf_iterator<char>(stream), istreambuf_iterator<char>());
+    }
+    return true;
+}
+
+// Create the hidden window the reload thread compiles on, sharing the main window's objects, and start the thread.
+// Without it the shaders are only read at startup.
+void UStartShaderReload()
+{
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    gShaderReload.context = glfwCreateWindow(1, 1, WINDOW_TITLE, NULL, gWindow);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+    if (!gShaderReload.context)
+    {
+        cout << "INFO: Shader hot reload unavailable" << endl;
+        return;
+    }
+    gShaderReload.thread = thread(UWatchShaderFiles);
+    cout << "INFO: Watching " << SHADER_DIRECTORY << " for shader changes" << endl;
+}
+
+// Stop the reload thread and delete a reload it finished that was never swapped in
+void UStopShaderReload()
+{
+    if (!gShaderReload.context)
+    {
+        return;
+    }
+    gShaderReload.stop = true;
+    gShaderReload.thread.join();
+    if (gShaderReload.ready)
+    {
+        for (GLuint programId : gShaderReload.fixedPrograms)
+        {
+            UDestroyShaderProgram(programId);
+        }
+        for (const auto& variant : gShaderReload.variants)
+        {
+            UDestroyShaderProgram(variant.second);
+        }
+        gShaderReload.ready = false;
+    }
+    glfwDestroyWindow(gShaderReload.context);
+    gShaderReload.context = nullptr;
+}
+
+// Body of the reload thread: wait for a shader file to be written, then compile everything again. inotify reports the
+// changes on Linux; elsewhere, or when it can't watch the directory, the files' modification times are compared every
+// SHADER_RELOAD_POLL_MS.
+void UWatchShaderFiles()
+{
+    glfwMakeContextCurrent(gShaderReload.context);
+
+#ifdef __linux__
+    int watch = inotify_init1(IN_NONBLOCK);
+    if (watch >= 0 && inotify_add_watch(watch, SHADER_DIRECTORY, IN_CLOSE_WRITE | IN_MOVED_TO) >= 0)
+    {
+        while (!gShaderReload.stop)
+        {
+            pollfd events = { watch, POLLIN, 0 };
+            if (poll(&events, 1, SHADER_RELOAD_POLL_MS) <= 0)
+            {
+                continue;
+            }
+
+            // Editors may save several files, or one file in several steps; give them a moment and take every event at once
+            this_thread::sleep_for(chrono::milliseconds(50));
+            bool changed = false;
+            alignas(inotify_event) char buffer[4096];
+            ssize_t length;
+            while ((length = read(watch, buffer, sizeof(buffer))) > 0)
+            {
+                for (char* next = buffer; next < buffer + length; )
+                {
+                    const inotify_event* event = (const inotify_event*)next;
+                    for (const char* name : SHADER_FILE_NAMES)
+                    {
+                        changed = changed || (event->len && strcmp(event->name, name) == 0);
+                    }
+                    next += sizeof(inotify_event) + event->len;
+                }
+            }
+            if (changed)
+            {
+                UReloadShaders();
+            }
+        }
+        close(watch);
+        glfwMakeContextCurrent(NULL);
+        return;
+    }
+    if (watch >= 0)
+    {
+        close(watch);
+    }
+#endif
+
+    auto writeTimes = []
+    {
+        array<filesystem::file_time_type, SHADER_FILE_COUNT> times;
+        for (int file = 0; file < SHADER_FILE_COUNT; file++)
+        {
+            error_code error;
+            times[file] = filesystem::last_write_time(string(SHADER_DIRECTORY) + "/" + SHADER_FILE_NAMES[file], error);
+        }
+        return times;
+    };
+    auto times = writeTimes();
+    while (!gShaderReload.stop)
+    {
+        this_thread::sleep_for(chrono::milliseconds(SHADER_RELOAD_POLL_MS));
+        auto current = writeTimes();
+        if (current != times)
+        {
+            times = current;
+            UReloadShaders();
+        }
+    }
+    glfwMakeContextCurrent(NULL);
+}
+
+// Compile every program in use from the shader files as they are now, on the reload thread. A reload where all of them
+// compiled is handed to the main thread to swap in; otherwise it is deleted and the programs in use are kept.
+void UReloadShaders()
+{
+    auto start = chrono::steady_clock::now();
+    ShaderSources sources;
+    if (!ULoadShaderSources(sources))
+    {
+        cout << "INFO: Shader reload skipped, keeping the programs in use" << endl;
+        return;
+    }
+    vector<ShaderKey> keys;
+    {
+        lock_guard<mutex> lock(gShaderReload.mutex);
+        keys = gShaderReload.variantKeys;
+    }
+
+    // Submit everything before checking anything, so a driver with parallel shader compile works on all of it at once
+    ProgramCacheStats stats;
+    PendingProgram fixedPending[FIXED_PROGRAM_COUNT];
+    vector<PendingProgram> variantPending(keys.size());
+    for (int program = 0; program < FIXED_PROGRAM_COUNT; program++)
+    {
+        fixedPending[program].stats = &stats;
+        if (FIXED_PROGRAMS[program].inUse())
+        {
+            USubmitShaderFiles(sources, FIXED_PROGRAMS[program].stages, fixedPending[program]);
+        }
+    }
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        variantPending[i].stats = &stats;
+        USubmitShaderVariant(keys[i], sources, variantPending[i]);
+    }
+
+    bool compiled = true;
+    GLuint fixedPrograms[FIXED_PROGRAM_COUNT] = {};
+    for (int program = 0; program < FIXED_PROGRAM_COUNT; program++)
+    {
+        if (FIXED_PROGRAMS[program].inUse())
+        {
+            compiled = UFinishShaderProgram(fixedPending[program], fixedPrograms[program]) && compiled;
+        }
+    }
+    vector<pair<ShaderKey, GLuint>> variants(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        variants[i].first = keys[i];
+        if (UFinishShaderProgram(variantPending[i], variants[i].second))
+        {
+            UPrepareShaderVariant(keys[i], variants[i].second);
+        }
+        else
+        {
+            compiled = false;
+        }
+    }
+
+    // Objects made on this context are only safe to use on the main one once the driver is done with them
+    glFinish();
+
+    if (!compiled)
+    {
+        for (GLuint programId : fixedPrograms)
+        {
+            UDestroyShaderProgram(programId);
+        }
+        for (const auto& variant : variants)
+        {
+            UDestroyShaderProgram(variant.second);
+        }
+        cout << "INFO: Shader reload failed, keeping the programs in use" << endl;
+        return;
+    }
+
+    lock_guard<mutex> lock(gShaderReload.mutex);
+    if (gShaderReload.ready)
+    {
+        // The main thread hasn't taken the last reload yet; this one replaces it
+        for (GLuint programId : gShaderReload.fixedPrograms)
+        {
+            UDestroyShaderProgram(programId);
+        }
+        for (const auto& variant : gShaderReload.variants)
+        {
+            UDestroyShaderProgram(variant.second);
+        }
+    }
+    gShaderReload.sources = move(sources);
+    copy(begin(fixedPrograms), end(fixedPrograms), gShaderReload.fixedPrograms);
+    gShaderReload.variants = move(variants);
+    gShaderReload.ready = true;
+    cout << "INFO: Reloaded " << stats.compiled + stats.loaded << " shader programs in "
+        << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+}
+
+// Swap a finished reload in between frames, replacing every program in use at once. Variants submitted from the old
+// sources are dropped and compiled again from the new ones when next asked for.
+void UApplyShaderReload()
+{
+    {
+        lock_guard<mutex> lock(gShaderReload.mutex);
+        if (!gShaderReload.ready)
+        {
+            return;
+        }
+        for (int program = 0; program < FIXED_PROGRAM_COUNT; program++)
+        {
+            if (FIXED_PROGRAMS[program].inUse())
+            {
+                UDestroyShaderProgram(*FIXED_PROGRAMS[program].programId);
+                *FIXED_PROGRAMS[program].programId = gShaderReload.fixedPrograms[program];
+            }
+        }
+        for (const auto& variant : gShaderVariants)
+        {
+            UDestroyShaderProgram(variant.second);
+        }
+        for (auto& variant : gPendingVariants)
+        {
+            UDiscardShaderProgram(variant.second);
+        }
+        gShaderVariants.clear();
+        gPendingVariants.clear();
+        gShaderReload.variantKeys.clear();
+        for (const auto& variant : gShaderReload.variants)
+        {
+            gShaderVariants.emplace(variant.first, variant.second);
+            gShaderReload.variantKeys.push_back(variant.first);
+        }
+        gShaderSources = move(gShaderReload.sources);
+        gShaderReload.variants.clear();
+        gShaderReload.ready = false;
+    }
+
+    auto defaultVariant = [](ShaderPipeline pipeline)
+    {
+        auto found = gShaderVariants.find(UDefaultShaderKey(pipeline));
+        return found != gShaderVariants.end() ? found->second : 0;
+    };
+    gProgramId = defaultVariant(PIPELINE_FORWARD);
+    gSphereTessProgramId = defaultVariant(PIPELINE_SPHERE_TESS);
+    gCylinderTessProgramId = defaultVariant(PIPELINE_CYLINDER_TESS);
+    gDeferredLightingProgramId = defaultVariant(PIPELINE_DEFERRED_LIGHTING);
+    cout << "INFO: Swapped in the reloaded shader programs" << endl;
+}
+
+// Draw with every program a frame can use with the current settings, or with any one of them switched by a key, into
+// small offscreen targets with each mesh and texture it is used with, then wait for the GPU. Drivers finish compiling a
+// program for the state it is first drawn with, and upload buffers and textures on their first use, which would
+// otherwise stall the frames where they first appear. The shadow maps and lightmaps of the first frame are made here too.
+void UWarmUpShaders()
+{
+    auto start = chrono::steady_clock::now();
+
+    // Variants for the settings in use and for each setting a key switches; the lightmapped forward variant is used by
+    // the instanced draws
+    vector<ShaderKey> keys;
+    auto addFrameKeys = [&keys]()
+    {
+        for (ShaderPipeline pipeline : { PIPELINE_FORWARD, PIPELINE_SPHERE_TESS, PIPELINE_CYLINDER_TESS, PIPELINE_DEFERRED_LIGHTING })
+        {
+            bool tessellated = pipeline == PIPELINE_SPHERE_TESS || pipeline == PIPELINE_CYLINDER_TESS;
+            if ((tessellated && !gTessellationAvailable) || (pipeline == PIPELINE_DEFERRED_LIGHTING && !gDeferredAvailable))
+            {
+                continue;
+            }
+            ShaderKey key = UFrameShaderKey(pipeline);
+            for (const ShaderKey& variant : { key, ShaderKey{ pipeline, key.features | FEATURE_LIGHTMAP, key.lightCount } })
+            {
+                if ((variant == key || pipeline == PIPELINE_FORWARD) && find(keys.begin(), keys.end(), variant) == keys.end())
+                {
+                    keys.push_back(variant);
+                }
+            }
+        }
+    };
+    addFrameKeys();
+    for (bool* setting : { &gUseShadows, &gUseProbes, &gUseLightClusters, &gUseObjectLightLists, &gUseBlinnPhong, &gUseFastSpecular })
+    {
+        *setting = !*setting;
+        addFrameKeys();
+        *setting = !*setting;
+    }
+
+    // Submit them all before waiting on any, so the driver can compile them side by side
+    for (const ShaderKey& key : keys)
+    {
+        UShaderVariant(key);
+    }
+    for (const ShaderKey& key : keys)
+    {
+        UShaderVariant(key, true);
+    }
+
+    // The first frame's lights, shadow maps and lightmaps
+    UUploadLights();
+    if (gUseObjectLightLists)
+    {
+        UBuildObjectLightLists();
+    }
+    UUpdateShadowMaps();
+    if (gUseLightmaps && !ULightmapsCurrent())
+    {
+        UBakeLightmaps();
+    }
+
+    const glm::mat4 view = gCamera.GetViewMatrix();
+    const glm::mat4 projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, NEAR_PLANE, FAR_PLANE);
+    UUploadLightClusters(view, projection);
+
+    // A few pixels with the formats of the window are enough
+    const int targetSize = 8;
+    GLuint fbo, targets[2];
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glGenTextures(2, targets);
+    glBindTexture(GL_TEXTURE_2D, targets[0]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, targetSize, targetSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, targets[0], 0);
+    glBindTexture(GL_TEXTURE_2D, targets[1]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, targetSize, targetSize, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, targets[1], 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glViewport(0, 0, targetSize, targetSize);
+    glEnable(GL_DEPTH_TEST);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // Each program draws every mesh, level of detail and texture it is used with
+    unsigned int programs = 0;
+
+    // Forward variants, and the tessellated ones with the patches
+    for (const ShaderKey& key : keys)
+    {
+        GLuint programId = UShaderVariant(key);
+        if (key.pipeline == PIPELINE_FORWARD)
+        {
+            glUseProgram(programId);
+            USetFrameUniforms(view, projection);
+            UDrawSceneObjects(view, projection, true);
+        }
+        else if (key.pipeline != PIPELINE_DEFERRED_LIGHTING)
+        {
+            bool sphere = key.pipeline == PIPELINE_SPHERE_TESS;
+            UDrawPatches(programId, sphere ? gSpherePatches : gCylinderPatches, sphere ? PATCH_SPHERE : PATCH_CYLINDER, view, projection);
+        }
+        else
+        {
+            continue;
+        }
+        programs++;
+    }
+
+    // The shadow casters, as drawn into the cube maps
+    glUseProgram(gShadowProgramId);
+    glUniformMatrix4fv(UNIFORM_VIEW, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(UNIFORM_PROJECTION, 1, GL_FALSE, glm::value_ptr(projection));
+    glUniform3fv(UNIFORM_LIGHT_POSITION, 1, glm::value_ptr(gCamera.Position));
+    glUniform1f(UNIFORM_SHADOW_FAR_PLANE, FAR_PLANE);
+    UDrawSceneObjects(view, projection, true, false);
+    programs++;
+
+    // The lamp markers
+    glUseProgram(gLampProgramId);
+    glUniformMatrix4fv(UNIFORM_VIEW, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(UNIFORM_PROJECTION, 1, GL_FALSE, glm::value_ptr(projection));
+    glBindVertexArray(gLampMesh->vao);
+    USetFaceCulling(gLampMesh->twoSided);
+    UDrawMesh(*gLampMesh, gLights.size());
+    programs++;
+
+    // The deferred path: the scene into a corner of the G-buffer, then the lighting pass reading it
+    if (gDeferredAvailable)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, gGBuffer.fbo);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glUseProgram(gGBufferProgramId);
+        glUniformMatrix4fv(UNIFORM_VIEW, 1, GL_FALSE, glm::value_ptr(view));
+        glUniformMatrix4fv(UNIFORM_PROJECTION, 1, GL_FALSE, glm::value_ptr(projection));
+        UDrawSceneObjects(view, projection, true);
+        programs++;
+        if (gTessellationAvailable)
+        {
+            UDrawPatches(gSphereGBufferProgramId, gSpherePatches, PATCH_SPHERE, view, projection, false);
+            UDrawPatches(gCylinderGBufferProgramId, gCylinderPatches, PATCH_CYLINDER, view, projection, false);
+            programs += 2;
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        const GLuint textures[] = { gGBuffer.albedo, gGBuffer.normal, gGBuffer.depth };
+        for (int unit = 0; unit < 3; unit++)
+        {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glBindTexture(GL_TEXTURE_2D, textures[unit]);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glDepthFunc(GL_ALWAYS);
+        glDisable(GL_CULL_FACE);
+        glBindVertexArray(gFullscreenVao);
+        for (const ShaderKey& key : keys)
+        {
+            if (key.pipeline == PIPELINE_DEFERRED_LIGHTING)
+            {
+                glUseProgram(UShaderVariant(key));
+                USetFrameUniforms(view, projection);
+                glUniformMatrix4fv(UNIFORM_INVERSE_VIEW_PROJECTION, 1, GL_FALSE, glm::value_ptr(glm::inverse(projection * view)));
+                glUniform2f(UNIFORM_VIEWPORT_SIZE, gGBuffer.width, gGBuffer.height);
+                glDrawArrays(GL_TRIANGLES, 0, 3);
+                programs++;
+            }
+        }
+        glDepthFunc(GL_LESS);
+    }
+
+    // Back to the window, once the GPU has gone through every draw
+    glBindVertexArray(0);
+    glUseProgram(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(2, targets);
+    int width, height;
+    glfwGetFramebufferSize(gWindow, &width, &height);
+    glViewport(0, 0, width, height);
+    glFinish();
+
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    cout << "INFO: Warmed up " << programs << " shader programs (" << keys.size() << " lit variants) in " << elapsed.count() << " ms" << endl;
+}
+
+// Keep the CPU time of the first frames and print them once there are LOGGED_FRAME_COUNT, with how far the slowest
+// stands above the median. Without the warm up the first frames spike while the driver finishes the programs.
+void ULogFrameTime(double milliseconds)
+{
+    if (gFirstFrameTimes.size() >= LOGGED_FRAME_COUNT)
+    {
+        return;
+    }
+    gFirstFrameTimes.push_back(milliseconds);
+    if (gFirstFrameTimes.size() < LOGGED_FRAME_COUNT)
+    {
+        return;
+    }
+
+    vector<double> sorted = gFirstFrameTimes;
+    sort(sorted.begin(), sorted.end());
+    cout << "INFO: First " << LOGGED_FRAME_COUNT << " frames (" << (gWarmUpShaders ? "warmed up" : "no warm up") << "), ms:";
+    for (double frame : gFirstFrameTimes)
+    {
+        cout << " " << frame;
+    }
+    cout << "; slowest " << sorted.back() / max(sorted[sorted.size() / 2], 1e-3) << "x the median" << endl;
+}
+
+// Draw the instanced draws and every other object with the program in use, without the view culling of the frame. The
+// objects with levels of detail draw the one for their size on screen, or every one of them with everyLevel. Programs
+// without a texture, like the shadow one, pass textured as false to leave out the texture and its scale.
+void UDrawSceneObjects(const glm::mat4& view, const glm::mat4& projection, bool everyLevel, bool textured)
+{
+    glUniform1i(UNIFORM_INSTANCED, GL_TRUE);
+    for (const GLInstanceBatch& batch : gInstanceBatches)
+    {
+        glBindVertexArray(batch.vao);
+        USetFaceCulling(batch.mesh->twoSided);
+        if (textured)
+        {
+            glUniform2fv(UNIFORM_UV_SCALE, 1, glm::value_ptr(batch.uvScale));
+            glBindTexture(GL_TEXTURE_2D, batch.textureId);
+        }
+        UDrawMesh(*batch.mesh, batch.nInstances);
+    }
+    glUniform1i(UNIFORM_INSTANCED, GL_FALSE);
+
+    for (const SceneObject& object : gSceneObjects)
+    {
+        if (!object.lods && object.patchShape == PATCH_NONE && !object.dynamic)
+        {
+            continue;
+        }
+        glUniformMatrix4fv(UNIFORM_MODEL, 1, GL_FALSE, glm::value_ptr(object.model));
+        glUniform2fv(UNIFORM_SHAPE_HEIGHTS, 1, glm::value_ptr(object.shapeHeights));
+        if (textured)
+        {
+            glUniform2fv(UNIFORM_UV_SCALE, 1, glm::value_ptr(object.uvScale));
+            glBindTexture(GL_TEXTURE_2D, object.textureId);
+        }
+
+        vector<const GLMesh*> meshes;
+        if (object.lods && everyLevel)
+        {
+            meshes.push_back(object.mesh.get());
+            for (const GLMesh& level : object.lods->levels)
+            {
+                meshes.push_back(&level);
+            }
+        }
+        else
+        {
+            meshes.push_back(object.lods && gUseMeshLods
+                ? &USelectMeshLod(*object.lods, glm::vec3(object.model[3]), UMaxScale(object.model))
+                : object.mesh.get());
+        }
+        for (const GLMesh* mesh : meshes)
+        {
+            glBindVertexArray(mesh->vao);
+            USetFaceCulling(mesh->twoSided);
+            if (gUseMeshletCulling && !mesh->meshlets.empty())
+            {
+                UDrawMeshlets(*mesh, object.model, projection * view);
+            }
+            else
+            {
+                UDrawMesh(*mesh);
+            }
+        }
+    }
+}
+
+// Draw the scene forward with each way of shading the specular highlights, at several resolutions, and report the GPU
+// time of each and how far its image is from Phong's, to choose the cheapest one that still looks right. The lightmaps
+// are left out so every object is lit by the variant being measured.
+void UCompareSpecular()
+{
+    const struct { bool blinnPhong; bool fastSpecular; const char* name; } modes[] = {
+        { false, false, "Phong" },
+        { true, false, "Blinn-Phong" },
+        { false, true, "Phong, approximate power" },
+        { true, true, "Blinn-Phong, approximate power" }
+    };
+    const glm::ivec2 resolutions[] = { { 640, 360 }, { 1280, 720 }, { 1920, 1080 }, { 2560, 1440 } };
+    const int timedFrames = 20;
+    const int changedThreshold = 2; // Difference of a channel, out of 255, for a pixel to count as changed
+    const bool blinnPhong = gUseBlinnPhong, fastSpecular = gUseFastSpecular;
+
+    // Every variant is compiled before anything is timed
+    for (const auto& mode : modes)
+    {
+        gUseBlinnPhong = mode.blinnPhong;
+        gUseFastSpecular = mode.fastSpecular;
+        UShaderVariant(UFrameShaderKey(PIPELINE_FORWARD), true);
+    }
+
+    UUploadLights();
+    UUpdateShadowMaps();
+    const glm::mat4 view = gCamera.GetViewMatrix();
+    GLuint query;
+    glGenQueries(1, &query);
+    cout << "INFO: Specular highlights compared with Phong, GPU time averaged over " << timedFrames << " frames:" << endl;
+    for (const glm::ivec2& size : resolutions)
+    {
+        const glm::mat4 projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)size.x / size.y, NEAR_PLANE, FAR_PLANE);
+        UUploadLightClusters(view, projection);
+
+        GLuint fbo, targets[2];
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glGenTextures(2, targets);
+        glBindTexture(GL_TEXTURE_2D, targets[0]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.x, size.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, targets[0], 0);
+        glBindTexture(GL_TEXTURE_2D, targets[1]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size.x, size.y, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, targets[1], 0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glViewport(0, 0, size.x, size.y);
+        glEnable(GL_DEPTH_TEST);
+
+        vector<unsigned char> reference, image(size.x * size.y * 4);
+        double referenceMilliseconds = 0.0;
+        for (const auto& mode : modes)
+        {
+            gUseBlinnPhong = mode.blinnPhong;
+            gUseFastSpecular = mode.fastSpecular;
+            glUseProgram(UShaderVariant(UFrameShaderKey(PIPELINE_FORWARD)));
+            USetFrameUniforms(view, projection);
+            glUniform2f(UNIFORM_CLUSTER_TILE_SIZE, (GLfloat)size.x / CLUSTERS_X, (GLfloat)size.y / CLUSTERS_Y);
+
+            // The first frame isn't timed, so nothing left over from the last variant is counted
+            for (int frame = -1; frame < timedFrames; frame++)
+            {
+                if (frame == 0)
+                {
+                    glBeginQuery(GL_TIME_ELAPSED, query);
+                }
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                UDrawSceneObjects(view, projection, false);
+            }
+            glEndQuery(GL_TIME_ELAPSED);
+            GLuint64 nanoseconds;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+            double milliseconds = nanoseconds / 1e6 / timedFrames;
+
+            // The first mode is Phong, which the others are compared with
+            glReadPixels(0, 0, size.x, size.y, GL_RGBA, GL_UNSIGNED_BYTE, image.data());
+            if (reference.empty())
+            {
+                reference = image;
+                referenceMilliseconds = max(milliseconds, 1e-6);
+            }
+            ImageDifference difference = UCompareImages(reference.data(), image.data(), size.x * size.y, changedThreshold);
+            cout << "INFO:   " << size.x << " x " << size.y << ", " << mode.name << ": " << milliseconds << " ms ("
+                << milliseconds / referenceMilliseconds << "x Phong), mean difference " << difference.meanError << ", max "
+                << difference.maxError << ", " << difference.differingPixels * 100.0 << "% of pixels changed, PSNR "
+                << difference.psnr << " dB" << endl;
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteTextures(2, targets);
+    }
+    glDeleteQueries(1, &query);
+
+    // Back to the window and the settings in use
+    gUseBlinnPhong = blinnPhong;
+    gUseFastSpecular = fastSpecular;
+    glBindVertexArray(0);
+    glUseProgram(0);
+    int width, height;
+    glfwGetFramebufferSize(gWindow, &width, &height);
+    glViewport(0, 0, width, height);
+}
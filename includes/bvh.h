@@ -0,0 +1,685 @@
+/*
+ * Bounding volume hierarchy
+ * Eric Slutz
+ *
+ * A tree of boxes over a list of items (scene objects, or the triangles of a
+ * mesh) for finding what a ray hits or what lies in a view frustum without
+ * testing every item. The tree is built with the surface area heuristic and
+ * stores four children per node, so a node's children are tested against a
+ * ray or the frustum planes four lanes at a time with SSE. When items move
+ * without changing much, Refit updates the boxes in place instead of
+ * rebuilding the tree.
+ */
+
+#ifndef BVH_H
+#define BVH_H
+
+#include "mesh_generators.h"
+#include "simd_math.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Axis aligned bounding box, empty until grown
+struct Aabb
+{
+    glm::vec3 min = glm::vec3(FLT_MAX);
+    glm::vec3 max = glm::vec3(-FLT_MAX);
+
+    void Grow(const glm::vec3& point)
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void Grow(const Aabb& box)
+    {
+        min = glm::min(min, box.min);
+        max = glm::max(max, box.max);
+    }
+
+    glm::vec3 Center() const
+    {
+        return (min + max) * 0.5f;
+    }
+
+    // Half the surface area, all the heuristic needs
+    float HalfArea() const
+    {
+        glm::vec3 size = glm::max(max - min, glm::vec3(0.0f));
+        return size.x * size.y + size.y * size.z + size.z * size.x;
+    }
+};
+
+// Box around a box after a transform
+inline Aabb UTransformBounds(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const glm::mat4& transform)
+{
+    // Each output axis is the translation plus the smaller and larger product of every matrix entry with the box
+    Aabb result;
+    result.min = result.max = glm::vec3(transform[3]);
+    for (int column = 0; column < 3; column++)
+    {
+        glm::vec3 a = glm::vec3(transform[column]) * boundsMin[column];
+        glm::vec3 b = glm::vec3(transform[column]) * boundsMax[column];
+        result.min += glm::min(a, b);
+        result.max += glm::max(a, b);
+    }
+    return result;
+}
+
+// A ray from origin along direction, up to tMax times the direction's length
+struct BvhRay
+{
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float tMax = FLT_MAX;
+};
+
+// Distance along the ray to the box, FLT_MAX when the ray misses it
+inline float URayBox(const BvhRay& ray, const Aabb& box)
+{
+    float tMin = 0.0f, tMax = ray.tMax;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float inverse = 1.0f / ray.direction[axis];
+        float t0 = (box.min[axis] - ray.origin[axis]) * inverse;
+        float t1 = (box.max[axis] - ray.origin[axis]) * inverse;
+        tMin = std::max(tMin, std::min(t0, t1));
+        tMax = std::min(tMax, std::max(t0, t1));
+    }
+    return tMin <= tMax ? tMin : FLT_MAX;
+}
+
+// Distance along the ray to the triangle from either side, FLT_MAX when the ray misses it (Moller-Trumbore)
+inline float URayTriangle(const BvhRay& ray, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+{
+    glm::vec3 edge1 = b - a, edge2 = c - a;
+    glm::vec3 p = glm::cross(ray.direction, edge2);
+    float determinant = glm::dot(edge1, p);
+    if (std::fabs(determinant) < 1e-12f)
+    {
+        return FLT_MAX;
+    }
+
+    float inverse = 1.0f / determinant;
+    glm::vec3 s = ray.origin - a;
+    float u = glm::dot(s, p) * inverse;
+    if (u < 0.0f || u > 1.0f)
+    {
+        return FLT_MAX;
+    }
+    glm::vec3 q = glm::cross(s, edge1);
+    float v = glm::dot(ray.direction, q) * inverse;
+    if (v < 0.0f || u + v > 1.0f)
+    {
+        return FLT_MAX;
+    }
+    float t = glm::dot(edge2, q) * inverse;
+    return t >= 0.0f && t <= ray.tMax ? t : FLT_MAX;
+}
+
+class Bvh
+{
+public:
+    // Build the tree over the boxes of the items, numbered by their position in the list
+    void Build(const std::vector<Aabb>& bounds)
+    {
+        nodes.clear();
+        parents.clear();
+        items.resize(bounds.size());
+        itemNodes.resize(bounds.size());
+        centers.resize(bounds.size());
+        for (unsigned int i = 0; i < bounds.size(); i++)
+        {
+            items[i] = i;
+            centers[i] = bounds[i].Center();
+        }
+        if (!bounds.empty())
+        {
+            BuildNode(bounds, 0, bounds.size(), 0, -1);
+        }
+    }
+
+    // Update the boxes for items that moved, keeping the tree. Queries stay correct however far the
+    // items move, but the tree gets slower to search the more they move away from where they were built.
+    void Refit(const std::vector<Aabb>& bounds)
+    {
+        // Children are always stored after their parent, so going backwards finishes every child first
+        for (size_t n = nodes.size(); n-- > 0;)
+        {
+            RefitNode(bounds, n);
+        }
+    }
+
+    // Update the boxes for one item that moved, only along the path from its leaf to the root
+    void Refit(const std::vector<Aabb>& bounds, unsigned int item)
+    {
+        for (int n = itemNodes[item]; n >= 0; n = parents[n])
+        {
+            RefitNode(bounds, n);
+        }
+    }
+
+    // Nearest hit along the ray. hitItem(item, ray) returns the item's distance along the ray, or FLT_MAX
+    // when the ray misses it; items whose box is farther than the nearest hit so far aren't tested.
+    template <typename HitItem>
+    float Raycast(const BvhRay& ray, HitItem hitItem, unsigned int* hitIndex = nullptr) const
+    {
+        BvhRay search = ray;
+        float nearest = FLT_MAX;
+        if (nodes.empty())
+        {
+            return nearest;
+        }
+
+        // Axes the ray runs parallel to get a huge inverse instead of an infinite one, which keeps 0 * inf out of the slab test
+        glm::vec3 inverse;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float d = ray.direction[axis];
+            inverse[axis] = 1.0f / (std::fabs(d) > 1e-20f ? d : std::copysign(1e-20f, d));
+        }
+
+        std::pair<int, float> stack[STACK_SIZE];
+        int top = 0;
+        stack[top++] = { 0, 0.0f };
+        while (top > 0)
+        {
+            std::pair<int, float> entry = stack[--top];
+            if (entry.second > search.tMax)
+            {
+                continue;
+            }
+
+            const Node& node = nodes[entry.first];
+            float entryT[4];
+            int hitMask = node.IntersectRay(ray.origin, inverse, search.tMax, entryT);
+
+            // Children sorted far to near
+            int order[4], hits = 0;
+            for (int k = 0; k < 4; k++)
+            {
+                if (((hitMask >> k) & 1) && node.count[k] >= 0)
+                {
+                    int i = hits++;
+                    for (; i > 0 && entryT[order[i - 1]] < entryT[k]; i--)
+                    {
+                        order[i] = order[i - 1];
+                    }
+                    order[i] = k;
+                }
+            }
+
+            // Test the leaves near to far, then push the child nodes far to near so the nearest is searched first
+            for (int h = hits - 1; h >= 0; h--)
+            {
+                int k = order[h];
+                for (int i = 0; i < node.count[k] && entryT[k] <= search.tMax; i++)
+                {
+                    unsigned int item = items[node.child[k] + i];
+                    float t = hitItem(item, search);
+                    if (t < nearest)
+                    {
+                        nearest = t;
+                        search.tMax = t;
+                        if (hitIndex)
+                        {
+                            *hitIndex = item;
+                        }
+                    }
+                }
+            }
+            for (int h = 0; h < hits; h++)
+            {
+                if (node.count[order[h]] == 0)
+                {
+                    stack[top++] = { node.child[order[h]], entryT[order[h]] };
+                }
+            }
+        }
+        return nearest;
+    }
+
+    // Call visit(item) for every item whose box is inside or crosses the frustum. The planes point inwards.
+    template <typename Visit>
+    void QueryFrustum(const glm::vec4 planes[6], Visit visit) const
+    {
+        if (nodes.empty())
+        {
+            return;
+        }
+
+        int stack[STACK_SIZE];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const Node& node = nodes[stack[--top]];
+            int inside = 0;
+            int visible = node.IntersectFrustum(planes, inside);
+            for (int k = 0; k < 4; k++)
+            {
+                if (!((visible >> k) & 1) || node.count[k] < 0)
+                {
+                    continue;
+                }
+                if ((inside >> k) & 1)
+                {
+                    VisitAll(node, k, visit); // Nothing below needs testing
+                }
+                else if (node.count[k] == 0)
+                {
+                    stack[top++] = node.child[k];
+                }
+                else
+                {
+                    for (int i = 0; i < node.count[k]; i++)
+                    {
+                        visit(items[node.child[k] + i]);
+                    }
+                }
+            }
+        }
+    }
+
+    size_t NodeCount() const
+    {
+        return nodes.size();
+    }
+
+private:
+    static const int MAX_LEAF_ITEMS = 4;
+    static const int SAH_BINS = 12;
+    // Below this depth ranges are halved instead, so badly clustered items can't make the tree arbitrarily deep
+    static const int MAX_SAH_DEPTH = 48;
+    // Each level pushes at most three more nodes than it pops; enough for the deepest tree the build makes
+    static const int STACK_SIZE = 256;
+
+    // Four children side by side, so each bound is one SSE register
+    struct alignas(16) Node
+    {
+        float minX[4], minY[4], minZ[4];
+        float maxX[4], maxY[4], maxZ[4];
+        int child[4]; // Child node, or first entry in items for a leaf
+        int count[4]; // Items of a leaf, 0 for a child node and -1 for an unused slot
+
+        void SetSlot(int k, const Aabb& box)
+        {
+            minX[k] = box.min.x; minY[k] = box.min.y; minZ[k] = box.min.z;
+            maxX[k] = box.max.x; maxY[k] = box.max.y; maxZ[k] = box.max.z;
+        }
+
+        Aabb Bounds() const
+        {
+            Aabb box;
+            for (int k = 0; k < 4; k++)
+            {
+                if (count[k] >= 0)
+                {
+                    box.Grow({ glm::vec3(minX[k], minY[k], minZ[k]), glm::vec3(maxX[k], maxY[k], maxZ[k]) });
+                }
+            }
+            return box;
+        }
+
+        // Bit k is set when the ray enters child k's box before tMax, with the entry distance in entryT[k]
+        int IntersectRay(const glm::vec3& origin, const glm::vec3& inverse, float tMax, float entryT[4]) const
+        {
+#ifdef SIMD_MATH_SSE2
+            __m128 near = _mm_setzero_ps(), far = _mm_set1_ps(tMax);
+            const float* mins[3] = { minX, minY, minZ };
+            const float* maxs[3] = { maxX, maxY, maxZ };
+            for (int axis = 0; axis < 3; axis++)
+            {
+                __m128 o = _mm_set1_ps(origin[axis]), inv = _mm_set1_ps(inverse[axis]);
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(mins[axis]), o), inv);
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(maxs[axis]), o), inv);
+                near = _mm_max_ps(near, _mm_min_ps(t0, t1));
+                far = _mm_min_ps(far, _mm_max_ps(t0, t1));
+            }
+            _mm_storeu_ps(entryT, near);
+            return _mm_movemask_ps(_mm_cmple_ps(near, far));
+#else
+            int mask = 0;
+            for (int k = 0; k < 4; k++)
+            {
+                float near = 0.0f, far = tMax;
+                const float boxMin[3] = { minX[k], minY[k], minZ[k] }, boxMax[3] = { maxX[k], maxY[k], maxZ[k] };
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    float t0 = (boxMin[axis] - origin[axis]) * inverse[axis];
+                    float t1 = (boxMax[axis] - origin[axis]) * inverse[axis];
+                    near = std::max(near, std::min(t0, t1));
+                    far = std::min(far, std::max(t0, t1));
+                }
+                entryT[k] = near;
+                mask |= near <= far ? 1 << k : 0;
+            }
+            return mask;
+#endif
+        }
+
+        // Bit k is set when child k's box isn't wholly outside a plane; the same bit of inside is set when it is inside all of them
+        int IntersectFrustum(const glm::vec4 planes[6], int& inside) const
+        {
+#ifdef SIMD_MATH_SSE2
+            __m128 outsideAny = _mm_setzero_ps(), crossingAny = _mm_setzero_ps();
+            const __m128 zero = _mm_setzero_ps();
+            __m128 boxMinX = _mm_load_ps(minX), boxMinY = _mm_load_ps(minY), boxMinZ = _mm_load_ps(minZ);
+            __m128 boxMaxX = _mm_load_ps(maxX), boxMaxY = _mm_load_ps(maxY), boxMaxZ = _mm_load_ps(maxZ);
+            for (int p = 0; p < 6; p++)
+            {
+                __m128 nx = _mm_set1_ps(planes[p].x), ny = _mm_set1_ps(planes[p].y), nz = _mm_set1_ps(planes[p].z);
+                __m128 x0 = _mm_mul_ps(nx, boxMinX), x1 = _mm_mul_ps(nx, boxMaxX);
+                __m128 y0 = _mm_mul_ps(ny, boxMinY), y1 = _mm_mul_ps(ny, boxMaxY);
+                __m128 z0 = _mm_mul_ps(nz, boxMinZ), z1 = _mm_mul_ps(nz, boxMaxZ);
+                __m128 w = _mm_set1_ps(planes[p].w);
+
+                // Distance of the corner farthest along the plane normal, and of the corner farthest against it
+                __m128 farthest = _mm_add_ps(_mm_add_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)), _mm_add_ps(_mm_max_ps(z0, z1), w));
+                __m128 nearest = _mm_add_ps(_mm_add_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)), _mm_add_ps(_mm_min_ps(z0, z1), w));
+                outsideAny = _mm_or_ps(outsideAny, _mm_cmplt_ps(farthest, zero));
+                crossingAny = _mm_or_ps(crossingAny, _mm_cmplt_ps(nearest, zero));
+            }
+            inside = _mm_movemask_ps(crossingAny) ^ 0xF;
+            return _mm_movemask_ps(outsideAny) ^ 0xF;
+#else
+            int visible = 0;
+            inside = 0;
+            for (int k = 0; k < 4; k++)
+            {
+                bool outside = false, crossing = false;
+                for (int p = 0; p < 6; p++)
+                {
+                    float x0 = planes[p].x * minX[k], x1 = planes[p].x * maxX[k];
+                    float y0 = planes[p].y * minY[k], y1 = planes[p].y * maxY[k];
+                    float z0 = planes[p].z * minZ[k], z1 = planes[p].z * maxZ[k];
+                    outside |= std::max(x0, x1) + std::max(y0, y1) + std::max(z0, z1) + planes[p].w < 0.0f;
+                    crossing |= std::min(x0, x1) + std::min(y0, y1) + std::min(z0, z1) + planes[p].w < 0.0f;
+                }
+                visible |= outside ? 0 : 1 << k;
+                inside |= crossing ? 0 : 1 << k;
+            }
+            return visible;
+#endif
+        }
+    };
+
+    std::vector<Node> nodes;
+    std::vector<int> parents; // Parent of each node, -1 for the root
+    std::vector<unsigned int> items; // Item numbers, each leaf's contiguous
+    std::vector<int> itemNodes; // Node holding each item in one of its leaves
+    std::vector<glm::vec3> centers; // Box centers of the items, used while building
+
+    // Recompute the boxes of a node's children from their items or their own children
+    void RefitNode(const std::vector<Aabb>& bounds, size_t n)
+    {
+        Node& node = nodes[n];
+        for (int k = 0; k < 4; k++)
+        {
+            Aabb box;
+            if (node.count[k] > 0)
+            {
+                for (int i = 0; i < node.count[k]; i++)
+                {
+                    box.Grow(bounds[items[node.child[k] + i]]);
+                }
+            }
+            else if (node.count[k] == 0)
+            {
+                box = nodes[node.child[k]].Bounds();
+            }
+            else
+            {
+                continue;
+            }
+            node.SetSlot(k, box);
+        }
+    }
+
+    template <typename Visit>
+    void VisitAll(const Node& node, int k, Visit& visit) const
+    {
+        if (node.count[k] > 0)
+        {
+            for (int i = 0; i < node.count[k]; i++)
+            {
+                visit(items[node.child[k] + i]);
+            }
+        }
+        else if (node.count[k] == 0)
+        {
+            const Node& child = nodes[node.child[k]];
+            for (int c = 0; c < 4; c++)
+            {
+                VisitAll(child, c, visit);
+            }
+        }
+    }
+
+    Aabb RangeBounds(const std::vector<Aabb>& bounds, unsigned int first, unsigned int count) const
+    {
+        Aabb box;
+        for (unsigned int i = first; i < first + count; i++)
+        {
+            box.Grow(bounds[items[i]]);
+        }
+        return box;
+    }
+
+    // Split a range of items in two where the surface area heuristic is lowest, returning the size of the first part,
+    // or 0 when keeping the range as one leaf is cheaper
+    unsigned int Split(const std::vector<Aabb>& bounds, unsigned int first, unsigned int count, const Aabb& box, int depth)
+    {
+        if (count <= 1)
+        {
+            return 0;
+        }
+        if (depth >= MAX_SAH_DEPTH)
+        {
+            return count > MAX_LEAF_ITEMS ? count / 2 : 0;
+        }
+
+        Aabb centerBox;
+        for (unsigned int i = first; i < first + count; i++)
+        {
+            centerBox.Grow(centers[items[i]]);
+        }
+
+        // Binned heuristic on each axis: cost of a split is the area weighted item count of both sides
+        float bestCost = FLT_MAX;
+        int bestAxis = -1, bestBin = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float extent = centerBox.max[axis] - centerBox.min[axis];
+            if (extent <= 0.0f)
+            {
+                continue;
+            }
+            float scale = SAH_BINS / extent;
+
+            Aabb binBoxes[SAH_BINS];
+            unsigned int binCounts[SAH_BINS] = {};
+            for (unsigned int i = first; i < first + count; i++)
+            {
+                int bin = std::min(SAH_BINS - 1, static_cast<int>((centers[items[i]][axis] - centerBox.min[axis]) * scale));
+                binBoxes[bin].Grow(bounds[items[i]]);
+                binCounts[bin]++;
+            }
+
+            // Areas and counts left of each split plane, then sweep from the right
+            float leftArea[SAH_BINS - 1];
+            unsigned int leftCount[SAH_BINS - 1];
+            Aabb left;
+            unsigned int leftTotal = 0;
+            for (int b = 0; b < SAH_BINS - 1; b++)
+            {
+                left.Grow(binBoxes[b]);
+                leftTotal += binCounts[b];
+                leftArea[b] = left.HalfArea();
+                leftCount[b] = leftTotal;
+            }
+            Aabb right;
+            unsigned int rightTotal = 0;
+            for (int b = SAH_BINS - 1; b > 0; b--)
+            {
+                right.Grow(binBoxes[b]);
+                rightTotal += binCounts[b];
+                if (leftCount[b - 1] == 0 || rightTotal == 0)
+                {
+                    continue;
+                }
+                float cost = leftArea[b - 1] * leftCount[b - 1] + right.HalfArea() * rightTotal;
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        // Items all at the same place: halve the range to keep leaves small
+        if (bestAxis < 0)
+        {
+            return count > MAX_LEAF_ITEMS ? count / 2 : 0;
+        }
+
+        // A leaf costs testing each item; a split costs a box test plus the weighted sides
+        float leafCost = static_cast<float>(count);
+        float splitCost = 1.0f + bestCost / std::max(box.HalfArea(), FLT_MIN);
+        if (count <= MAX_LEAF_ITEMS && leafCost <= splitCost)
+        {
+            return 0;
+        }
+
+        float scale = SAH_BINS / (centerBox.max[bestAxis] - centerBox.min[bestAxis]);
+        auto middle = std::partition(items.begin() + first, items.begin() + first + count, [&](unsigned int item)
+        {
+            return std::min(SAH_BINS - 1, static_cast<int>((centers[item][bestAxis] - centerBox.min[bestAxis]) * scale)) < bestBin;
+        });
+        return static_cast<unsigned int>(middle - (items.begin() + first));
+    }
+
+    // Make a node over a range of items: split it into up to four parts, always splitting the part with the
+    // largest surface area next, then make a leaf or a child node of each part
+    int BuildNode(const std::vector<Aabb>& bounds, unsigned int first, unsigned int count, int depth, int parent)
+    {
+        struct Part
+        {
+            unsigned int first, count, split;
+            Aabb box;
+        };
+        Part parts[4];
+        int nParts = 1;
+        parts[0].first = first;
+        parts[0].count = count;
+        parts[0].box = RangeBounds(bounds, first, count);
+        parts[0].split = Split(bounds, first, count, parts[0].box, depth);
+
+        while (nParts < 4)
+        {
+            int largest = -1;
+            for (int p = 0; p < nParts; p++)
+            {
+                if (parts[p].split > 0 && (largest < 0 || parts[p].box.HalfArea() > parts[largest].box.HalfArea()))
+                {
+                    largest = p;
+                }
+            }
+            if (largest < 0)
+            {
+                break;
+            }
+
+            Part whole = parts[largest];
+            Part& a = parts[largest];
+            Part& b = parts[nParts++];
+            a.first = whole.first;
+            a.count = whole.split;
+            b.first = whole.first + whole.split;
+            b.count = whole.count - whole.split;
+            a.box = RangeBounds(bounds, a.first, a.count);
+            b.box = RangeBounds(bounds, b.first, b.count);
+            a.split = Split(bounds, a.first, a.count, a.box, depth);
+            b.split = Split(bounds, b.first, b.count, b.box, depth);
+        }
+
+        int index = static_cast<int>(nodes.size());
+        nodes.emplace_back();
+        parents.push_back(parent);
+        for (int k = 0; k < 4; k++)
+        {
+            Node& node = nodes[index];
+            if (k >= nParts)
+            {
+                node.SetSlot(k, Aabb());
+                node.child[k] = 0;
+                node.count[k] = -1;
+                continue;
+            }
+
+            node.SetSlot(k, parts[k].box);
+            if (parts[k].split == 0)
+            {
+                node.child[k] = parts[k].first;
+                node.count[k] = parts[k].count;
+                for (unsigned int i = parts[k].first; i < parts[k].first + parts[k].count; i++)
+                {
+                    itemNodes[items[i]] = index;
+                }
+            }
+            else
+            {
+                int child = BuildNode(bounds, parts[k].first, parts[k].count, depth + 1, index);
+                nodes[index].child[k] = child; // The node list may have moved
+                nodes[index].count[k] = 0;
+            }
+        }
+        return index;
+    }
+};
+
+// The triangles of a mesh and a tree over them, for finding where a ray hits the mesh
+struct MeshBvh
+{
+    std::vector<glm::vec3> corners; // Three per triangle
+    Bvh bvh;
+
+    // Build from interleaved vertex data, with 16 bit indices or, when indices is null, consecutive vertices
+    void Build(const float* verts, unsigned int nVertices, const unsigned short* indices, unsigned int nIndices)
+    {
+        unsigned int count = indices ? nIndices : nVertices;
+        corners.resize(count - count % 3);
+        std::vector<Aabb> bounds(corners.size() / 3);
+        for (unsigned int i = 0; i < corners.size(); i++)
+        {
+            const float* v = verts + (indices ? indices[i] : i) * FLOATS_PER_ELEMENT;
+            corners[i] = glm::vec3(v[0], v[1], v[2]);
+            bounds[i / 3].Grow(corners[i]);
+        }
+        bvh.Build(bounds);
+    }
+
+    unsigned int TriangleCount() const
+    {
+        return corners.size() / 3;
+    }
+
+    // Distance along the ray to the nearest triangle, FLT_MAX when the ray misses the mesh. hitTriangle, when
+    // given, gets the number of the triangle hit.
+    float Raycast(const BvhRay& ray, unsigned int* hitTriangle = nullptr) const
+    {
+        return bvh.Raycast(ray, [this](unsigned int triangle, const BvhRay& search)
+        {
+            return URayTriangle(search, corners[triangle * 3], corners[triangle * 3 + 1], corners[triangle * 3 + 2]);
+        }, hitTriangle);
+    }
+};
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * Image comparison
+ * Eric Slutz
+ *
+ * Measures how far an RGBA8 image strays from a reference image of the same
+ * size, to judge whether a cheaper way of shading still looks like the one
+ * it replaces. Alpha is ignored.
+ */
+
+#ifndef IMAGE_COMPARE_H
+#define IMAGE_COMPARE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <limits>
+
+struct ImageDifference
+{
+    double meanError = 0.0; // Mean absolute difference of a color channel, 0 to 255
+    int maxError = 0; // Largest difference of any channel
+    double differingPixels = 0.0; // Fraction of the pixels with a channel off by more than the threshold
+    double psnr = std::numeric_limits<double>::infinity(); // Peak signal to noise ratio in dB, infinite for equal images
+};
+
+inline ImageDifference UCompareImages(const unsigned char* reference, const unsigned char* image, size_t nPixels, int threshold)
+{
+    ImageDifference difference;
+    if (nPixels == 0)
+    {
+        return difference;
+    }
+
+    double sumError = 0.0, sumSquaredError = 0.0;
+    size_t differing = 0;
+    for (size_t pixel = 0; pixel < nPixels; pixel++)
+    {
+        int pixelError = 0;
+        for (int channel = 0; channel < 3; channel++)
+        {
+            int error = std::abs(int(reference[pixel * 4 + channel]) - int(image[pixel * 4 + channel]));
+            sumError += error;
+            sumSquaredError += double(error) * error;
+            pixelError = std::max(pixelError, error);
+        }
+        difference.maxError = std::max(difference.maxError, pixelError);
+        differing += pixelError > threshold ? 1 : 0;
+    }
+
+    difference.meanError = sumError / (nPixels * 3);
+    difference.differingPixels = double(differing) / nPixels;
+    if (sumSquaredError > 0.0)
+    {
+        difference.psnr = 10.0 * std::log10(255.0 * 255.0 / (sumSquaredError / (nPixels * 3)));
+    }
+    return difference;
+}
+
+#endif
@@ -0,0 +1,242 @@
+/*
+ * Light clusters
+ * Eric Slutz
+ *
+ * Splits the view frustum into a grid of clusters, screen tiles cut into
+ * depth slices, and lists the lights that reach into each one. A fragment
+ * then only shades the lights of its own cluster rather than every light of
+ * the scene. Binning runs on the CPU, one depth slice per task on the
+ * thread pool, and tests each cluster against four lights at a time with SSE.
+ * The same test lists the lights reaching arbitrary boxes, such as the bounds
+ * of the objects drawn.
+ */
+
+#ifndef LIGHT_CLUSTERS_H
+#define LIGHT_CLUSTERS_H
+
+#include "simd_math.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Grid size: screen tiles across and down, and depth slices
+const int CLUSTERS_X = 16;
+const int CLUSTERS_Y = 9;
+const int CLUSTERS_Z = 24;
+const int CLUSTER_COUNT = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+
+// Lights of every cluster: cluster (x, y, z) is entry x + y * CLUSTERS_X + z * CLUSTERS_X * CLUSTERS_Y of ranges
+struct LightClusters
+{
+    std::vector<glm::uvec2> ranges; // Offset and count of each cluster's lights in indices
+    std::vector<unsigned int> indices; // Light numbers, each cluster's contiguous
+    float depthScale = 0.0f; // slice = log(depth) * depthScale + depthBias
+    float depthBias = 0.0f;
+
+    // Per slice results, merged into ranges and indices once every slice is done
+    std::vector<std::vector<unsigned int>> sliceIndices;
+    std::vector<std::vector<glm::uvec2>> sliceRanges;
+};
+
+// Lights reaching each of a set of boxes
+struct LightLists
+{
+    std::vector<glm::uvec2> ranges; // Offset and count of each box's lights in indices
+    std::vector<unsigned int> indices;
+};
+
+namespace light_clusters_detail
+{
+    // Lights that reach into a slice, four at a time. Lights without a range get an infinite one.
+    struct alignas(16) LightQuad
+    {
+        float x[4], y[4], z[4], rangeSquared[4];
+        unsigned int index[4];
+    };
+
+    // Bit k is set when light k of the quad reaches the box
+    inline int Touching(const LightQuad& quad, const glm::vec3& boxMin, const glm::vec3& boxMax)
+    {
+#ifdef SIMD_MATH_SSE2
+        const __m128 zero = _mm_setzero_ps();
+        __m128 distanceSquared = zero;
+        const float* centers[3] = { quad.x, quad.y, quad.z };
+        for (int axis = 0; axis < 3; axis++)
+        {
+            // Distance from the light to the box along the axis, zero when the light is level with the box
+            __m128 c = _mm_load_ps(centers[axis]);
+            __m128 below = _mm_max_ps(_mm_sub_ps(_mm_set1_ps(boxMin[axis]), c), zero);
+            __m128 above = _mm_max_ps(_mm_sub_ps(c, _mm_set1_ps(boxMax[axis])), zero);
+            __m128 d = _mm_add_ps(below, above);
+            distanceSquared = _mm_add_ps(distanceSquared, _mm_mul_ps(d, d));
+        }
+        return _mm_movemask_ps(_mm_cmple_ps(distanceSquared, _mm_load_ps(quad.rangeSquared)));
+#else
+        int mask = 0;
+        for (int k = 0; k < 4; k++)
+        {
+            glm::vec3 center(quad.x[k], quad.y[k], quad.z[k]);
+            glm::vec3 d = glm::max(boxMin - center, glm::vec3(0.0f)) + glm::max(center - boxMax, glm::vec3(0.0f));
+            mask |= glm::dot(d, d) <= quad.rangeSquared[k] ? 1 << k : 0;
+        }
+        return mask;
+#endif
+    }
+
+    // Pack the lights that keep(light) accepts four to a quad; unused lanes can't reach anything
+    template <typename Keep>
+    void PackLights(const std::vector<glm::vec4>& lights, std::vector<LightQuad>& quads, Keep keep)
+    {
+        quads.clear();
+        int lane = 4;
+        for (unsigned int i = 0; i < lights.size(); i++)
+        {
+            const glm::vec4& light = lights[i];
+            if (!keep(light))
+            {
+                continue;
+            }
+            if (lane == 4)
+            {
+                quads.push_back({ { 0.0f }, { 0.0f }, { 0.0f }, { -1.0f, -1.0f, -1.0f, -1.0f }, { 0 } });
+                lane = 0;
+            }
+            LightQuad& quad = quads.back();
+            quad.x[lane] = light.x;
+            quad.y[lane] = light.y;
+            quad.z[lane] = light.z;
+            quad.rangeSquared[lane] = light.w > 0.0f ? light.w * light.w : FLT_MAX;
+            quad.index[lane] = i;
+            lane++;
+        }
+    }
+
+    // Append the lights of the quads that reach the box to indices
+    inline void AppendTouching(const std::vector<LightQuad>& quads, const glm::vec3& boxMin, const glm::vec3& boxMax, std::vector<unsigned int>& indices)
+    {
+        for (const LightQuad& quad : quads)
+        {
+            int touching = Touching(quad, boxMin, boxMax);
+            for (int k = 0; touching; k++, touching >>= 1)
+            {
+                if (touching & 1)
+                {
+                    indices.push_back(quad.index[k]);
+                }
+            }
+        }
+    }
+}
+
+// Bin lights into the clusters of a projection. lights holds each light's view space position and range, a range of 0
+// reaching everywhere. Depth slices are spaced exponentially from near to far so clusters stay roughly as deep as they are wide.
+inline void UBuildLightClusters(const glm::mat4& projection, float nearPlane, float farPlane, const std::vector<glm::vec4>& lights,
+    LightClusters& clusters, ThreadPool* pool = nullptr)
+{
+    using light_clusters_detail::LightQuad;
+
+    clusters.depthScale = CLUSTERS_Z / std::log(farPlane / nearPlane);
+    clusters.depthBias = -std::log(nearPlane) * clusters.depthScale;
+    clusters.sliceIndices.resize(CLUSTERS_Z);
+    clusters.sliceRanges.resize(CLUSTERS_Z);
+
+    // Corners of the screen tiles on the near plane, in view space
+    const glm::mat4 inverseProjection = glm::inverse(projection);
+    const bool orthographic = projection[3][3] == 1.0f;
+    auto corner = [&](int x, int y, float depth)
+    {
+        glm::vec4 point = inverseProjection * glm::vec4(2.0f * x / CLUSTERS_X - 1.0f, 2.0f * y / CLUSTERS_Y - 1.0f, -1.0f, 1.0f);
+        glm::vec3 nearPoint = glm::vec3(point) / point.w;
+
+        // Perspective views widen with depth along the ray through the corner, orthographic views don't
+        return orthographic ? glm::vec3(nearPoint.x, nearPoint.y, -depth) : nearPoint * (depth / -nearPoint.z);
+    };
+
+    auto slices = [&](int begin, int end)
+    {
+        std::vector<LightQuad> quads;
+        for (int z = begin; z < end; z++)
+        {
+            float sliceNear = nearPlane * std::pow(farPlane / nearPlane, static_cast<float>(z) / CLUSTERS_Z);
+            float sliceFar = nearPlane * std::pow(farPlane / nearPlane, static_cast<float>(z + 1) / CLUSTERS_Z);
+
+            // Lights reaching the slice's depth range
+            light_clusters_detail::PackLights(lights, quads, [&](const glm::vec4& light)
+            {
+                float depth = -light.z;
+                return light.w <= 0.0f || (depth + light.w >= sliceNear && depth - light.w <= sliceFar);
+            });
+
+            std::vector<unsigned int>& indices = clusters.sliceIndices[z];
+            std::vector<glm::uvec2>& ranges = clusters.sliceRanges[z];
+            indices.clear();
+            ranges.resize(CLUSTERS_X * CLUSTERS_Y);
+            for (int y = 0; y < CLUSTERS_Y; y++)
+            {
+                for (int x = 0; x < CLUSTERS_X; x++)
+                {
+                    // View space box around the cluster's eight corners
+                    glm::vec3 boxMin(FLT_MAX), boxMax(-FLT_MAX);
+                    for (int c = 0; c < 8; c++)
+                    {
+                        glm::vec3 point = corner(x + (c & 1), y + ((c >> 1) & 1), (c & 4) ? sliceFar : sliceNear);
+                        boxMin = glm::min(boxMin, point);
+                        boxMax = glm::max(boxMax, point);
+                    }
+
+                    glm::uvec2& range = ranges[x + y * CLUSTERS_X];
+                    range.x = indices.size();
+                    light_clusters_detail::AppendTouching(quads, boxMin, boxMax, indices);
+                    range.y = indices.size() - range.x;
+                }
+            }
+        }
+    };
+
+    if (pool)
+    {
+        pool->ParallelFor(CLUSTERS_Z, 1, slices);
+    }
+    else
+    {
+        slices(0, CLUSTERS_Z);
+    }
+
+    // Join the slices, moving each slice's offsets past the slices before it
+    clusters.ranges.resize(CLUSTER_COUNT);
+    clusters.indices.clear();
+    for (int z = 0; z < CLUSTERS_Z; z++)
+    {
+        unsigned int offset = clusters.indices.size();
+        for (int i = 0; i < CLUSTERS_X * CLUSTERS_Y; i++)
+        {
+            clusters.ranges[z * CLUSTERS_X * CLUSTERS_Y + i] = clusters.sliceRanges[z][i] + glm::uvec2(offset, 0);
+        }
+        clusters.indices.insert(clusters.indices.end(), clusters.sliceIndices[z].begin(), clusters.sliceIndices[z].end());
+    }
+}
+
+// List the lights reaching each of nBoxes boxes (anything with min and max corners). lights holds each light's position
+// in the boxes' space and its range, a range of 0 reaching everywhere.
+template <typename Box>
+void UBuildLightLists(const std::vector<glm::vec4>& lights, const Box* boxes, size_t nBoxes, LightLists& lists)
+{
+    std::vector<light_clusters_detail::LightQuad> quads;
+    light_clusters_detail::PackLights(lights, quads, [](const glm::vec4&) { return true; });
+
+    lists.ranges.resize(nBoxes);
+    lists.indices.clear();
+    for (size_t i = 0; i < nBoxes; i++)
+    {
+        lists.ranges[i].x = lists.indices.size();
+        light_clusters_detail::AppendTouching(quads, boxes[i].min, boxes[i].max, lists.indices);
+        lists.ranges[i].y = lists.indices.size() - lists.ranges[i].x;
+    }
+}
+
+#endif
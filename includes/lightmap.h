@@ -0,0 +1,172 @@
+/*
+ * Lightmaps
+ * Eric Slutz
+ *
+ * Lays out lightmaps for flat sided meshes in a shared atlas. Each face is
+ * box unwrapped by its normal into a cell of a 3 x 2 grid, and each object
+ * gets a rectangle of the atlas holding the cells it uses, placed by a
+ * scale and offset so instances of one mesh share its lightmap coordinates.
+ * The vertex shader computes the same coordinates as UBoxUnwrap. Baking
+ * rasterizes the triangles into the atlas to find the point and normal of
+ * each texel, and the lit texels are spread into the empty ones around them
+ * so filtering never reads an unbaked texel.
+ */
+
+#ifndef LIGHTMAP_H
+#define LIGHTMAP_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Width and height of the atlas in texels
+const int LIGHTMAP_SIZE = 1024;
+// Part of each side of a grid cell left empty so neighbouring faces don't bleed into each other
+const float LIGHTMAP_CELL_MARGIN = 0.03f;
+
+// Face of the box unwrap a normal belongs to: +x, -x, +y, -y, +z, -z
+inline int ULightmapFace(const glm::vec3& normal)
+{
+    glm::vec3 a = glm::abs(normal);
+    if (a.x >= a.y && a.x >= a.z)
+    {
+        return normal.x >= 0.0f ? 0 : 1;
+    }
+    if (a.y >= a.z)
+    {
+        return normal.y >= 0.0f ? 2 : 3;
+    }
+    return normal.z >= 0.0f ? 4 : 5;
+}
+
+// Position in the 3 x 2 grid (0 to 1 across) of a mesh point from -1 to 1 on a face with the given normal
+inline glm::vec2 UBoxUnwrap(const glm::vec3& position, const glm::vec3& normal)
+{
+    int face = ULightmapFace(normal);
+    glm::vec2 local = face < 2 ? glm::vec2(position.z, position.y) : (face < 4 ? glm::vec2(position.x, position.z) : glm::vec2(position.x, position.y));
+    glm::vec2 cell(face % 3, face / 3);
+    return (cell + LIGHTMAP_CELL_MARGIN + (local * 0.5f + 0.5f) * (1.0f - 2.0f * LIGHTMAP_CELL_MARGIN)) / glm::vec2(3.0f, 2.0f);
+}
+
+// Part of the atlas given to one object
+struct LightmapRect
+{
+    glm::ivec2 cellSize; // Texels per grid cell
+    glm::ivec2 firstCell; // Cells used by the object's faces
+    glm::ivec2 cellCount;
+    glm::ivec2 origin; // Texel where the used cells start in the atlas
+    glm::vec4 scaleOffset; // Maps grid positions to atlas coordinates: grid * xy + zw
+};
+
+// Place the rectangles in the atlas in rows, tallest first. Returns false when they don't fit.
+inline bool UPackLightmapAtlas(std::vector<LightmapRect>& rects, int atlasSize)
+{
+    std::vector<size_t> order(rects.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        return rects[a].cellSize.y * rects[a].cellCount.y > rects[b].cellSize.y * rects[b].cellCount.y;
+    });
+
+    glm::ivec2 cursor(0);
+    int rowHeight = 0;
+    for (size_t i : order)
+    {
+        LightmapRect& rect = rects[i];
+        glm::ivec2 size = rect.cellSize * rect.cellCount;
+        if (cursor.x + size.x > atlasSize)
+        {
+            cursor = glm::ivec2(0, cursor.y + rowHeight);
+            rowHeight = 0;
+        }
+        if (size.x > atlasSize || cursor.y + size.y > atlasSize)
+        {
+            return false;
+        }
+        rect.origin = cursor;
+        cursor.x += size.x;
+        rowHeight = std::max(rowHeight, size.y);
+
+        // The whole grid spans 3 x 2 cells; shift it so the used cells land on the rectangle
+        glm::vec2 cellSize(rect.cellSize);
+        rect.scaleOffset = glm::vec4(glm::vec2(3.0f, 2.0f) * cellSize / float(atlasSize),
+            (glm::vec2(rect.origin) - glm::vec2(rect.firstCell) * cellSize) / float(atlasSize));
+    }
+    return true;
+}
+
+// Call texel(x, y, barycentric) for every atlas texel whose center lies in the triangle, given in texels
+template <typename Texel>
+void URasterizeLightmapTriangle(const glm::vec2 corners[3], int atlasSize, Texel texel)
+{
+    glm::vec2 low = glm::min(corners[0], glm::min(corners[1], corners[2]));
+    glm::vec2 high = glm::max(corners[0], glm::max(corners[1], corners[2]));
+    auto edge = [](const glm::vec2& a, const glm::vec2& b, const glm::vec2& p)
+    {
+        return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+    };
+    float area = edge(corners[0], corners[1], corners[2]);
+    if (std::fabs(area) < 1e-12f)
+    {
+        return;
+    }
+
+    int x0 = std::max(0, int(std::floor(low.x))), x1 = std::min(atlasSize - 1, int(std::ceil(high.x)));
+    int y0 = std::max(0, int(std::floor(low.y))), y1 = std::min(atlasSize - 1, int(std::ceil(high.y)));
+    for (int y = y0; y <= y1; y++)
+    {
+        for (int x = x0; x <= x1; x++)
+        {
+            glm::vec2 center(x + 0.5f, y + 0.5f);
+            glm::vec3 barycentric(edge(corners[1], corners[2], center), edge(corners[2], corners[0], center), edge(corners[0], corners[1], center));
+            barycentric /= area;
+            if (barycentric.x >= 0.0f && barycentric.y >= 0.0f && barycentric.z >= 0.0f)
+            {
+                texel(x, y, barycentric);
+            }
+        }
+    }
+}
+
+// Spread baked texels (alpha 1) into the empty texels (alpha 0) next to them, averaging the neighbours, for a number of rings
+inline void UDilateLightmap(std::vector<glm::vec4>& texels, int atlasSize, int rings)
+{
+    std::vector<glm::vec4> source;
+    for (int ring = 0; ring < rings; ring++)
+    {
+        source = texels;
+        for (int y = 0; y < atlasSize; y++)
+        {
+            for (int x = 0; x < atlasSize; x++)
+            {
+                if (source[y * atlasSize + x].a > 0.0f)
+                {
+                    continue;
+                }
+                glm::vec4 sum(0.0f);
+                for (int dy = -1; dy <= 1; dy++)
+                {
+                    for (int dx = -1; dx <= 1; dx++)
+                    {
+                        int nx = x + dx, ny = y + dy;
+                        if (nx >= 0 && ny >= 0 && nx < atlasSize && ny < atlasSize && source[ny * atlasSize + nx].a > 0.0f)
+                        {
+                            sum += glm::vec4(glm::vec3(source[ny * atlasSize + nx]), 1.0f);
+                        }
+                    }
+                }
+                if (sum.a > 0.0f)
+                {
+                    texels[y * atlasSize + x] = glm::vec4(glm::vec3(sum) / sum.a, 1.0f);
+                }
+            }
+        }
+    }
+}
+
+#endif
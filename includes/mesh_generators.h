@@ -0,0 +1,370 @@
+/*
+ * Procedural mesh generators
+ * Eric Slutz
+ *
+ * CPU side generators that fill a MeshData with interleaved vertex data
+ * (position, normal, texture coordinate) and triangle indices. The data is
+ * uploaded to the GPU by the caller.
+ */
+
+#ifndef MESH_GENERATORS_H
+#define MESH_GENERATORS_H
+
+#include "simd_math.h"
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <numbers>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Number of floats making up each vertex attribute
+const unsigned int FLOATS_PER_VERTEX = 3;
+const unsigned int FLOATS_PER_NORMAL = 3;
+const unsigned int FLOATS_PER_UV = 2;
+const unsigned int FLOATS_PER_ELEMENT = FLOATS_PER_VERTEX + FLOATS_PER_NORMAL + FLOATS_PER_UV;
+
+// Defines the available sphere tessellations
+enum SphereType {
+    SPHERE_UV,   // Latitude / longitude grid
+    SPHERE_ICO,  // Subdivided icosahedron
+    SPHERE_CUBE  // Normalized subdivided cube
+};
+
+// Interleaved vertex data and triangle indices of a mesh
+struct MeshData
+{
+    std::vector<float> verts;
+    std::vector<unsigned short> indices;
+
+    unsigned int VertexCount() const { return verts.size() / FLOATS_PER_ELEMENT; }
+    unsigned int TriangleCount() const { return indices.size() / 3; }
+
+    // Appends a vertex and returns its index
+    unsigned short AddVertex(const glm::vec3& position, const glm::vec3& normal, const glm::vec2& uv)
+    {
+        verts.insert(verts.end(), { position.x, position.y, position.z, normal.x, normal.y, normal.z, uv.x, uv.y });
+        return static_cast<unsigned short>(VertexCount() - 1);
+    }
+
+    // Appends a unit sphere vertex, using the same planar texture projection as the UV sphere
+    unsigned short AddSphereVertex(const glm::vec3& position)
+    {
+        return AddVertex(position, position, glm::vec2(position.x / 2 + 0.5f, position.y / 2 + 0.5f));
+    }
+
+    glm::vec3 Position(unsigned int index) const
+    {
+        const float* v = &verts[index * FLOATS_PER_ELEMENT];
+        return glm::vec3(v[0], v[1], v[2]);
+    }
+};
+
+// Vertex counts of the icosphere and cube sphere, and the finest of each whose indices fit in 16 bits
+constexpr int IcoSphereVertexCount(int subdivisions) { return 10 * (1 << (2 * subdivisions)) + 2; }
+constexpr int CubeSphereVertexCount(int divisions) { return 6 * divisions * divisions + 2; }
+constexpr int MAX_ICO_SPHERE_SUBDIVISIONS = 6;
+constexpr int MAX_CUBE_SPHERE_DIVISIONS = 104;
+static_assert(IcoSphereVertexCount(MAX_ICO_SPHERE_SUBDIVISIONS) <= 65536 && IcoSphereVertexCount(MAX_ICO_SPHERE_SUBDIVISIONS + 1) > 65536, "Finest icosphere must fit 16 bit indices");
+static_assert(CubeSphereVertexCount(MAX_CUBE_SPHERE_DIVISIONS) <= 65536 && CubeSphereVertexCount(MAX_CUBE_SPHERE_DIVISIONS + 1) > 65536, "Finest cube sphere must fit 16 bit indices");
+
+// Generate an icosphere by repeatedly splitting each triangle of an icosahedron into four.
+// Every vertex is shared by its neighbouring triangles, so the mesh is watertight.
+// 10 * 4^subdivisions + 2 vertices and 20 * 4^subdivisions triangles. Subdivisions are clamped to
+// MAX_ICO_SPHERE_SUBDIVISIONS so the indices don't wrap.
+inline void UGenerateIcoSphere(MeshData& data, int subdivisions)
+{
+    subdivisions = std::clamp(subdivisions, 0, MAX_ICO_SPHERE_SUBDIVISIONS);
+    data.verts.clear();
+    data.indices.clear();
+
+    // Icosahedron corners lie on three orthogonal golden rectangles
+    const float t = (1.0f + std::sqrt(5.0f)) / 2.0f;
+    const glm::vec3 corners[] = {
+        { -1,  t,  0 }, {  1,  t,  0 }, { -1, -t,  0 }, {  1, -t,  0 },
+        {  0, -1,  t }, {  0,  1,  t }, {  0, -1, -t }, {  0,  1, -t },
+        {  t,  0, -1 }, {  t,  0,  1 }, { -t,  0, -1 }, { -t,  0,  1 }
+    };
+    for (const glm::vec3& corner : corners)
+    {
+        data.AddSphereVertex(glm::normalize(corner));
+    }
+
+    // Faces wound counter clockwise when seen from outside
+    std::vector<unsigned short> faces = {
+        0, 11, 5,   0, 5, 1,    0, 1, 7,    0, 7, 10,   0, 10, 11,
+        1, 5, 9,    5, 11, 4,   11, 10, 2,  10, 7, 6,   7, 1, 8,
+        3, 9, 4,    3, 4, 2,    3, 2, 6,    3, 6, 8,    3, 8, 9,
+        4, 9, 5,    2, 4, 11,   6, 2, 10,   8, 6, 7,    9, 8, 1
+    };
+
+    for (int level = 0; level < subdivisions; level++)
+    {
+        // Midpoints are cached per edge so neighbouring triangles share them
+        std::map<std::pair<unsigned short, unsigned short>, unsigned short> midpoints;
+        auto midpoint = [&](unsigned short a, unsigned short b)
+        {
+            std::pair<unsigned short, unsigned short> key = a < b ? std::make_pair(a, b) : std::make_pair(b, a);
+            auto found = midpoints.find(key);
+            if (found != midpoints.end())
+            {
+                return found->second;
+            }
+            unsigned short index = data.AddSphereVertex(glm::normalize(data.Position(a) + data.Position(b)));
+            midpoints[key] = index;
+            return index;
+        };
+
+        std::vector<unsigned short> split;
+        split.reserve(faces.size() * 4);
+        for (size_t i = 0; i < faces.size(); i += 3)
+        {
+            unsigned short a = faces[i], b = faces[i + 1], c = faces[i + 2];
+            unsigned short ab = midpoint(a, b), bc = midpoint(b, c), ca = midpoint(c, a);
+            split.insert(split.end(), { a, ab, ca,   b, bc, ab,   c, ca, bc,   ab, bc, ca });
+        }
+        faces.swap(split);
+    }
+
+    data.indices = faces;
+}
+
+// Generate a cube sphere by projecting a subdivided cube onto the unit sphere.
+// Vertices on the cube edges are welded so the mesh is watertight.
+// 6 * divisions^2 + 2 vertices and 12 * divisions^2 triangles. Divisions are clamped to
+// MAX_CUBE_SPHERE_DIVISIONS so the indices don't wrap.
+inline void UGenerateCubeSphere(MeshData& data, int divisions)
+{
+    divisions = std::clamp(divisions, 1, MAX_CUBE_SPHERE_DIVISIONS);
+    data.verts.clear();
+    data.indices.clear();
+
+    // Face normal, and the two in-plane axes chosen so that u x v points outwards
+    const glm::ivec3 faces[6][3] = {
+        { {  1, 0, 0 }, { 0, 0, -1 }, { 0, 1, 0 } },
+        { { -1, 0, 0 }, { 0, 0,  1 }, { 0, 1, 0 } },
+        { { 0,  1, 0 }, { 1, 0,  0 }, { 0, 0, -1 } },
+        { { 0, -1, 0 }, { 1, 0,  0 }, { 0, 0,  1 } },
+        { { 0, 0,  1 }, { 1, 0,  0 }, { 0, 1, 0 } },
+        { { 0, 0, -1 }, { -1, 0, 0 }, { 0, 1, 0 } }
+    };
+
+    // Welds vertices by their integer lattice coordinate on the cube surface
+    std::map<std::tuple<int, int, int>, unsigned short> lattice;
+    std::vector<unsigned short> grid((divisions + 1) * (divisions + 1));
+
+    for (const auto& face : faces)
+    {
+        for (int i = 0; i <= divisions; i++)
+        {
+            for (int j = 0; j <= divisions; j++)
+            {
+                // Lattice coordinates run from -divisions to divisions in steps of 2
+                glm::ivec3 p = face[0] * divisions + face[1] * (2 * i - divisions) + face[2] * (2 * j - divisions);
+                std::tuple<int, int, int> key(p.x, p.y, p.z);
+
+                auto found = lattice.find(key);
+                if (found == lattice.end())
+                {
+                    // Equal-area style mapping keeps the cells more uniform than a plain normalize
+                    glm::vec3 c = glm::vec3(p) / float(divisions);
+                    glm::vec3 c2 = c * c;
+                    glm::vec3 s(
+                        c.x * std::sqrt(1 - c2.y / 2 - c2.z / 2 + c2.y * c2.z / 3),
+                        c.y * std::sqrt(1 - c2.z / 2 - c2.x / 2 + c2.z * c2.x / 3),
+                        c.z * std::sqrt(1 - c2.x / 2 - c2.y / 2 + c2.x * c2.y / 3));
+                    found = lattice.emplace(key, data.AddSphereVertex(glm::normalize(s))).first;
+                }
+                grid[i * (divisions + 1) + j] = found->second;
+            }
+        }
+
+        for (int i = 0; i < divisions; i++)
+        {
+            for (int j = 0; j < divisions; j++)
+            {
+                unsigned short a = grid[i * (divisions + 1) + j];
+                unsigned short b = grid[(i + 1) * (divisions + 1) + j];
+                unsigned short c = grid[(i + 1) * (divisions + 1) + j + 1];
+                unsigned short d = grid[i * (divisions + 1) + j + 1];
+                data.indices.insert(data.indices.end(), { a, b, c,   a, c, d });
+            }
+        }
+    }
+}
+
+// Size of the preallocated arrays the UV sphere and cylinder generators write into
+constexpr int UVSphereVertexCount(int complexity) { return (complexity + 1) * (complexity + 1); }
+constexpr int UVSphereIndexCount(int complexity) { return complexity * complexity * 6; }
+constexpr int CylinderVertexCount(int slices) { return (slices + 1) * 2; }
+constexpr int CylinderIndexCount(int slices) { return slices * 3 * 4; }
+
+// Generate a latitude / longitude sphere into preallocated arrays of
+// UVSphereVertexCount(complexity) * FLOATS_PER_ELEMENT floats and UVSphereIndexCount(complexity) indices.
+// The sines and cosines of each ring are evaluated once, four at a time, and rows are split across the pool.
+template <typename Index>
+void UGenerateUVSphere(float* verts, Index* indices, int complexity, ThreadPool* pool = nullptr)
+{
+    const double pi = std::numbers::pi;
+    const int ring = complexity + 1;
+
+    // Every vertex is a product of one latitude term and one longitude term
+    std::vector<float> angles(ring * 2), sines(ring * 2), cosines(ring * 2);
+    for (int i = 0; i < ring; i++)
+    {
+        angles[i] = static_cast<float>((i * (pi + pi)) / complexity - pi);
+        angles[ring + i] = static_cast<float>((i * (pi / 2 + pi / 2)) / complexity - pi / 2);
+    }
+    USinCos(angles.data(), sines.data(), cosines.data(), ring * 2);
+    const float* sinLat = sines.data();
+    const float* cosLat = cosines.data();
+    const float* sinLon = sines.data() + ring;
+    const float* cosLon = cosines.data() + ring;
+
+    auto rows = [&](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            float* v = verts + i * ring * FLOATS_PER_ELEMENT;
+            for (int j = 0; j < ring; j++, v += FLOATS_PER_ELEMENT)
+            {
+                float x = sinLat[i] * cosLon[j];
+                float y = sinLat[i] * sinLon[j];
+                float z = cosLat[i];
+
+                // Position, normal, and texture data
+                v[0] = x; v[1] = y; v[2] = z;
+                v[3] = x; v[4] = y; v[5] = z;
+                v[6] = x / 2 + 0.5f;
+                v[7] = y / 2 + 0.5f;
+            }
+
+            // The last row only closes the grid, it doesn't start a quad
+            if (i == complexity)
+            {
+                continue;
+            }
+
+            // Latitude runs through both poles, so the grid is mirrored where its sine is negative, and at odd
+            // complexity the band over the pole joins opposite sides of it, turning each quad into a bow tie whose
+            // two triangles face opposite ways. Each triangle is wound from its own normal instead, swapping two
+            // corners when it points into the sphere, so every one is counter clockwise seen from outside.
+            auto position = [&](int vertex)
+            {
+                const int row = vertex / ring, column = vertex % ring;
+                return glm::vec3(sinLat[row] * cosLon[column], sinLat[row] * sinLon[column], cosLat[row]);
+            };
+            Index* index = indices + i * complexity * 6;
+            for (int j = 0; j < complexity; j++)
+            {
+                const int quad[2][3] = {
+                    { i * ring + j, (i + 1) * ring + j, i * ring + (j + 1) },
+                    { (i + 1) * ring + (j + 1), i * ring + (j + 1), (i + 1) * ring + j }
+                };
+                for (const int* corners : quad)
+                {
+                    const glm::vec3 p0 = position(corners[0]), p1 = position(corners[1]), p2 = position(corners[2]);
+                    const bool inward = glm::dot(glm::cross(p1 - p0, p2 - p0), p0 + p1 + p2) < 0.0f;
+                    index[0] = static_cast<Index>(corners[0]);
+                    index[inward ? 2 : 1] = static_cast<Index>(corners[1]);
+                    index[inward ? 1 : 2] = static_cast<Index>(corners[2]);
+                    index += 3;
+                }
+            }
+        }
+    };
+
+    if (pool)
+    {
+        // Rows of roughly 16k vertices per task keep the scheduling cost negligible
+        pool->ParallelFor(ring, std::max(1, 16384 / ring), rows);
+    }
+    else
+    {
+        rows(0, ring);
+    }
+}
+
+// Generate a capped cylinder along the Z axis into preallocated arrays of
+// CylinderVertexCount(slices) * FLOATS_PER_ELEMENT floats and CylinderIndexCount(slices) indices.
+// Each cap is a ring of slices vertices followed by its center vertex.
+template <typename Index>
+void UGenerateCylinder(float* verts, Index* indices, int slices, ThreadPool* pool = nullptr)
+{
+    const float angle = static_cast<float>(2 * std::numbers::pi / slices);
+    const int secCircOffset = slices + 1;
+
+    std::vector<float> angles(slices), sines(slices), cosines(slices);
+    for (int i = 0; i < slices; i++)
+    {
+        angles[i] = angle * i;
+    }
+    USinCos(angles.data(), sines.data(), cosines.data(), slices);
+
+    auto sections = [&](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            // Position, normal, and texture data of both caps
+            for (int cap = 0; cap < 2; cap++)
+            {
+                float* v = verts + (i + cap * secCircOffset) * FLOATS_PER_ELEMENT;
+                float x = i == slices ? 0.0f : cosines[i];
+                float y = i == slices ? 0.0f : sines[i];
+                float z = cap == 0 ? 1.0f : -1.0f;
+                v[0] = x; v[1] = y; v[2] = z;
+                v[3] = x; v[4] = y; v[5] = z;
+                v[6] = x;
+                v[7] = y;
+            }
+
+            if (i == slices)
+            {
+                continue;
+            }
+
+            // Index data to share position data
+            int next = i + 1 < slices ? i + 1 : 0;
+            int pointer = i * 3;
+
+            // Triangles are counter clockwise seen from outside: top cap, bottom cap, then the two halves of the side quad
+            indices[pointer] = static_cast<Index>(i);
+            indices[pointer + 1] = static_cast<Index>(next);
+            indices[pointer + 2] = static_cast<Index>(slices);
+
+            pointer += slices * 3;
+
+            indices[pointer] = static_cast<Index>(i + secCircOffset);
+            indices[pointer + 1] = static_cast<Index>(slices + secCircOffset);
+            indices[pointer + 2] = static_cast<Index>(next + secCircOffset);
+
+            pointer += slices * 3;
+
+            indices[pointer] = static_cast<Index>(i);
+            indices[pointer + 1] = static_cast<Index>(i + secCircOffset);
+            indices[pointer + 2] = static_cast<Index>(next);
+
+            pointer += slices * 3;
+
+            indices[pointer] = static_cast<Index>(i + secCircOffset);
+            indices[pointer + 1] = static_cast<Index>(next + secCircOffset);
+            indices[pointer + 2] = static_cast<Index>(next);
+        }
+    };
+
+    if (pool)
+    {
+        pool->ParallelFor(slices + 1, 4096, sections);
+    }
+    else
+    {
+        sections(0, slices + 1);
+    }
+}
+
+#endif
@@ -0,0 +1,418 @@
+/*
+ * Quadric error mesh simplification
+ * Eric Slutz
+ *
+ * Reduces the triangle count of a MeshData with half edge collapses ordered by
+ * quadric error (Garland and Heckbert). Vertices on a UV or normal seam, and
+ * vertices on an open border, are never moved so texture mapping and hard
+ * edges are kept intact, and collapses that would fold or sharply bend a
+ * face, or make a non manifold edge, are skipped. A chain of such reductions
+ * forms the levels of detail of a mesh, each with the quadric error
+ * accumulated over its reductions.
+ */
+
+#ifndef MESH_SIMPLIFIER_H
+#define MESH_SIMPLIFIER_H
+
+#include "mesh_generators.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <iterator>
+#include <cmath>
+#include <map>
+#include <queue>
+#include <tuple>
+#include <vector>
+
+// Smallest cosine of the angle a surviving triangle may turn by in a collapse, so faces neither fold over nor bend sharply
+const float MIN_COLLAPSE_NORMAL_COS = 0.3f;
+
+// A simplified version of a mesh and the quadric error accumulated over the reductions that made it. The error is
+// the sum of each reduction's root mean square distance to the planes of its costliest collapse, an estimate of how far
+// the surface moved rather than a bound on it.
+struct MeshLod
+{
+    MeshData data;
+    float quadricError;
+};
+
+// Symmetric 4x4 matrix accumulating squared distances to a set of planes
+struct Quadric
+{
+    double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
+    double weight = 0;
+
+    static Quadric FromPlane(const glm::dvec3& n, double d, double weight)
+    {
+        Quadric q;
+        q.a2 = weight * n.x * n.x; q.ab = weight * n.x * n.y; q.ac = weight * n.x * n.z; q.ad = weight * n.x * d;
+        q.b2 = weight * n.y * n.y; q.bc = weight * n.y * n.z; q.bd = weight * n.y * d;
+        q.c2 = weight * n.z * n.z; q.cd = weight * n.z * d;
+        q.d2 = weight * d * d;
+        q.weight = weight;
+        return q;
+    }
+
+    Quadric& operator+=(const Quadric& o)
+    {
+        a2 += o.a2; ab += o.ab; ac += o.ac; ad += o.ad; b2 += o.b2;
+        bc += o.bc; bd += o.bd; c2 += o.c2; cd += o.cd; d2 += o.d2;
+        weight += o.weight;
+        return *this;
+    }
+
+    // Weighted mean of the squared distances from p to the planes
+    double Error(const glm::dvec3& p) const
+    {
+        if (weight <= 0)
+        {
+            return 0;
+        }
+        double e = a2 * p.x * p.x + 2 * ab * p.x * p.y + 2 * ac * p.x * p.z + 2 * ad * p.x
+            + b2 * p.y * p.y + 2 * bc * p.y * p.z + 2 * bd * p.y
+            + c2 * p.z * p.z + 2 * cd * p.z
+            + d2;
+        return e > 0 ? e / weight : 0;
+    }
+};
+
+// Simplify a mesh down to targetTriangles (or as close as the locked vertices allow).
+// Returns the square root of the largest quadric error of a collapse, in the units of the source positions.
+inline float USimplifyMesh(const MeshData& source, MeshData& result, unsigned int targetTriangles)
+{
+    const unsigned int vertexCount = source.VertexCount();
+    const unsigned int triangleCount = source.TriangleCount();
+
+    // Group attribute vertices sharing a position; a position used by several vertices is a seam
+    std::map<std::tuple<float, float, float>, unsigned int> positionIds;
+    std::vector<unsigned int> positionOf(vertexCount);
+    std::vector<unsigned int> verticesAtPosition;
+    for (unsigned int v = 0; v < vertexCount; v++)
+    {
+        glm::vec3 p = source.Position(v);
+        auto found = positionIds.emplace(std::make_tuple(p.x, p.y, p.z), (unsigned int)verticesAtPosition.size());
+        if (found.second)
+        {
+            verticesAtPosition.push_back(0);
+        }
+        positionOf[v] = found.first->second;
+        verticesAtPosition[positionOf[v]]++;
+    }
+
+    std::vector<unsigned int> tris(source.indices.begin(), source.indices.end());
+    std::vector<bool> removed(triangleCount, false);
+    std::vector<std::vector<unsigned int>> trianglesOf(vertexCount);
+    for (unsigned int t = 0; t < triangleCount; t++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            trianglesOf[tris[t * 3 + k]].push_back(t);
+        }
+    }
+
+    // Positional edges used by a single triangle lie on an open border
+    std::vector<bool> locked(vertexCount, false);
+    std::map<std::pair<unsigned int, unsigned int>, int> edgeUses;
+    for (unsigned int t = 0; t < triangleCount; t++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            unsigned int a = positionOf[tris[t * 3 + k]], b = positionOf[tris[t * 3 + (k + 1) % 3]];
+            edgeUses[std::minmax(a, b)]++;
+        }
+    }
+    for (unsigned int t = 0; t < triangleCount; t++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            unsigned int a = tris[t * 3 + k], b = tris[t * 3 + (k + 1) % 3];
+            if (edgeUses[std::minmax(positionOf[a], positionOf[b])] != 2)
+            {
+                locked[a] = locked[b] = true;
+            }
+        }
+    }
+    for (unsigned int v = 0; v < vertexCount; v++)
+    {
+        if (verticesAtPosition[positionOf[v]] > 1)
+        {
+            locked[v] = true;
+        }
+    }
+
+    // Area weighted plane quadric of every triangle, accumulated on its corners
+    std::vector<Quadric> quadrics(vertexCount);
+    for (unsigned int t = 0; t < triangleCount; t++)
+    {
+        glm::dvec3 p0 = source.Position(tris[t * 3]), p1 = source.Position(tris[t * 3 + 1]), p2 = source.Position(tris[t * 3 + 2]);
+        glm::dvec3 n = glm::cross(p1 - p0, p2 - p0);
+        double area = glm::length(n);
+        if (area <= 0)
+        {
+            continue;
+        }
+        n /= area;
+        Quadric q = Quadric::FromPlane(n, -glm::dot(n, p0), area / 2);
+        for (int k = 0; k < 3; k++)
+        {
+            quadrics[tris[t * 3 + k]] += q;
+        }
+    }
+
+    // Candidate collapses, invalidated lazily through a per vertex version number
+    struct Collapse
+    {
+        double cost;
+        unsigned int from, to, version;
+        bool operator<(const Collapse& o) const { return cost > o.cost; }
+    };
+    std::priority_queue<Collapse> queue;
+    std::vector<unsigned int> version(vertexCount, 0);
+
+    auto pushCollapses = [&](unsigned int v)
+    {
+        if (locked[v])
+        {
+            return;
+        }
+        for (unsigned int t : trianglesOf[v])
+        {
+            if (removed[t])
+            {
+                continue;
+            }
+            for (int k = 0; k < 3; k++)
+            {
+                unsigned int to = tris[t * 3 + k];
+                if (to != v)
+                {
+                    Quadric q = quadrics[v];
+                    q += quadrics[to];
+                    queue.push({ q.Error(source.Position(to)), v, to, version[v] });
+                }
+            }
+        }
+    };
+    for (unsigned int v = 0; v < vertexCount; v++)
+    {
+        pushCollapses(v);
+    }
+
+    unsigned int remaining = triangleCount;
+    double maxCost = 0;
+    while (remaining > targetTriangles && !queue.empty())
+    {
+        Collapse c = queue.top();
+        queue.pop();
+        if (c.version != version[c.from] || locked[c.from])
+        {
+            continue;
+        }
+
+        // Reject collapses whose edge has neighbours other than the corners opposite it (the link condition), as
+        // merging its ends would join two sheets of the surface into a non manifold edge
+        std::vector<unsigned int> fromRing, toRing, opposite;
+        for (unsigned int t : trianglesOf[c.from])
+        {
+            if (removed[t])
+            {
+                continue;
+            }
+            bool hasTarget = tris[t * 3] == c.to || tris[t * 3 + 1] == c.to || tris[t * 3 + 2] == c.to;
+            for (int k = 0; k < 3; k++)
+            {
+                unsigned int v = tris[t * 3 + k];
+                if (v != c.from && v != c.to)
+                {
+                    fromRing.push_back(positionOf[v]);
+                    if (hasTarget)
+                    {
+                        opposite.push_back(positionOf[v]);
+                    }
+                }
+            }
+        }
+        for (unsigned int t : trianglesOf[c.to])
+        {
+            for (int k = 0; !removed[t] && k < 3; k++)
+            {
+                unsigned int v = tris[t * 3 + k];
+                if (v != c.from && v != c.to)
+                {
+                    toRing.push_back(positionOf[v]);
+                }
+            }
+        }
+        for (std::vector<unsigned int>* ring : { &fromRing, &toRing, &opposite })
+        {
+            std::sort(ring->begin(), ring->end());
+            ring->erase(std::unique(ring->begin(), ring->end()), ring->end());
+        }
+        std::vector<unsigned int> shared;
+        std::set_intersection(fromRing.begin(), fromRing.end(), toRing.begin(), toRing.end(), std::back_inserter(shared));
+        if (shared != opposite)
+        {
+            continue;
+        }
+
+        // Reject collapses that flip, fold or sharply bend any triangle that survives them
+        const glm::vec3 target = source.Position(c.to);
+        bool flips = false;
+        for (unsigned int t : trianglesOf[c.from])
+        {
+            if (removed[t])
+            {
+                continue;
+            }
+            glm::vec3 p[3], q[3];
+            bool hasTarget = false;
+            for (int k = 0; k < 3; k++)
+            {
+                unsigned int v = tris[t * 3 + k];
+                hasTarget |= v == c.to;
+                p[k] = source.Position(v);
+                q[k] = v == c.from ? target : p[k];
+            }
+            if (hasTarget)
+            {
+                continue;
+            }
+            glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+            glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+            float lengths = glm::length(before) * glm::length(after);
+            if (lengths <= 0 || glm::dot(before, after) < MIN_COLLAPSE_NORMAL_COS * lengths)
+            {
+                flips = true;
+                break;
+            }
+        }
+        if (flips)
+        {
+            continue;
+        }
+
+        // Move every triangle of the collapsed vertex to the target, dropping the ones that degenerate
+        for (unsigned int t : trianglesOf[c.from])
+        {
+            if (removed[t])
+            {
+                continue;
+            }
+            unsigned int* corners = &tris[t * 3];
+            if (corners[0] == c.to || corners[1] == c.to || corners[2] == c.to)
+            {
+                removed[t] = true;
+                remaining--;
+                continue;
+            }
+            for (int k = 0; k < 3; k++)
+            {
+                if (corners[k] == c.from)
+                {
+                    corners[k] = c.to;
+                }
+            }
+            trianglesOf[c.to].push_back(t);
+        }
+        trianglesOf[c.from].clear();
+
+        // Drop the triangles the target lost along the way
+        std::vector<unsigned int>& around = trianglesOf[c.to];
+        around.erase(std::remove_if(around.begin(), around.end(), [&](unsigned int t) { return removed[t]; }), around.end());
+
+        quadrics[c.to] += quadrics[c.from];
+        maxCost = std::max(maxCost, c.cost);
+        version[c.from]++;
+        version[c.to]++;
+
+        // The target and its neighbours now see a different quadric
+        std::vector<unsigned int> neighbours;
+        for (unsigned int t : around)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                neighbours.push_back(tris[t * 3 + k]);
+            }
+        }
+        std::sort(neighbours.begin(), neighbours.end());
+        neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+        for (unsigned int v : neighbours)
+        {
+            if (v != c.to)
+            {
+                version[v]++;
+            }
+            pushCollapses(v);
+        }
+    }
+
+    // Compact the surviving triangles and the vertices they use
+    result.verts.clear();
+    result.indices.clear();
+    std::vector<int> remap(vertexCount, -1);
+    for (unsigned int t = 0; t < triangleCount; t++)
+    {
+        if (removed[t])
+        {
+            continue;
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            unsigned int v = tris[t * 3 + k];
+            if (remap[v] < 0)
+            {
+                remap[v] = result.VertexCount();
+                const float* src = &source.verts[v * FLOATS_PER_ELEMENT];
+                result.verts.insert(result.verts.end(), src, src + FLOATS_PER_ELEMENT);
+            }
+            result.indices.push_back(static_cast<unsigned short>(remap[v]));
+        }
+    }
+
+    return static_cast<float>(std::sqrt(maxCost));
+}
+
+// Build a chain of levels of detail, each keeping `ratio` of the previous level's triangles.
+// Level 0 is the source mesh with no error. Each level is reduced from the one before it, so
+// its accumulated quadric error is the sum of the errors of every step. The chain stops early
+// once a level can't be reduced any further.
+inline std::vector<MeshLod> UBuildLodChain(const MeshData& source, int levels, float ratio = 0.5f)
+{
+    std::vector<MeshLod> chain;
+    chain.push_back({ source, 0.0f });
+
+    for (int level = 1; level < levels; level++)
+    {
+        const MeshLod& previous = chain.back();
+        unsigned int target = static_cast<unsigned int>(previous.data.TriangleCount() * ratio);
+
+        MeshLod lod;
+        lod.quadricError = previous.quadricError + USimplifyMesh(previous.data, lod.data, target);
+        if (lod.data.TriangleCount() >= previous.data.TriangleCount())
+        {
+            break;
+        }
+        chain.push_back(lod);
+    }
+
+    return chain;
+}
+
+// Pick the coarsest level whose accumulated quadric error, projected to the screen, stays under
+// maxPixelError. pixelsPerUnit is the screen size in pixels of one world unit at the object's distance.
+inline int USelectLod(const std::vector<float>& quadricErrors, float objectScale, float pixelsPerUnit, float maxPixelError = 1.0f)
+{
+    int selected = 0;
+    for (int level = 0; level < (int)quadricErrors.size(); level++)
+    {
+        if (quadricErrors[level] * objectScale * pixelsPerUnit <= maxPixelError)
+        {
+            selected = level;
+        }
+    }
+    return selected;
+}
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * Compile time mesh tables
+ * Eric Slutz
+ *
+ * constexpr builders for the small fixed meshes of the scene (cube / wedge,
+ * plane and pyramid). Evaluated into a constexpr variable, the vertex data,
+ * face normals and bounds are computed by the compiler and stored as constant
+ * data, so creating the mesh at startup is only an upload.
+ */
+
+#ifndef MESH_TABLES_H
+#define MESH_TABLES_H
+
+#include "mesh_generators.h"
+
+#include <stdexcept>
+
+// Interleaved vertex data (position, normal, texture coordinate), optional indices and bounds of a fixed mesh
+template <int VertexCount, int IndexCount>
+struct MeshTable
+{
+    static constexpr int vertexCount = VertexCount;
+    static constexpr int indexCount = IndexCount;
+
+    float verts[VertexCount * FLOATS_PER_ELEMENT];
+    unsigned short indices[IndexCount > 0 ? IndexCount : 1]; // Unused when the mesh isn't indexed
+    float boundsMin[3];
+    float boundsMax[3];
+
+    constexpr void ComputeBounds()
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            boundsMin[axis] = boundsMax[axis] = verts[axis];
+            for (int v = 1; v < VertexCount; v++)
+            {
+                float value = verts[v * FLOATS_PER_ELEMENT + axis];
+                boundsMin[axis] = value < boundsMin[axis] ? value : boundsMin[axis];
+                boundsMax[axis] = value > boundsMax[axis] ? value : boundsMax[axis];
+            }
+        }
+    }
+};
+
+namespace mesh_table_detail
+{
+    struct Vec3
+    {
+        float x, y, z;
+    };
+
+    constexpr float Sqrt(float value)
+    {
+        // Newton iteration; converges in a handful of steps for the magnitudes used here
+        float guess = value > 1 ? value : 1;
+        for (int i = 0; i < 32; i++)
+        {
+            guess = 0.5f * (guess + value / guess);
+        }
+        return guess;
+    }
+
+    // Unit normal of the triangle (a, b, c) wound counter clockwise
+    constexpr Vec3 FaceNormal(Vec3 a, Vec3 b, Vec3 c)
+    {
+        Vec3 u{ b.x - a.x, b.y - a.y, b.z - a.z };
+        Vec3 v{ c.x - a.x, c.y - a.y, c.z - a.z };
+        Vec3 n{ u.y * v.z - u.z * v.y, u.z * v.x - u.x * v.z, u.x * v.y - u.y * v.x };
+        float length = Sqrt(n.x * n.x + n.y * n.y + n.z * n.z);
+        return { n.x / length, n.y / length, n.z / length };
+    }
+
+    constexpr void CheckHeights(float frontHeight, float backHeight)
+    {
+        if (frontHeight < 0 || frontHeight > 1 || backHeight < 0 || backHeight > 1)
+        {
+            throw std::invalid_argument("Height must be between 0 and 1");
+        }
+    }
+}
+
+// Cube with the top edge of the front and back faces at the given heights (0 to 1); a wedge when they differ.
+// Drawn as 36 unindexed vertices.
+constexpr MeshTable<36, 0> UCubeTable(float frontHeight = 1.0f, float backHeight = 1.0f)
+{
+    mesh_table_detail::CheckHeights(frontHeight, backHeight);
+
+    const float fh = -1 + (frontHeight * 2), bh = -1 + (backHeight * 2);
+
+    // The top face rises from the back edge to the front edge, so its normal tilts towards the lower side
+    const mesh_table_detail::Vec3 top = mesh_table_detail::FaceNormal({ -1.0f, fh, 1.0f }, { 1.0f, fh, 1.0f }, { 1.0f, bh, -1.0f });
+
+    MeshTable<36, 0> table = { {
+        // Positions           // Normals              //Textures
+        // ------------------------------------------------------
+        // Back Face          Negative Z Normal       Texture Coords.
+       -1.0f, -1.0f, -1.0f,   0.0f,  0.0f, -1.0f,     0.0f, 0.0f,
+        1.0f,  bh,   -1.0f,   0.0f,  0.0f, -1.0f,     1.0f, 1.0f,
+        1.0f, -1.0f, -1.0f,   0.0f,  0.0f, -1.0f,     1.0f, 0.0f,
+        1.0f,  bh,   -1.0f,   0.0f,  0.0f, -1.0f,     1.0f, 1.0f,
+       -1.0f, -1.0f, -1.0f,   0.0f,  0.0f, -1.0f,     0.0f, 0.0f,
+       -1.0f,  bh,   -1.0f,   0.0f,  0.0f, -1.0f,     0.0f, 1.0f,
+
+        // Front Face         Positive Z Normal       Texture Coords.
+       -1.0f, -1.0f,  1.0f,   0.0f,  0.0f,  1.0f,     0.0f, 0.0f,
+        1.0f, -1.0f,  1.0f,   0.0f,  0.0f,  1.0f,     1.0f, 0.0f,
+        1.0f,  fh,    1.0f,   0.0f,  0.0f,  1.0f,     1.0f, 1.0f,
+        1.0f,  fh,    1.0f,   0.0f,  0.0f,  1.0f,     1.0f, 1.0f,
+       -1.0f,  fh,    1.0f,   0.0f,  0.0f,  1.0f,     0.0f, 1.0f,
+       -1.0f, -1.0f,  1.0f,   0.0f,  0.0f,  1.0f,     0.0f, 0.0f,
+
+        // Left Face          Negative X Normal       Texture Coords.
+       -1.0f,  fh,    1.0f,  -1.0f,  0.0f,  0.0f,     1.0f, 0.0f,
+       -1.0f,  bh,   -1.0f,  -1.0f,  0.0f,  0.0f,     1.0f, 1.0f,
+       -1.0f, -1.0f, -1.0f,  -1.0f,  0.0f,  0.0f,     0.0f, 1.0f,
+       -1.0f, -1.0f, -1.0f,  -1.0f,  0.0f,  0.0f,     0.0f, 1.0f,
+       -1.0f, -1.0f,  1.0f,  -1.0f,  0.0f,  0.0f,     0.0f, 0.0f,
+       -1.0f,  fh,    1.0f,  -1.0f,  0.0f,  0.0f,     1.0f, 0.0f,
+
+        // Right Face         Positive X Normal       Texture Coords.
+        1.0f,  fh,    1.0f,   1.0f,  0.0f,  0.0f,     1.0f, 0.0f,
+        1.0f, -1.0f, -1.0f,   1.0f,  0.0f,  0.0f,     0.0f, 1.0f,
+        1.0f,  bh,   -1.0f,   1.0f,  0.0f,  0.0f,     1.0f, 1.0f,
+        1.0f, -1.0f, -1.0f,   1.0f,  0.0f,  0.0f,     0.0f, 1.0f,
+        1.0f,  fh,    1.0f,   1.0f,  0.0f,  0.0f,     1.0f, 0.0f,
+        1.0f, -1.0f,  1.0f,   1.0f,  0.0f,  0.0f,     0.0f, 0.0f,
+
+        // Bottom Face        Negative Y Normal       Texture Coords.
+       -1.0f, -1.0f, -1.0f,   0.0f, -1.0f,  0.0f,     0.0f, 1.0f,
+        1.0f, -1.0f, -1.0f,   0.0f, -1.0f,  0.0f,     1.0f, 1.0f,
+        1.0f, -1.0f,  1.0f,   0.0f, -1.0f,  0.0f,     1.0f, 0.0f,
+        1.0f, -1.0f,  1.0f,   0.0f, -1.0f,  0.0f,     1.0f, 0.0f,
+       -1.0f, -1.0f,  1.0f,   0.0f, -1.0f,  0.0f,     0.0f, 0.0f,
+       -1.0f, -1.0f, -1.0f,   0.0f, -1.0f,  0.0f,     0.0f, 1.0f,
+
+        // Top Face           Sloped Normal           Texture Coords.
+       -1.0f,  bh,   -1.0f,   top.x, top.y, top.z,    0.0f, 1.0f,
+        1.0f,  fh,    1.0f,   top.x, top.y, top.z,    1.0f, 0.0f,
+        1.0f,  bh,   -1.0f,   top.x, top.y, top.z,    1.0f, 1.0f,
+        1.0f,  fh,    1.0f,   top.x, top.y, top.z,    1.0f, 0.0f,
+       -1.0f,  bh,   -1.0f,   top.x, top.y, top.z,    0.0f, 1.0f,
+       -1.0f,  fh,    1.0f,   top.x, top.y, top.z,    0.0f, 0.0f
+    }, {}, {}, {} };
+
+    table.ComputeBounds();
+    return table;
+}
+
+// Plane with its front and back edges at the given heights (0 to 1)
+constexpr MeshTable<4, 6> UPlaneTable(float frontHeight = 0.5f, float backHeight = 0.5f)
+{
+    mesh_table_detail::CheckHeights(frontHeight, backHeight);
+
+    const float fh = -1 + (frontHeight * 2), bh = -1 + (backHeight * 2);
+    const mesh_table_detail::Vec3 n = mesh_table_detail::FaceNormal({ -1.0f, fh, 1.0f }, { 1.0f, fh, 1.0f }, { -1.0f, bh, -1.0f });
+
+    MeshTable<4, 6> table = {
+        {
+            // Positions        // Normals         //Textures
+            // ----------------------------------------------
+           -1.0f,  fh,  1.0f,   n.x, n.y, n.z,     0.0f, 1.0f, // Index 0 - top left
+            1.0f,  fh,  1.0f,   n.x, n.y, n.z,     1.0f, 1.0f, // Index 1 - top right
+            1.0f,  bh, -1.0f,   n.x, n.y, n.z,     1.0f, 0.0f, // Index 2 - bottom right
+           -1.0f,  bh, -1.0f,   n.x, n.y, n.z,     0.0f, 0.0f, // Index 3 - bottom left
+        },
+        {
+            0, 1, 3,  // Triangle 1
+            1, 2, 3   // Triangle 2
+        },
+        {}, {}
+    };
+
+    table.ComputeBounds();
+    return table;
+}
+
+// Square based pyramid. Each face has its own vertices so its normal is the true face normal.
+constexpr MeshTable<16, 18> UPyramidTable()
+{
+    using mesh_table_detail::Vec3;
+    using mesh_table_detail::FaceNormal;
+
+    const Vec3 apex{ 0.0f, 0.75f, 0.0f };
+    const Vec3 base[4] = { { 0.5f, -0.75f, 0.5f }, { 0.5f, -0.75f, -0.5f }, { -0.5f, -0.75f, -0.5f }, { -0.5f, -0.75f, 0.5f } };
+
+    MeshTable<16, 18> table = {};
+    int v = 0, i = 0;
+    auto addVertex = [&](Vec3 p, Vec3 n, float s, float t)
+    {
+        const float values[FLOATS_PER_ELEMENT] = { p.x, p.y, p.z, n.x, n.y, n.z, s, t };
+        for (unsigned int k = 0; k < FLOATS_PER_ELEMENT; k++)
+        {
+            table.verts[v * FLOATS_PER_ELEMENT + k] = values[k];
+        }
+        return static_cast<unsigned short>(v++);
+    };
+
+    // Sides, counter clockwise seen from outside
+    for (int side = 0; side < 4; side++)
+    {
+        Vec3 a = base[side], b = base[(side + 1) % 4];
+        Vec3 n = FaceNormal(a, b, apex);
+        table.indices[i++] = addVertex(a, n, 0.0f, 0.0f);
+        table.indices[i++] = addVertex(b, n, 1.0f, 0.0f);
+        table.indices[i++] = addVertex(apex, n, 0.5f, 1.0f);
+    }
+
+    // Base, facing down
+    const Vec3 down{ 0.0f, -1.0f, 0.0f };
+    unsigned short corner[4];
+    for (int k = 0; k < 4; k++)
+    {
+        corner[k] = addVertex(base[k], down, base[k].x + 0.5f, base[k].z + 0.5f);
+    }
+    const unsigned short bottom[6] = { corner[0], corner[3], corner[2], corner[0], corner[2], corner[1] };
+    for (unsigned short index : bottom)
+    {
+        table.indices[i++] = index;
+    }
+
+    table.ComputeBounds();
+    return table;
+}
+
+#endif
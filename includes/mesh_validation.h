@@ -0,0 +1,90 @@
+/*
+ * Mesh validation
+ * Eric Slutz
+ *
+ * Checks that every triangle of a mesh is wound counter clockwise seen from
+ * the side its vertex normals point to, which is the side OpenGL keeps when
+ * back faces are culled. The checks are constexpr so compile time mesh tables
+ * can be validated with static_assert; generated meshes are checked when
+ * they load.
+ */
+
+#ifndef MESH_VALIDATION_H
+#define MESH_VALIDATION_H
+
+#include "mesh_generators.h"
+#include "mesh_tables.h"
+
+// Triangle counts found by a winding check
+struct WindingReport
+{
+    unsigned int triangles = 0;
+    unsigned int flipped = 0; // Wound clockwise seen from the side the normals point to
+    unsigned int degenerate = 0; // Without area, or with normals that don't pick a side
+};
+
+namespace mesh_validation_detail
+{
+    constexpr float Dot(const float* a, const float* b)
+    {
+        return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+    }
+
+    // 1 when the triangle faces the way its normals point, -1 when it faces away and 0 when it can't tell
+    constexpr int Facing(const float* verts, unsigned int a, unsigned int b, unsigned int c)
+    {
+        const float* pa = verts + a * FLOATS_PER_ELEMENT;
+        const float* pb = verts + b * FLOATS_PER_ELEMENT;
+        const float* pc = verts + c * FLOATS_PER_ELEMENT;
+        const float u[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+        const float v[3] = { pc[0] - pa[0], pc[1] - pa[1], pc[2] - pa[2] };
+        const float face[3] = { u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2], u[0] * v[1] - u[1] * v[0] };
+        float normal[3] = {};
+        for (int axis = 0; axis < 3; axis++)
+        {
+            normal[axis] = pa[FLOATS_PER_VERTEX + axis] + pb[FLOATS_PER_VERTEX + axis] + pc[FLOATS_PER_VERTEX + axis];
+        }
+
+        // Slivers thinner than float precision (such as the pole rows of a UV sphere) have no reliable winding
+        float edge = Dot(u, u) > Dot(v, v) ? Dot(u, u) : Dot(v, v);
+        if (Dot(face, face) <= 1e-12f * edge * edge)
+        {
+            return 0;
+        }
+
+        float side = Dot(face, normal);
+        return side > 0 ? 1 : (side < 0 ? -1 : 0);
+    }
+}
+
+// Check the winding of indexed triangles, or of consecutive vertices when indices is null
+template <typename Index>
+constexpr WindingReport UCheckWinding(const float* verts, const Index* indices, unsigned int nIndices)
+{
+    WindingReport report;
+    for (unsigned int i = 0; i + 2 < nIndices; i += 3)
+    {
+        int facing = indices
+            ? mesh_validation_detail::Facing(verts, indices[i], indices[i + 1], indices[i + 2])
+            : mesh_validation_detail::Facing(verts, i, i + 1, i + 2);
+        report.triangles++;
+        report.flipped += facing < 0 ? 1 : 0;
+        report.degenerate += facing == 0 ? 1 : 0;
+    }
+    return report;
+}
+
+template <int VertexCount, int IndexCount>
+constexpr WindingReport UCheckWinding(const MeshTable<VertexCount, IndexCount>& table)
+{
+    return IndexCount > 0
+        ? UCheckWinding(table.verts, table.indices, IndexCount)
+        : UCheckWinding<unsigned short>(table.verts, nullptr, VertexCount);
+}
+
+inline WindingReport UCheckWinding(const MeshData& mesh)
+{
+    return UCheckWinding(mesh.verts.data(), mesh.indices.data(), mesh.indices.size());
+}
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * Meshlets
+ * Eric Slutz
+ *
+ * Splits an indexed mesh into clusters of neighbouring triangles of at most
+ * 64 vertices and 124 triangles, each with a bounding sphere and a cone
+ * around its triangle normals. Clusters that face away from the camera or
+ * lie outside the view can be skipped as a whole before drawing, so the
+ * triangles drawn follow what is visible rather than the size of the mesh.
+ */
+
+#ifndef MESHLETS_H
+#define MESHLETS_H
+
+#include "mesh_generators.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+const unsigned int MESHLET_MAX_VERTICES = 64;
+const unsigned int MESHLET_MAX_TRIANGLES = 124;
+
+struct Meshlet
+{
+    unsigned int firstIndex; // Start of the meshlet's triangles in the reordered index list
+    unsigned int triangleCount;
+    unsigned int firstVertex; // Start of the meshlet's vertices in the meshlet vertex list
+    unsigned int vertexCount;
+    glm::vec3 center; // Bounding sphere
+    float radius;
+    glm::vec3 coneAxis; // Average direction of the triangle normals
+    float coneCutoff; // Sine of the normal cone's half angle, above 1 when the cluster can't face away as a whole
+};
+
+struct MeshletData
+{
+    std::vector<Meshlet> meshlets;
+    std::vector<unsigned short> indices; // The mesh's triangles, grouped meshlet by meshlet
+    std::vector<unsigned short> vertices; // Mesh vertices used by each meshlet
+};
+
+// Camera in a mesh's own coordinates. Back facing and frustum tests give the same answer there as in
+// world space, and the meshlet bounds stay valid under non uniform scale.
+struct MeshletCamera
+{
+    glm::vec4 planes[6]; // Frustum planes, pointing inwards and normalized
+    glm::vec3 position;
+    glm::vec3 direction; // View direction, used instead of the position by orthographic views
+    bool orthographic;
+};
+
+// Group the triangles of a mesh into meshlets. Each meshlet grows from a seed triangle by adding the
+// neighbouring triangle that brings in the fewest new vertices, until it is full or has no neighbour left.
+inline void UBuildMeshlets(const MeshData& mesh, MeshletData& result)
+{
+    const unsigned int vertexCount = mesh.VertexCount();
+    const unsigned int triangleCount = mesh.TriangleCount();
+    const std::vector<unsigned short>& indices = mesh.indices;
+
+    result.meshlets.clear();
+    result.indices.clear();
+    result.vertices.clear();
+    result.indices.reserve(indices.size());
+
+    // Triangles around each vertex, stored contiguously
+    std::vector<unsigned int> firstTriangle(vertexCount + 1, 0);
+    for (unsigned short index : indices)
+    {
+        firstTriangle[index + 1]++;
+    }
+    for (unsigned int v = 0; v < vertexCount; v++)
+    {
+        firstTriangle[v + 1] += firstTriangle[v];
+    }
+    std::vector<unsigned int> trianglesOf(indices.size());
+    std::vector<unsigned int> filled(firstTriangle.begin(), firstTriangle.end() - 1);
+    for (unsigned int t = 0; t < triangleCount; t++)
+    {
+        for (int corner = 0; corner < 3; corner++)
+        {
+            trianglesOf[filled[indices[t * 3 + corner]]++] = t;
+        }
+    }
+
+    std::vector<bool> assigned(triangleCount, false);
+    std::vector<bool> inMeshlet(vertexCount, false);
+    unsigned int seed = 0;
+
+    while (true)
+    {
+        while (seed < triangleCount && assigned[seed])
+        {
+            seed++;
+        }
+        if (seed == triangleCount)
+        {
+            break;
+        }
+
+        Meshlet meshlet = {};
+        meshlet.firstIndex = result.indices.size();
+        meshlet.firstVertex = result.vertices.size();
+
+        auto newVertices = [&](unsigned int t)
+        {
+            unsigned int count = 0;
+            for (int corner = 0; corner < 3; corner++)
+            {
+                count += inMeshlet[indices[t * 3 + corner]] ? 0 : 1;
+            }
+            return count;
+        };
+        auto add = [&](unsigned int t)
+        {
+            for (int corner = 0; corner < 3; corner++)
+            {
+                unsigned short v = indices[t * 3 + corner];
+                if (!inMeshlet[v])
+                {
+                    inMeshlet[v] = true;
+                    result.vertices.push_back(v);
+                    meshlet.vertexCount++;
+                }
+                result.indices.push_back(v);
+            }
+            assigned[t] = true;
+            meshlet.triangleCount++;
+        };
+
+        add(seed);
+        while (meshlet.triangleCount < MESHLET_MAX_TRIANGLES)
+        {
+            // Best unassigned neighbour of the meshlet's vertices; lower triangle numbers win ties
+            unsigned int best = triangleCount, bestNew = 4;
+            for (unsigned int i = meshlet.firstVertex; i < result.vertices.size() && bestNew > 0; i++)
+            {
+                unsigned short v = result.vertices[i];
+                for (unsigned int k = firstTriangle[v]; k < firstTriangle[v + 1]; k++)
+                {
+                    unsigned int t = trianglesOf[k];
+                    if (assigned[t])
+                    {
+                        continue;
+                    }
+                    unsigned int count = newVertices(t);
+                    if (count < bestNew || (count == bestNew && t < best))
+                    {
+                        best = t;
+                        bestNew = count;
+                    }
+                }
+            }
+            if (best == triangleCount || meshlet.vertexCount + bestNew > MESHLET_MAX_VERTICES)
+            {
+                break;
+            }
+            add(best);
+        }
+
+        // Bounding sphere around the center of the vertices' box
+        glm::vec3 boxMin = mesh.Position(result.vertices[meshlet.firstVertex]), boxMax = boxMin;
+        for (unsigned int i = meshlet.firstVertex; i < result.vertices.size(); i++)
+        {
+            inMeshlet[result.vertices[i]] = false;
+            boxMin = glm::min(boxMin, mesh.Position(result.vertices[i]));
+            boxMax = glm::max(boxMax, mesh.Position(result.vertices[i]));
+        }
+        meshlet.center = (boxMin + boxMax) * 0.5f;
+        for (unsigned int i = meshlet.firstVertex; i < result.vertices.size(); i++)
+        {
+            meshlet.radius = std::max(meshlet.radius, glm::length(mesh.Position(result.vertices[i]) - meshlet.center));
+        }
+
+        // Normal cone: the average face normal and the widest angle any face makes with it
+        std::vector<glm::vec3> normals;
+        glm::vec3 sum(0.0f);
+        for (unsigned int i = meshlet.firstIndex; i < result.indices.size(); i += 3)
+        {
+            glm::vec3 a = mesh.Position(result.indices[i]), b = mesh.Position(result.indices[i + 1]), c = mesh.Position(result.indices[i + 2]);
+            glm::vec3 normal = glm::cross(b - a, c - a);
+            float length = glm::length(normal);
+            if (length > 0.0f)
+            {
+                normals.push_back(normal / length);
+                sum += normals.back();
+            }
+        }
+        meshlet.coneCutoff = 2.0f;
+        if (glm::length(sum) > 0.0f)
+        {
+            meshlet.coneAxis = glm::normalize(sum);
+            float minDot = 1.0f;
+            for (const glm::vec3& normal : normals)
+            {
+                minDot = std::min(minDot, glm::dot(normal, meshlet.coneAxis));
+            }
+
+            // Faces more than 90 degrees apart never all face away together
+            if (minDot > 0.0f)
+            {
+                meshlet.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+            }
+        }
+
+        result.meshlets.push_back(meshlet);
+    }
+}
+
+// Express the camera in the coordinates of a mesh drawn with the given model matrix
+inline MeshletCamera UMeshletCamera(const glm::mat4& viewProjection, const glm::mat4& model, const glm::vec3& position,
+    const glm::vec3& direction, bool orthographic)
+{
+    MeshletCamera camera;
+
+    // Planes of the clip volume, taken from the rows of the full transform
+    glm::mat4 clip = glm::transpose(viewProjection * model);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        camera.planes[axis * 2] = clip[3] + clip[axis];
+        camera.planes[axis * 2 + 1] = clip[3] - clip[axis];
+    }
+    for (glm::vec4& plane : camera.planes)
+    {
+        plane /= glm::length(glm::vec3(plane));
+    }
+
+    glm::mat4 inverseModel = glm::inverse(model);
+    camera.position = glm::vec3(inverseModel * glm::vec4(position, 1.0f));
+    camera.direction = glm::vec3(inverseModel * glm::vec4(direction, 0.0f));
+    camera.orthographic = orthographic;
+    return camera;
+}
+
+// Whether any triangle of the meshlet can be seen: it must be inside the frustum and not facing away as a whole
+inline bool UMeshletVisible(const Meshlet& meshlet, const MeshletCamera& camera)
+{
+    for (const glm::vec4& plane : camera.planes)
+    {
+        if (glm::dot(glm::vec3(plane), meshlet.center) + plane.w < -meshlet.radius)
+        {
+            return false;
+        }
+    }
+
+    if (camera.orthographic)
+    {
+        return glm::dot(glm::normalize(camera.direction), meshlet.coneAxis) < meshlet.coneCutoff;
+    }
+
+    // Every direction from the camera into the bounding sphere must lie within the cone's complement.
+    // The radius term widens the test to cover the whole sphere.
+    glm::vec3 toCenter = meshlet.center - camera.position;
+    return glm::dot(toCenter, meshlet.coneAxis) < meshlet.coneCutoff * glm::length(toCenter) + meshlet.radius * (1.0f + meshlet.coneCutoff);
+}
+
+#endif
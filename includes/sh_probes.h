@@ -0,0 +1,121 @@
+/*
+ * Spherical harmonic probes
+ * Eric Slutz
+ *
+ * Stores the light arriving at points of a grid as order 2 spherical
+ * harmonics, nine coefficients per color channel. Radiance sampled in many
+ * directions around a probe is projected onto the harmonics, then convolved
+ * with the cosine lobe so evaluating the result at a normal gives the
+ * irradiance of a surface facing that way. Shaders blend the eight probes
+ * around a point.
+ */
+
+#ifndef SH_PROBES_H
+#define SH_PROBES_H
+
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+const int SH_COEFFICIENTS = 9;
+
+// Radiance or irradiance around a point, one color per harmonic
+struct SHProbe
+{
+    glm::vec3 coefficients[SH_COEFFICIENTS] = {};
+};
+
+// Values of the nine harmonics in a unit direction
+inline void USHBasis(const glm::vec3& d, float basis[SH_COEFFICIENTS])
+{
+    basis[0] = 0.282095f;
+    basis[1] = 0.488603f * d.y;
+    basis[2] = 0.488603f * d.z;
+    basis[3] = 0.488603f * d.x;
+    basis[4] = 1.092548f * d.x * d.y;
+    basis[5] = 1.092548f * d.y * d.z;
+    basis[6] = 0.315392f * (3.0f * d.z * d.z - 1.0f);
+    basis[7] = 1.092548f * d.x * d.z;
+    basis[8] = 0.546274f * (d.x * d.x - d.y * d.y);
+}
+
+// Add radiance arriving from a unit direction, weighted by the solid angle the sample stands for
+inline void USHAddRadiance(SHProbe& probe, const glm::vec3& direction, const glm::vec3& radiance, float weight)
+{
+    float basis[SH_COEFFICIENTS];
+    USHBasis(direction, basis);
+    for (int i = 0; i < SH_COEFFICIENTS; i++)
+    {
+        probe.coefficients[i] += radiance * (basis[i] * weight);
+    }
+}
+
+// Turn projected radiance into irradiance: each band is scaled by the cosine lobe's matching harmonic
+inline void USHConvolveCosine(SHProbe& probe)
+{
+    const float pi = std::numbers::pi_v<float>;
+    const float bands[3] = { pi, 2.0f * pi / 3.0f, pi / 4.0f };
+    for (int i = 0; i < SH_COEFFICIENTS; i++)
+    {
+        probe.coefficients[i] *= bands[i == 0 ? 0 : (i < 4 ? 1 : 2)];
+    }
+}
+
+inline glm::vec3 USHEvaluate(const SHProbe& probe, const glm::vec3& direction)
+{
+    float basis[SH_COEFFICIENTS];
+    USHBasis(direction, basis);
+    glm::vec3 result(0.0f);
+    for (int i = 0; i < SH_COEFFICIENTS; i++)
+    {
+        result += probe.coefficients[i] * basis[i];
+    }
+    return result;
+}
+
+// Directions spread evenly over the sphere along a Fibonacci spiral
+inline std::vector<glm::vec3> USphereDirections(int count)
+{
+    const float goldenAngle = 2.39996323f;
+    std::vector<glm::vec3> directions(count);
+    for (int i = 0; i < count; i++)
+    {
+        float z = 1.0f - (2.0f * i + 1.0f) / count;
+        float radius = std::sqrt(std::max(0.0f, 1.0f - z * z));
+        directions[i] = glm::vec3(radius * std::cos(goldenAngle * i), radius * std::sin(goldenAngle * i), z);
+    }
+    return directions;
+}
+
+// Probes evenly spaced through a box, x fastest then y then z
+struct ProbeGrid
+{
+    glm::vec3 origin = glm::vec3(0.0f); // First probe
+    glm::vec3 spacing = glm::vec3(1.0f);
+    glm::ivec3 counts = glm::ivec3(0);
+
+    // Cover the box with about targetSpacing between probes and no more than maxCount along an axis
+    void Fit(const glm::vec3& boxMin, const glm::vec3& boxMax, float targetSpacing, int maxCount)
+    {
+        glm::vec3 size = boxMax - boxMin;
+        counts = glm::clamp(glm::ivec3(glm::ceil(size / targetSpacing)) + 1, glm::ivec3(2), glm::ivec3(maxCount));
+        spacing = glm::max(size / glm::vec3(counts - 1), glm::vec3(1e-3f));
+        origin = boxMin;
+    }
+
+    int Count() const
+    {
+        return counts.x * counts.y * counts.z;
+    }
+
+    glm::vec3 Position(int index) const
+    {
+        glm::ivec3 cell(index % counts.x, (index / counts.x) % counts.y, index / (counts.x * counts.y));
+        return origin + glm::vec3(cell) * spacing;
+    }
+};
+
+#endif
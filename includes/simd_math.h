@@ -0,0 +1,114 @@
+/*
+ * Vectorized math helpers
+ * Eric Slutz
+ *
+ * Array versions of scalar math functions, evaluated four lanes at a time
+ * with SSE2 where the target supports it and with the same polynomials in
+ * plain C++ elsewhere.
+ */
+
+#ifndef SIMD_MATH_H
+#define SIMD_MATH_H
+
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_MATH_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace simd_detail
+{
+    // pi / 2 split in three parts so that x - k * pi / 2 stays exact for large k
+    const float PIO2_HI = 1.5703125f;
+    const float PIO2_MID = 4.837512969970703125e-4f;
+    const float PIO2_LO = 7.54978995489188216e-8f;
+    const float TWO_OVER_PI = 0.636619772367581343f;
+
+    // Minimax polynomials on [-pi/4, pi/4]
+    inline void SinCosReduced(float r, float& s, float& c)
+    {
+        float r2 = r * r;
+        s = r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f + r2 * -1.9515295891e-4f));
+        c = 1.0f - 0.5f * r2 + r2 * r2 * (4.166664568298827e-2f + r2 * (-1.388731625493765e-3f + r2 * 2.443315711809948e-5f));
+    }
+
+    inline void SinCos(float x, float& s, float& c)
+    {
+        float k = std::nearbyint(x * TWO_OVER_PI);
+        float r = ((x - k * PIO2_HI) - k * PIO2_MID) - k * PIO2_LO;
+        float rs, rc;
+        SinCosReduced(r, rs, rc);
+
+        // Rotate the result by the quadrant
+        switch (static_cast<int>(k) & 3)
+        {
+        case 0: s = rs; c = rc; break;
+        case 1: s = rc; c = -rs; break;
+        case 2: s = -rs; c = -rc; break;
+        default: s = -rc; c = rs; break;
+        }
+    }
+}
+
+// Computes sines[i] = sin(angles[i]) and cosines[i] = cos(angles[i]) for count angles
+inline void USinCos(const float* angles, float* sines, float* cosines, int count)
+{
+    int i = 0;
+
+#ifdef SIMD_MATH_SSE2
+    using namespace simd_detail;
+    const __m128 twoOverPi = _mm_set1_ps(TWO_OVER_PI);
+    const __m128 pio2Hi = _mm_set1_ps(PIO2_HI);
+    const __m128 pio2Mid = _mm_set1_ps(PIO2_MID);
+    const __m128 pio2Lo = _mm_set1_ps(PIO2_LO);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i quadrantOne = _mm_set1_epi32(1);
+    const __m128i quadrantTwo = _mm_set1_epi32(2);
+    const __m128 signBit = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(angles + i);
+
+        // Quadrant and reduced angle
+        __m128i k = _mm_cvtps_epi32(_mm_mul_ps(x, twoOverPi));
+        __m128 kf = _mm_cvtepi32_ps(k);
+        __m128 r = _mm_sub_ps(x, _mm_mul_ps(kf, pio2Hi));
+        r = _mm_sub_ps(r, _mm_mul_ps(kf, pio2Mid));
+        r = _mm_sub_ps(r, _mm_mul_ps(kf, pio2Lo));
+
+        __m128 r2 = _mm_mul_ps(r, r);
+        __m128 ps = _mm_add_ps(_mm_set1_ps(8.3321608736e-3f), _mm_mul_ps(r2, _mm_set1_ps(-1.9515295891e-4f)));
+        ps = _mm_add_ps(_mm_set1_ps(-1.6666654611e-1f), _mm_mul_ps(r2, ps));
+        ps = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(r, r2), ps));
+
+        __m128 pc = _mm_add_ps(_mm_set1_ps(-1.388731625493765e-3f), _mm_mul_ps(r2, _mm_set1_ps(2.443315711809948e-5f)));
+        pc = _mm_add_ps(_mm_set1_ps(4.166664568298827e-2f), _mm_mul_ps(r2, pc));
+        pc = _mm_add_ps(_mm_sub_ps(one, _mm_mul_ps(half, r2)), _mm_mul_ps(_mm_mul_ps(r2, r2), pc));
+
+        // Odd quadrants swap sine and cosine
+        __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(k, quadrantOne), quadrantOne));
+        __m128 s = _mm_or_ps(_mm_and_ps(swap, pc), _mm_andnot_ps(swap, ps));
+        __m128 c = _mm_or_ps(_mm_and_ps(swap, ps), _mm_andnot_ps(swap, pc));
+
+        // Quadrants 2 and 3 negate the sine, quadrants 1 and 2 negate the cosine
+        __m128 negateSin = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(k, quadrantTwo), 30));
+        __m128 negateCos = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(k, quadrantOne), quadrantTwo), 30));
+        s = _mm_xor_ps(s, _mm_and_ps(negateSin, signBit));
+        c = _mm_xor_ps(c, _mm_and_ps(negateCos, signBit));
+
+        _mm_storeu_ps(sines + i, s);
+        _mm_storeu_ps(cosines + i, c);
+    }
+#endif
+
+    // Remaining angles, or all of them without SSE2
+    for (; i < count; i++)
+    {
+        simd_detail::SinCos(angles[i], sines[i], cosines[i]);
+    }
+}
+
+#endif
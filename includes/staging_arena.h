@@ -0,0 +1,149 @@
+/*
+ * Staging arena
+ * Eric Slutz
+ *
+ * Heap memory for the temporary vertex and index arrays a mesh is built in
+ * before it is uploaded. Allocations are bumped out of large blocks and all
+ * released at once by Reset, which keeps the memory for the next mesh, so
+ * rebuilding meshes at runtime doesn't allocate once the arena has grown to
+ * the largest mesh. A Scope releases only what was allocated while it was
+ * open, so scopes can nest.
+ */
+
+#ifndef STAGING_ARENA_H
+#define STAGING_ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+class StagingArena
+{
+public:
+    // constructor with the size of the first block in bytes
+    explicit StagingArena(size_t blockSize = 256 * 1024) : blockSize(blockSize)
+    {
+    }
+
+    StagingArena(const StagingArena&) = delete;
+    StagingArena& operator=(const StagingArena&) = delete;
+
+    // Returns uninitialized storage for count values of T, valid until the next Reset
+    template <typename T>
+    T* Allocate(size_t count)
+    {
+        return static_cast<T*>(AllocateBytes(count * sizeof(T)));
+    }
+
+    // Releases every allocation. Memory spread over several blocks is merged into one
+    // block large enough for all of it, so the same workload fits in a single block next time.
+    void Reset()
+    {
+        if (blocks.size() > 1 || rewoundBytes > 0)
+        {
+            size_t total = rewoundBytes;
+            for (const Block& block : blocks)
+            {
+                total += block.size;
+            }
+            blocks.clear();
+            AddBlock(total);
+            rewoundBytes = 0;
+        }
+        used = 0;
+    }
+
+    // Position of the next allocation, to release everything allocated after it with Rewind
+    struct Marker
+    {
+        size_t blockCount;
+        size_t used;
+    };
+
+    Marker Mark() const
+    {
+        return { blocks.size(), used };
+    }
+
+    // Releases the allocations made since marker was taken. Rewinding to an empty arena is a Reset.
+    void Rewind(const Marker& marker)
+    {
+        if (marker.blockCount <= 1 && marker.used == 0)
+        {
+            Reset();
+            return;
+        }
+        for (size_t block = marker.blockCount; block < blocks.size(); block++)
+        {
+            rewoundBytes += blocks[block].size;
+        }
+        blocks.erase(blocks.begin() + marker.blockCount, blocks.end());
+        used = marker.used;
+    }
+
+    // Bytes reserved from the heap
+    size_t Capacity() const
+    {
+        size_t total = 0;
+        for (const Block& block : blocks)
+        {
+            total += block.size;
+        }
+        return total;
+    }
+
+    // Releases the allocations made while it is in scope
+    class Scope
+    {
+    public:
+        explicit Scope(StagingArena& arena) : arena(arena), marker(arena.Mark()) {}
+        ~Scope() { arena.Rewind(marker); }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        StagingArena& arena;
+        Marker marker;
+    };
+
+private:
+    // SSE loads and stores want 16 byte alignment
+    static const size_t ALIGNMENT = 16;
+
+    struct Block
+    {
+        std::unique_ptr<unsigned char[]> memory;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t blockSize;
+    size_t used = 0; // Bytes used in the last block
+    size_t rewoundBytes = 0; // Size of the blocks freed by Rewind, added back by the next Reset
+
+    void AddBlock(size_t size)
+    {
+        blocks.push_back({ std::unique_ptr<unsigned char[]>(new unsigned char[size + ALIGNMENT]), size });
+        used = 0;
+    }
+
+    void* AllocateBytes(size_t bytes)
+    {
+        bytes = (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        if (blocks.empty() || used + bytes > blocks.back().size)
+        {
+            AddBlock(std::max(bytes, blockSize));
+            blockSize = std::max(blockSize, blocks.back().size);
+        }
+
+        // Align the block start, the sizes handed out keep every later allocation aligned
+        unsigned char* base = blocks.back().memory.get();
+        base += (ALIGNMENT - reinterpret_cast<size_t>(base) % ALIGNMENT) % ALIGNMENT;
+
+        void* allocation = base + used;
+        used += bytes;
+        return allocation;
+    }
+};
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * Thread pool
+ * Eric Slutz
+ *
+ * A fixed set of worker threads that split a range of work items between
+ * them. The calling thread takes part in the work and ParallelFor only
+ * returns once every item is done. A task that calls ParallelFor on its own
+ * pool runs the inner range itself, as every thread may already be busy.
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    // constructor, defaults to one thread per hardware core (the caller counts as one)
+    explicit ThreadPool(unsigned int threads = std::thread::hardware_concurrency())
+    {
+        for (unsigned int i = 1; i < std::max(threads, 1u); i++)
+        {
+            workers.emplace_back([this] { WorkerLoop(); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Number of threads working on a ParallelFor, including the caller
+    unsigned int Size() const
+    {
+        return workers.size() + 1;
+    }
+
+    // Calls task(begin, end) over [0, count) in chunks of at most grainSize items, and waits for all of them.
+    // Called from a task of this pool, it runs the whole range on the calling thread.
+    void ParallelFor(int count, int grainSize, const std::function<void(int, int)>& task)
+    {
+        if (count <= 0)
+        {
+            return;
+        }
+        grainSize = std::max(grainSize, 1);
+        if (workers.empty() || count <= grainSize || runningPool == this)
+        {
+            task(0, count);
+            return;
+        }
+
+        // Only one range is shared with the workers at a time
+        std::lock_guard<std::mutex> submit(submitMutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &task;
+            jobCount = count;
+            jobGrain = grainSize;
+            nextItem = 0;
+            pending = (count + grainSize - 1) / grainSize;
+            generation++;
+        }
+        wake.notify_all();
+
+        int finished = RunChunks(task, count, grainSize);
+
+        // Workers still holding the range must let go of it before the next one is posted
+        std::unique_lock<std::mutex> lock(mutex);
+        pending -= finished;
+        done.wait(lock, [this] { return pending == 0 && active == 0; });
+        job = nullptr;
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex submitMutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(int, int)>* job = nullptr;
+    int jobCount = 0;
+    int jobGrain = 1;
+    std::atomic<int> nextItem{ 0 };
+    int pending = 0;
+    int active = 0;
+    unsigned int generation = 0;
+    bool stopping = false;
+
+    // Pool whose task the current thread is running, if any
+    static inline thread_local const ThreadPool* runningPool = nullptr;
+
+    // Claim chunks until the range is used up, returning how many were run
+    int RunChunks(const std::function<void(int, int)>& task, int count, int grainSize)
+    {
+        const ThreadPool* outer = runningPool;
+        runningPool = this;
+        int finished = 0;
+        for (int begin = nextItem.fetch_add(grainSize); begin < count; begin = nextItem.fetch_add(grainSize))
+        {
+            task(begin, std::min(begin + grainSize, count));
+            finished++;
+        }
+        runningPool = outer;
+        return finished;
+    }
+
+    void WorkerLoop()
+    {
+        unsigned int seen = 0;
+        while (true)
+        {
+            const std::function<void(int, int)>* task;
+            int count, grainSize;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || (job != nullptr && generation != seen); });
+                if (stopping)
+                {
+                    return;
+                }
+                seen = generation;
+                task = job;
+                count = jobCount;
+                grainSize = jobGrain;
+                active++;
+            }
+
+            int finished = RunChunks(*task, count, grainSize);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            pending -= finished;
+            active--;
+            if (pending == 0 && active == 0)
+            {
+                done.notify_all();
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,18 @@
+@echo off
+rem Compile the shaders to SPIR-V for OpenGL with glslang, one module per stage file, into shaders\spirv.
+rem Run before each build; without the Vulkan SDK's glslangValidator it does nothing and the program
+rem compiles the GLSL itself. Modules older than a shader file are not used, so a skipped step is harmless.
+
+setlocal
+set GLSLANG=glslangValidator
+if defined VULKAN_SDK set GLSLANG="%VULKAN_SDK%\Bin\glslangValidator.exe"
+%GLSLANG% --version >nul 2>&1 || (
+    echo glslangValidator not found, shaders will be compiled from GLSL at startup
+    exit /b 0
+)
+
+cd /d "%~dp0"
+if not exist spirv mkdir spirv
+for %%f in (*.vert *.tesc *.tese *.frag) do (
+    %GLSLANG% -G -o spirv\%%f.spv %%f || exit /b 1
+)
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Compile the shaders to SPIR-V for OpenGL with glslang, one module per stage file, into shaders/spirv.
+# The counterpart of compile_spirv.bat for builds off Windows, run by the Makefile before each build; without
+# glslangValidator it does nothing and the program compiles the GLSL itself. Modules older than a shader file are
+# not used, so a skipped step is harmless.
+
+GLSLANG=glslangValidator
+if [ -n "$VULKAN_SDK" ] && [ -x "$VULKAN_SDK/bin/glslangValidator" ]; then
+    GLSLANG="$VULKAN_SDK/bin/glslangValidator"
+fi
+if ! "$GLSLANG" --version >/dev/null 2>&1; then
+    echo "glslangValidator not found, shaders will be compiled from GLSL at startup"
+    exit 0
+fi
+
+cd "$(dirname "$0")" || exit 1
+mkdir -p spirv
+for f in *.vert *.tesc *.tese *.frag; do
+    "$GLSLANG" -G -o "spirv/$f.spv" "$f" || exit 1
+done
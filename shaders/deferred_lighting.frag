@@ -0,0 +1,51 @@
+#version 440 core
+
+// Deferred Lighting Fragment Shader, including the lighting shader
+#extension GL_GOOGLE_include_directive : require
+#include "lighting.glsl"
+
+layout(location = 0) out vec4 fragmentColor;
+
+layout(location = 48, binding = 0) uniform sampler2D gAlbedo;
+layout(location = 49, binding = 1) uniform sampler2D gNormal;
+layout(location = 50, binding = 2) uniform sampler2D gDepth;
+layout(location = 51) uniform mat4 inverseViewProjection;
+layout(location = 55) uniform vec2 viewportSize;
+
+// Unfold the octahedron stored by the G-buffer pass back onto the unit sphere
+vec3 OctahedralDecode(vec2 encoded)
+{
+    vec2 e = encoded * 2.0f - 1.0f;
+    vec3 n = vec3(e.x, e.y, 1.0f - abs(e.x) - abs(e.y));
+    float fold = max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -fold : fold;
+    n.y += n.y >= 0.0f ? -fold : fold;
+    return normalize(n);
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    if (depth == 1.0f)
+    {
+        discard; // Nothing was drawn here, keep the background
+    }
+    gl_FragDepth = depth; // Lets the lamps drawn afterwards hide behind the scene
+
+    // World position from the pixel and its depth
+    vec4 clip = vec4(gl_FragCoord.xy / viewportSize * 2.0f - 1.0f, depth * 2.0f - 1.0f, 1.0f);
+    vec4 world = inverseViewProjection * clip;
+    vec3 fragmentPos = world.xyz / world.w;
+
+    uvec2 cluster = LightCluster(fragmentPos, gl_FragCoord.xy);
+    if (showClusterHeatmap)
+    {
+        fragmentColor = vec4(ClusterHeatmap(cluster.y), 1.0f);
+        return;
+    }
+
+    vec3 norm = OctahedralDecode(texelFetch(gNormal, pixel, 0).xy);
+    vec3 phong = PhongLighting(fragmentPos, norm, cluster, false) * texelFetch(gAlbedo, pixel, 0).rgb;
+    fragmentColor = vec4(phong, 1.0);
+}
@@ -0,0 +1,9 @@
+#version 440 core
+
+// Fullscreen Vertex Shader, a triangle covering the screen without vertex data
+
+void main()
+{
+    vec2 corner = vec2((gl_VertexID & 1) * 4.0f - 1.0f, (gl_VertexID >> 1) * 4.0f - 1.0f);
+    gl_Position = vec4(corner, 0.0f, 1.0f);
+}
@@ -0,0 +1,27 @@
+#version 440 core
+
+// G-buffer Fragment Shader, the first pass of deferred shading
+
+layout(location = 0) in vec3 vertexFragmentPos; // For incoming fragment position
+layout(location = 1) in vec3 vertexNormal; // For incoming normals
+layout(location = 2) in vec2 vertexTextureCoordinate; // For incoming texture coordinate
+
+layout(location = 0) out vec4 albedo; // Texture color
+layout(location = 1) out vec2 encodedNormal; // Octahedral normal mapped to [0, 1]; the position comes back from the depth buffer
+
+layout(location = 15, binding = 0) uniform sampler2D uTexture;
+layout(location = 14) uniform vec2 uvScale;
+
+// Fold the unit sphere onto an octahedron and flatten it into the [-1, 1] square
+vec2 OctahedralEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 signs = vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+    return n.z >= 0.0f ? n.xy : (1.0f - abs(n.yx)) * signs;
+}
+
+void main()
+{
+    albedo = texture(uTexture, vertexTextureCoordinate * uvScale);
+    encodedNormal = OctahedralEncode(normalize(vertexNormal)) * 0.5f + 0.5f;
+}
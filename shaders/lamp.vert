@@ -0,0 +1,27 @@
+#version 440 core
+
+// Lamp Vertex Shader
+
+layout(location = 0) in vec3 position; // Vertex data from Vertex Attrib Pointer 0
+
+// Each instance is the marker of one light of the light buffer
+struct Light
+{
+    vec4 positionScale; // Position, and the scale of the lamp marker
+    vec4 colorAmbient;
+    vec4 specular;
+};
+layout(std430, binding = 0) readonly buffer LightBuffer
+{
+    Light lights[];
+};
+
+// Uniform / Global variables for the  transform matrices
+layout(location = 4) uniform mat4 view;
+layout(location = 8) uniform mat4 projection;
+
+void main()
+{
+    vec4 light = lights[gl_InstanceID].positionScale;
+    gl_Position = projection * view * vec4(light.xyz + position * light.w, 1.0f); // Transforms vertices into clip coordinates
+}
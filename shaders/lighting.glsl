@@ -0,0 +1,203 @@
+// Lighting Shader, included by the fragment shaders that light the scene. Variants compiled from source define
+// LIGHT_COUNT and each of the SHADER_FEATURES as true or false above it (see UShaderVariant); variants loaded from
+// SPIR-V set them as specialization constants, numbered after the feature bits.
+#ifdef GL_SPIRV
+layout(constant_id = 0) const int LIGHT_COUNT = 0;
+layout(constant_id = 1) const bool SPECULAR = true;
+layout(constant_id = 2) const bool SHADOWS = true;
+layout(constant_id = 3) const bool PROBES = true;
+layout(constant_id = 4) const bool CLUSTERS = true;
+layout(constant_id = 5) const bool OBJECT_LIGHTS = true;
+layout(constant_id = 6) const bool LIGHTMAP = false;
+layout(constant_id = 7) const bool BLINN_PHONG = false;
+layout(constant_id = 8) const bool FAST_SPECULAR = false;
+#endif
+
+// The scene's lights and the camera/view position
+struct Light
+{
+    vec4 positionScale; // Position, and the scale of the lamp marker
+    vec4 colorAmbient; // Color, and the ambient strength
+    vec4 specular; // Intensity, highlight size, range (0 reaches everywhere) and shadow map (-1 for none)
+};
+layout(std430, binding = 0) readonly buffer LightBuffer
+{
+    Light lights[];
+};
+layout(location = 17) uniform int lightCount;
+layout(location = 18) uniform vec3 viewPosition;
+
+// Lights of each cluster of the view, a grid of screen tiles cut into depth slices
+layout(std430, binding = 1) readonly buffer ClusterBuffer
+{
+    uvec2 clusters[]; // Offset and count of each cluster's lights in lightIndices
+};
+layout(std430, binding = 2) readonly buffer LightIndexBuffer
+{
+    uint lightIndices[];
+};
+layout(location = 4) uniform mat4 view;
+layout(location = 19) uniform bool showClusterHeatmap; // Color fragments by the number of lights in their cluster
+layout(location = 20) uniform ivec3 clusterCounts;
+layout(location = 21) uniform vec2 clusterTileSize; // Pixels per screen tile
+layout(location = 22) uniform float clusterDepthScale; // slice = log(depth) * scale + bias
+layout(location = 23) uniform float clusterDepthBias;
+
+// Cube shadow maps holding the distance from each light to its nearest caster over shadowFarPlane
+layout(location = 24, binding = 3) uniform samplerCubeArray shadowMaps; // Static casters, drawn again only when their light moves
+layout(location = 25, binding = 4) uniform samplerCubeArray dynamicShadowMaps; // Moving casters, drawn every frame
+layout(location = 26) uniform bool dynamicShadows;
+layout(location = 27) uniform float shadowFarPlane;
+
+// 0 when a caster is between the light and the point, 1 otherwise
+float Shadow(vec3 toLight, float map)
+{
+    if (!SHADOWS || map < 0.0f)
+    {
+        return 1.0f;
+    }
+    vec4 coord = vec4(-toLight, map);
+    float nearest = texture(shadowMaps, coord).r;
+    if (dynamicShadows)
+    {
+        nearest = min(nearest, texture(dynamicShadowMaps, coord).r);
+    }
+
+    // The bias grows with distance, as the texels of the map do
+    float distanceToLight = length(toLight);
+    return distanceToLight - 0.01f * distanceToLight - 0.02f > nearest * shadowFarPlane ? 0.0f : 1.0f;
+}
+
+// Irradiance probes: nine coefficients each, the first's w saying whether the probe is usable
+struct Probe
+{
+    vec4 coefficients[9];
+};
+layout(std430, binding = 3) readonly buffer ProbeBuffer
+{
+    Probe probes[];
+};
+layout(location = 28) uniform vec3 probeGridOrigin;
+layout(location = 29) uniform vec3 probeGridSpacing;
+layout(location = 30) uniform ivec3 probeGridCounts;
+
+// Irradiance of a surface facing along norm, blended from the usable probes of the grid cell around the point,
+// with an alpha of 0 when none of them are usable
+vec4 ProbeIrradiance(vec3 fragmentPos, vec3 norm)
+{
+    vec3 cell = clamp((fragmentPos - probeGridOrigin) / probeGridSpacing, vec3(0.0f), vec3(probeGridCounts - 1));
+    ivec3 base = min(ivec3(cell), probeGridCounts - 2);
+    vec3 t = cell - vec3(base);
+    float basis[9] = float[9](0.282095f, 0.488603f * norm.y, 0.488603f * norm.z, 0.488603f * norm.x,
+        1.092548f * norm.x * norm.y, 1.092548f * norm.y * norm.z, 0.315392f * (3.0f * norm.z * norm.z - 1.0f),
+        1.092548f * norm.x * norm.z, 0.546274f * (norm.x * norm.x - norm.y * norm.y));
+
+    vec4 sum = vec4(0.0f);
+    for (int corner = 0; corner < 8; corner++)
+    {
+        ivec3 side = ivec3(corner & 1, (corner >> 1) & 1, corner >> 2);
+        ivec3 probe = base + side;
+        int index = probe.x + probeGridCounts.x * (probe.y + probeGridCounts.y * probe.z);
+        vec3 axisWeights = mix(1.0f - t, t, vec3(side));
+        float weight = axisWeights.x * axisWeights.y * axisWeights.z * probes[index].coefficients[0].w;
+        vec3 irradiance = vec3(0.0f);
+        for (int i = 0; i < 9; i++)
+        {
+            irradiance += probes[index].coefficients[i].rgb * basis[i];
+        }
+        sum += vec4(max(irradiance, vec3(0.0f)) * weight, weight);
+    }
+    return sum.a > 0.0f ? vec4(sum.rgb / sum.a, 1.0f) : vec4(0.0f);
+}
+
+// Lights reaching the object being drawn, listed on the CPU; a count of -1 when the draw has no list
+layout(location = 31) uniform int objectLightCount;
+layout(location = 32) uniform uint objectLights[16]; // MAX_OBJECT_LIGHTS
+
+// Lights to shade at a fragment: its object's, its cluster's, or all of them
+uvec2 LightCluster(vec3 fragmentPos, vec2 fragCoord)
+{
+    if (OBJECT_LIGHTS && objectLightCount >= 0)
+    {
+        return uvec2(0u, uint(objectLightCount));
+    }
+    if (!CLUSTERS)
+    {
+        return uvec2(0u, LIGHT_COUNT > 0 ? uint(LIGHT_COUNT) : uint(lightCount));
+    }
+    ivec2 tile = min(ivec2(fragCoord / clusterTileSize), clusterCounts.xy - 1);
+    float depth = -(view * vec4(fragmentPos, 1.0f)).z;
+    int slice = clamp(int(log(depth) * clusterDepthScale + clusterDepthBias), 0, clusterCounts.z - 1);
+    return clusters[tile.x + clusterCounts.x * (tile.y + clusterCounts.y * slice)];
+}
+
+// Blue through green to red at 16 lights or more
+vec3 ClusterHeatmap(uint count)
+{
+    float heat = min(float(count) / 16.0f, 1.0f);
+    return vec3(clamp(2.0f * heat - 1.0f, 0.0f, 1.0f), 1.0f - abs(2.0f * heat - 1.0f), clamp(1.0f - 2.0f * heat, 0.0f, 1.0f));
+}
+
+// x to the power n for the specular highlight, or Schlick's approximation of it (a division instead of a log and an
+// exponent), which keeps the highlight's peak and size but widens its tail a little
+float SpecularPower(float x, float n)
+{
+    return FAST_SPECULAR ? x / (n - n * x + x) : pow(x, n);
+}
+
+// Phong lighting model calculations to generate ambient, diffuse, and specular components, summed over the cluster's lights.
+// With specularOnly the ambient and diffuse components are left out, for surfaces that have them baked into a lightmap.
+vec3 PhongLighting(vec3 fragmentPos, vec3 norm, uvec2 cluster, bool specularOnly)
+{
+    vec3 viewDir = normalize(viewPosition - fragmentPos); // Calculate view direction
+
+    // Ambient light comes from the probes where they cover the point, otherwise from each light's flat ambient term
+    vec4 probe = PROBES && !specularOnly ? ProbeIrradiance(fragmentPos, norm) : vec4(0.0f);
+    vec3 lighting = probe.rgb;
+
+    // A fixed light count gives the loop a constant length the compiler can unroll
+    uint count = LIGHT_COUNT > 0 ? uint(LIGHT_COUNT) : cluster.y;
+    for (uint k = 0u; k < count; k++)
+    {
+        uint i = (OBJECT_LIGHTS && objectLightCount >= 0) ? objectLights[k] : (CLUSTERS ? lightIndices[cluster.x + k] : k);
+        vec3 lightColor = lights[i].colorAmbient.rgb;
+
+        // Lights with a range fade out smoothly before reaching it
+        vec3 toLight = lights[i].positionScale.xyz - fragmentPos;
+        float distanceToLight = length(toLight);
+        float range = lights[i].specular.z;
+        float fade = range > 0.0f ? pow(clamp(1.0f - pow(distanceToLight / range, 4.0f), 0.0f, 1.0f), 2.0f) : 1.0f;
+
+        // Calculate ambient lighting
+        vec3 ambient = specularOnly ? vec3(0.0f) : (1.0f - probe.a) * lights[i].colorAmbient.a * lightColor; // Generate ambient light color
+
+        // Calculate diffuse lighting
+        vec3 lightDirection = toLight / distanceToLight; // Calculate distance (light direction) between light source and fragments/pixels on cube
+        float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
+        vec3 diffuse = specularOnly ? vec3(0.0f) : impact * lightColor; // Generate diffuse light color
+
+        // Calculate specular lighting, from the half vector for Blinn-Phong (with four times the exponent for a similar highlight)
+        vec3 specular = vec3(0.0f);
+        if (SPECULAR)
+        {
+            float specularComponent;
+            if (BLINN_PHONG)
+            {
+                vec3 halfwayDir = normalize(lightDirection + viewDir);
+                specularComponent = SpecularPower(max(dot(norm, halfwayDir), 0.0), 4.0f * lights[i].specular.y);
+            }
+            else
+            {
+                vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
+                specularComponent = SpecularPower(max(dot(viewDir, reflectDir), 0.0), lights[i].specular.y);
+            }
+            specular = lights[i].specular.x * specularComponent * lightColor;
+        }
+
+        // Shadowed points keep only the ambient light; the lookup starts a little off the surface to keep it from shadowing itself
+        float shadow = Shadow(toLight - norm * 0.03f, lights[i].specular.w);
+
+        lighting += (ambient + shadow * (diffuse + specular)) * fade;
+    }
+    return lighting;
+}
@@ -0,0 +1,12 @@
+#version 440 core
+
+// Patch Vertex Shader
+
+layout(location = 0) in vec4 patchPoint; // Patch control point from Vertex Attrib Pointer 0
+
+layout(location = 0) out vec4 controlPoint; // For outgoing control point to the tessellation control shader
+
+void main()
+{
+    controlPoint = patchPoint;
+}
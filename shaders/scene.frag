@@ -0,0 +1,38 @@
+#version 440 core
+
+// Fragment Shader, including the lighting shader
+#extension GL_GOOGLE_include_directive : require
+#include "lighting.glsl"
+
+layout(location = 0) in vec3 vertexFragmentPos; // For incoming fragment position
+layout(location = 1) in vec3 vertexNormal; // For incoming normals
+layout(location = 2) in vec2 vertexTextureCoordinate; // For incoming texture coordinate
+
+layout(location = 3) in vec2 vertexLightmapCoordinate; // For incoming lightmap atlas coordinate
+
+layout(location = 0) out vec4 fragmentColor; // For outgoing cube color to the GPU
+
+layout(location = 15, binding = 0) uniform sampler2D uTexture; // Useful when working with multiple textures
+layout(location = 14) uniform vec2 uvScale;
+layout(location = 16, binding = 5) uniform sampler2D lightmap; // Ambient and diffuse light baked for the LIGHTMAP variants
+
+void main()
+{
+    uvec2 cluster = LightCluster(vertexFragmentPos, gl_FragCoord.xy);
+    if (showClusterHeatmap)
+    {
+        fragmentColor = vec4(ClusterHeatmap(cluster.y), 1.0f);
+        return;
+    }
+
+    // Texture holds the color to be used for all three components
+    vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+
+    // Calculate phong result; lightmapped surfaces look up their baked ambient and diffuse light and only add the view
+    // dependent specular highlights
+    vec3 baked = LIGHTMAP ? texture(lightmap, vertexLightmapCoordinate).rgb : vec3(0.0f);
+    vec3 phong = (baked + PhongLighting(vertexFragmentPos, normalize(vertexNormal), cluster, LIGHTMAP)) * textureColor.xyz;
+
+    // Send lighting results to GPU
+    fragmentColor = vec4(phong, 1.0);
+}
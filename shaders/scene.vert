@@ -0,0 +1,52 @@
+#version 440 core
+
+// Vertex Shader
+
+layout(location = 0) in vec3 position; // Vertex data from Vertex Attrib Pointer 0
+layout(location = 1) in vec3 normal; // Normal data from Vertex Attrib Pointer 1
+layout(location = 2) in vec2 textureCoordinate; // Texture data from Vertex Attrib Pointer 2
+layout(location = 3) in mat4 instanceModel; // Per instance transform from Vertex Attrib Pointers 3 to 6
+layout(location = 7) in vec2 instanceShapeHeights; // Per instance front and back height from Vertex Attrib Pointer 7
+layout(location = 8) in vec4 instanceLightmap; // Per instance lightmap scale and offset from Vertex Attrib Pointer 8
+
+layout(location = 0) out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
+layout(location = 1) out vec3 vertexNormal; // For outgoing normals to fragment shader
+layout(location = 2) out vec2 vertexTextureCoordinate; // For outgoing texture coordinate
+layout(location = 3) out vec2 vertexLightmapCoordinate; // For outgoing lightmap atlas coordinate
+
+// Global variables for the  transform matrices
+layout(location = 0) uniform mat4 model;
+layout(location = 4) uniform mat4 view;
+layout(location = 8) uniform mat4 projection;
+layout(location = 12) uniform vec2 shapeHeights; // Front and back height relative to the mesh, (1, 1) leaves it unchanged
+layout(location = 13) uniform bool instanced; // Take the transform and heights from the instance attributes
+
+// Box unwrap of a mesh point into a 3 x 2 grid of faces, as UBoxUnwrap does; the margin is LIGHTMAP_CELL_MARGIN
+vec2 BoxUnwrap(vec3 point, vec3 faceNormal)
+{
+    vec3 a = abs(faceNormal);
+    int face = a.x >= a.y && a.x >= a.z ? (faceNormal.x >= 0.0f ? 0 : 1) : (a.y >= a.z ? (faceNormal.y >= 0.0f ? 2 : 3) : (faceNormal.z >= 0.0f ? 4 : 5));
+    vec2 local = face < 2 ? point.zy : (face < 4 ? point.xz : point.xy);
+    vec2 cell = vec2(face % 3, face / 3);
+    return (cell + 0.03f + (local * 0.5f + 0.5f) * (1.0f - 2.0f * 0.03f)) / vec2(3.0f, 2.0f);
+}
+
+void main()
+{
+    mat4 objectModel = instanced ? instanceModel : model;
+    vec2 heights = instanced ? instanceShapeHeights : shapeHeights;
+
+    // Scale the height above the bottom (y = -1) from the back height to the front height along z, making a wedge of a cube
+    float raise = mix(heights.y, heights.x, (position.z + 1.0f) / 2.0f);
+    vec3 shapePosition = vec3(position.x, -1.0f + (position.y + 1.0f) * raise, position.z);
+
+    // A surface at constant height now slopes along z, tilt its normal to match
+    float slope = (position.y + 1.0f) * (heights.x - heights.y) / 2.0f;
+    vec3 shapeNormal = normalize(vec3(normal.x, normal.y, normal.z - normal.y * slope));
+
+    gl_Position = projection * view * objectModel * vec4(shapePosition, 1.0f); // Transforms vertices to clip coordinates
+    vertexFragmentPos = vec3(objectModel * vec4(shapePosition, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+    vertexNormal = mat3(transpose(inverse(objectModel))) * shapeNormal; // Gets normal vectors in world space only and exclude normal translation properties
+    vertexTextureCoordinate = textureCoordinate; // Gets texture coordinate
+    vertexLightmapCoordinate = instanced ? BoxUnwrap(position, normal) * instanceLightmap.xy + instanceLightmap.zw : vec2(0.0f);
+}
@@ -0,0 +1,13 @@
+#version 440 core
+
+// Shadow Fragment Shader, storing the distance to the light in the depth of a shadow map face
+
+layout(location = 0) in vec3 vertexFragmentPos; // For incoming fragment position
+
+layout(location = 59) uniform vec3 lightPosition;
+layout(location = 27) uniform float shadowFarPlane;
+
+void main()
+{
+    gl_FragDepth = distance(vertexFragmentPos, lightPosition) / shadowFarPlane;
+}